@@ -0,0 +1,37 @@
+import timeit
+
+import spam
+
+try:
+    # The METH_VARARGS baseline, built with cmake -DSPAM_BUILD_VARARGS_BASELINE=ON
+    import spam_varargs
+except ImportError:
+    spam_varargs = None
+
+
+def subtract(x, y):
+    return x - y
+
+
+def ns_per_call(statement, module, number=1_000_000, repeat=5):
+    timer = timeit.Timer(statement, globals={'spam': module, 'ops': spam.ops, 'subtract': subtract})
+    return min(timer.repeat(repeat=repeat, number=number)) / number * 1e9
+
+
+if __name__ == '__main__':
+    benchmarks = [
+        ("add", "spam.add(3, 5)"),
+        ("swap", "spam.swap(3, 5)"),
+        ("do_operation (Python callback)", "spam.do_operation(3, 5, subtract)"),
+        ("do_operation (spam.ops.sub)", "spam.do_operation(3, 5, ops.sub)"),
+    ]
+    if spam_varargs is None:
+        print("spam_varargs is not built, so there is no METH_VARARGS baseline")
+        print(f"{'':<32} {'FASTCALL':>8}")
+    else:
+        print(f"{'':<32} {'FASTCALL':>8} {'VARARGS':>8}   ns/call")
+    for label, statement in benchmarks:
+        line = f"{label:<32} {ns_per_call(statement, spam):8.1f}"
+        if spam_varargs is not None:
+            line += f" {ns_per_call(statement, spam_varargs):8.1f}"
+        print(line)
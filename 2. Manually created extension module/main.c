@@ -22,5 +22,8 @@ int main()
     result = do_operation(x, y, &subtract);
     printf("do_operation(%d, %d, &subtract) gives %d\n", x, y, result);
 
+    result = do_operation(x, y, find_operation("mul"));
+    printf("do_operation(%d, %d, find_operation(\"mul\")) gives %d\n", x, y, result);
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,106 @@
+#define PY_SSIZE_T_CLEAN
+
+/*
+ * The METH_VARARGS entry points that spam had before it moved to METH_FASTCALL,
+ * as a baseline for benchmark.py. Only built with -DSPAM_BUILD_VARARGS_BASELINE=ON.
+ */
+#ifdef _DEBUG
+#undef _DEBUG
+#include <Python.h>
+#define _DEBUG
+#else
+#include <Python.h>
+#endif /* _DEBUG */
+
+#include "spamlib.h"
+
+#define OPERATION_CAPSULE_NAME "spam.operation"
+
+static PyObject * spam_varargs_add(PyObject *self, PyObject *args)
+{
+    int x;
+    int y;
+
+    if (!PyArg_ParseTuple(args, "ii", &x, &y))
+    {
+        return NULL;
+    }
+    return Py_BuildValue("i", add(x, y));
+}
+
+static PyObject * spam_varargs_swap(PyObject *self, PyObject *args)
+{
+    int x;
+    int y;
+
+    if (!PyArg_ParseTuple(args, "ii", &x, &y))
+    {
+        return NULL;
+    }
+    swap(&x, &y);
+    return Py_BuildValue("ii", x, y);
+}
+
+/*
+ * The callback is passed as the context, rather than in a global variable as it was,
+ * which costs the same and keeps the baseline reentrant
+ */
+static int operation_wrapper_func(int x, int y, void *context)
+{
+    int retval = 0;
+    PyObject *result = PyObject_CallFunction((PyObject *) context, "ii", x, y);
+    if (result && PyLong_Check(result))
+    {
+        retval = PyLong_AsLong(result);
+    }
+    Py_XDECREF(result);
+    return retval;
+}
+
+static PyObject * spam_varargs_do_operation(PyObject *self, PyObject *args)
+{
+    int x;
+    int y;
+    PyObject *operation;
+
+    if (!PyArg_ParseTuple(args, "iiO", &x, &y, &operation))
+    {
+        return NULL;
+    }
+    if (PyCapsule_IsValid(operation, OPERATION_CAPSULE_NAME))
+    {
+        operation_func native_operation = (operation_func) PyCapsule_GetPointer(operation, OPERATION_CAPSULE_NAME);
+        return Py_BuildValue("i", do_operation(x, y, native_operation));
+    }
+    if (!PyCallable_Check(operation))
+    {
+        PyErr_SetString(PyExc_TypeError, "operation must be callable or a native operation from spam.ops");
+        return NULL;
+    }
+    int result = do_operation_r(x, y, &operation_wrapper_func, operation);
+    if (PyErr_Occurred())
+    {
+        return NULL;
+    }
+    return Py_BuildValue("i", result);
+}
+
+static PyMethodDef spam_varargs_methods[] = {
+        {"add", spam_varargs_add, METH_VARARGS, "Add two numbers."},
+        {"swap", spam_varargs_swap, METH_VARARGS, "Swap two values."},
+        {"do_operation", spam_varargs_do_operation, METH_VARARGS, "Perform operation on two numbers."},
+        {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static struct PyModuleDef spam_varargs_module = {
+        PyModuleDef_HEAD_INIT,
+        "spam_varargs",
+        NULL,
+        -1,
+        spam_varargs_methods
+};
+
+PyMODINIT_FUNC PyInit_spam_varargs(void)
+{
+    return PyModule_Create(&spam_varargs_module);
+}
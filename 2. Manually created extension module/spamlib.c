@@ -1,5 +1,10 @@
+#include <string.h>
+
 #include "spamlib.h"
 
+#define MAX_OPERATIONS 64
+#define MAX_OPERATION_NAME 32
+
 int add(int a, int b)
 {
     return a + b;
@@ -15,4 +20,97 @@ void swap(int* a, int* b)
 int do_operation(int a, int b, int (*operation)(int a, int b))
 {
     return operation(a, b);
-}
\ No newline at end of file
+}
+
+int do_operation_r(int a, int b, int (*operation)(int a, int b, void* context), void* context)
+{
+    return operation(a, b, context);
+}
+
+/* The registered arithmetic goes through unsigned, so that an overflow wraps around instead of being undefined */
+static int add_operation(int a, int b)
+{
+    return (int) ((unsigned) a + (unsigned) b);
+}
+
+static int sub_operation(int a, int b)
+{
+    return (int) ((unsigned) a - (unsigned) b);
+}
+
+static int mul_operation(int a, int b)
+{
+    return (int) ((unsigned) a * (unsigned) b);
+}
+
+static int min_operation(int a, int b)
+{
+    return a < b ? a : b;
+}
+
+static int max_operation(int a, int b)
+{
+    return a > b ? a : b;
+}
+
+struct registered_operation
+{
+    char name[MAX_OPERATION_NAME];
+    operation_func operation;
+};
+
+static struct registered_operation operations[MAX_OPERATIONS] = {
+        {"add", add_operation},
+        {"sub", sub_operation},
+        {"mul", mul_operation},
+        {"min", min_operation},
+        {"max", max_operation},
+};
+
+static size_t number_of_operations = 5;
+
+operation_func find_operation(const char* name)
+{
+    for (size_t i = 0; i < number_of_operations; ++i)
+    {
+        if (strcmp(operations[i].name, name) == 0)
+        {
+            return operations[i].operation;
+        }
+    }
+    return NULL;
+}
+
+int register_operation(const char* name, operation_func operation)
+{
+    if (strlen(name) >= MAX_OPERATION_NAME)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < number_of_operations; ++i)
+    {
+        if (strcmp(operations[i].name, name) == 0)
+        {
+            operations[i].operation = operation;
+            return 0;
+        }
+    }
+    if (number_of_operations == MAX_OPERATIONS)
+    {
+        return -1;
+    }
+    strcpy(operations[number_of_operations].name, name);
+    operations[number_of_operations].operation = operation;
+    ++number_of_operations;
+    return 0;
+}
+
+size_t operation_count(void)
+{
+    return number_of_operations;
+}
+
+const char* operation_name(size_t index)
+{
+    return index < number_of_operations ? operations[index].name : NULL;
+}
@@ -1,8 +1,30 @@
 #ifndef PYTHON_C_CPP_DEMO2
 #define PYTHON_C_CPP_DEMO2
 
+#include <stddef.h>
+
+typedef int (*operation_func)(int a, int b);
+
 int add(int a, int b);
 void swap(int* a, int* b);
 int do_operation(int a, int b, int (*operation)(int a, int b));
 
+/*
+ * Reentrant variant of do_operation: the context pointer is passed on
+ * to the operation, so callers do not need global state to find their data.
+ */
+int do_operation_r(int a, int b, int (*operation)(int a, int b, void* context), void* context);
+
+/*
+ * Registry of named native operations that can be passed to do_operation.
+ * The registry is filled with add, sub, mul, min and max.
+ * register_operation returns 0 on success, and -1 if the name is too long
+ * or the registry is full. Registering an existing name replaces its operation.
+ * The registry is not thread-safe; register operations before using them concurrently.
+ */
+operation_func find_operation(const char* name);
+int register_operation(const char* name, operation_func operation);
+size_t operation_count(void);
+const char* operation_name(size_t index);
+
 #endif //PYTHON_C_CPP_DEMO2
@@ -12,126 +12,348 @@
 #include <Python.h>
 #endif /* _DEBUG */
 
+#include <limits.h>
+
 #include "spamlib.h"
 
+/* PyObject_Vectorcall is only public since Python 3.9 */
+#if PY_VERSION_HEX < 0x03090000
+#define PyObject_Vectorcall _PyObject_Vectorcall
+#endif
+
+/*
+ * Native operations are passed around as capsules with this name,
+ * that contain a pointer to a C function int (*)(int, int).
+ * Other extension modules can create such capsules for their own C functions,
+ * and register them with spam.register_operation.
+ */
+#define OPERATION_CAPSULE_NAME "spam.operation"
+
+/*
+ * The state of the module.
+ * Every (sub)interpreter that imports spam gets its own copy,
+ * so nothing here may be shared through C global variables.
+ */
+typedef struct
+{
+    PyObject *ops;  /* The spam.ops namespace */
+} spam_state;
+
+static spam_state * get_spam_state(PyObject *module)
+{
+    return (spam_state *) PyModule_GetState(module);
+}
+
+/* Check the number of positional arguments of a METH_FASTCALL function */
+static int check_nargs(const char *name, Py_ssize_t nargs, Py_ssize_t expected)
+{
+    if (nargs != expected)
+    {
+        PyErr_Format(PyExc_TypeError, "%s() takes exactly %zd arguments (%zd given)", name, expected, nargs);
+        return 0;
+    }
+    return 1;
+}
+
+/* Convert a Python object to a C int, with the same range check as the "i" format of PyArg_ParseTuple */
+static int as_int(PyObject *obj, int *value)
+{
+    long result = PyLong_AsLong(obj);
+    if (result == -1 && PyErr_Occurred())
+    {
+        return 0;
+    }
+    if (result > INT_MAX || result < INT_MIN)
+    {
+        PyErr_SetString(PyExc_OverflowError, "Python int too large to convert to C int");
+        return 0;
+    }
+    *value = (int) result;
+    return 1;
+}
+
 /* Wrapper function for the add function in spamlib */
-static PyObject * spam_add(PyObject *self, PyObject *args)
+static PyObject * spam_add(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
     int x;
     int y;
-    int result;
 
-    /* Parse the python objects in args, and store them in the corresponding C variables */
-    if (!PyArg_ParseTuple(args, "ii", &x, &y))
+    /* Convert the python objects in args directly to the corresponding C variables */
+    if (!check_nargs("add", nargs, 2) || !as_int(args[0], &x) || !as_int(args[1], &y))
     {
         return NULL;
     }
 
-    result = add(x, y);
-
     /* Transform the result into a Python int object, and return that. */
-    return Py_BuildValue("i", result);
+    return PyLong_FromLong(add(x, y));
 }
 
 /* Wrapper function for the swap function in spamlib */
-static PyObject * spam_swap(PyObject *self, PyObject *args)
+static PyObject * spam_swap(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
     int x;
     int y;
 
-    /* Parse the python objects in args, and store them in the corresponding C variables */
-    if (!PyArg_ParseTuple(args, "ii", &x, &y))
+    if (!check_nargs("swap", nargs, 2) || !as_int(args[0], &x) || !as_int(args[1], &y))
     {
         return NULL;
     }
 
     swap(&x, &y);
+
     /*
      * Transform the result into a Python tuple, and return that.
      * Note that Python cannot do an inplace replacement of a variable.
+     * The tuple is filled directly. After the swap, x has the value of the second argument
+     * and y that of the first, so exact ints are reused instead of created again.
      */
-    return Py_BuildValue("ii", x, y);
+    PyObject *result = PyTuple_New(2);
+    if (result == NULL)
+    {
+        return NULL;
+    }
+    PyObject *first = PyLong_CheckExact(args[1]) ? (Py_INCREF(args[1]), args[1]) : PyLong_FromLong(x);
+    PyObject *second = PyLong_CheckExact(args[0]) ? (Py_INCREF(args[0]), args[0]) : PyLong_FromLong(y);
+    if (first == NULL || second == NULL)
+    {
+        Py_XDECREF(first);
+        Py_XDECREF(second);
+        Py_DECREF(result);
+        return NULL;
+    }
+    PyTuple_SET_ITEM(result, 0, first);
+    PyTuple_SET_ITEM(result, 1, second);
+    return result;
 }
 
-
 /*
- * Variable to store the Python callback function.
- * Since standard C does not allow nested functions,
- * portability requires this mechanism.
+ * The context of one call to do_operation with a Python callback.
+ * It lives on the stack of spam_do_operation and is passed to spamlib,
+ * so concurrent and nested calls each have their own callback.
  */
-static PyObject *py_callback_func = NULL;
+typedef struct
+{
+    PyObject *callback;
+    int failed;  /* Set when the callback raised an exception */
+} callback_context;
 
 /*
  * Wrapper for the Python callback function.
  * This is the function that is actually offered to the
- * do_operation function in spamlib.
+ * do_operation_r function in spamlib.
  */
-static int operation_wrapper_func(int x, int y)
+static int operation_wrapper_func(int x, int y, void *context)
 {
+    callback_context *ctx = (callback_context *) context;
     int retval = 0;
 
-    /*
-     * Ensure that the callback function stays alive during the call to do_operation.
-     * This is not guaranteed, because the callback is executed in Python,
-     * and in principle the callback function could be deleted during that call.
-     * Incrementing the refcount ensures that the reference will remain valid.
-     */
-    Py_INCREF(py_callback_func);
+    /* Once the callback has failed, the exception is kept and the callback is not called again */
+    if (ctx->failed)
+    {
+        return 0;
+    }
 
-    /* Call the Python callback function. */
-    PyObject *result = PyObject_CallFunction(py_callback_func, "ii", x, y);
-    if (result && PyLong_Check(result))
+    PyObject *args[2] = {PyLong_FromLong(x), PyLong_FromLong(y)};
+    PyObject *result = NULL;
+    if (args[0] != NULL && args[1] != NULL)
+    {
+        /* Call the Python callback function, without packing the arguments in a tuple */
+        result = PyObject_Vectorcall(ctx->callback, args, 2, NULL);
+    }
+    if (result == NULL || !as_int(result, &retval))
     {
-        retval = PyLong_AsLong(result);
+        ctx->failed = 1;
     }
 
     /* Prevent memory leaks! */
-    Py_DECREF(py_callback_func);
+    Py_XDECREF(args[0]);
+    Py_XDECREF(args[1]);
     Py_XDECREF(result);
     return retval;
 }
 
 /* Wrapper function for the do_operation function in spamlib */
-static PyObject * spam_do_operation(PyObject *self, PyObject *args)
+static PyObject * spam_do_operation(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
     int x;
     int y;
 
-    /* Parse the python objects in args, and store them in the corresponding C variables */
-    if (!PyArg_ParseTuple(args, "iiO", &x, &y, &py_callback_func))
+    if (!check_nargs("do_operation", nargs, 3) || !as_int(args[0], &x) || !as_int(args[1], &y))
     {
         return NULL;
     }
+    PyObject *operation = args[2];
+
+    /* A native operation is called directly, without going through Python */
+    if (PyCapsule_IsValid(operation, OPERATION_CAPSULE_NAME))
+    {
+        operation_func native_operation = (operation_func) PyCapsule_GetPointer(operation, OPERATION_CAPSULE_NAME);
+        return PyLong_FromLong(do_operation(x, y, native_operation));
+    }
 
     /* Ensure that the Python callback is callable */
-    if (!PyCallable_Check(py_callback_func))
+    if (!PyCallable_Check(operation))
     {
+        PyErr_SetString(PyExc_TypeError, "operation must be callable or a native operation from spam.ops");
         return NULL;
     }
 
-    int result = do_operation(x, y, &operation_wrapper_func);
-    return Py_BuildValue("i", result);
+    /*
+     * The args array holds a reference to the callback for the duration of this call,
+     * so it stays alive even if the callback deletes the last other reference to itself.
+     */
+    callback_context context = {operation, 0};
+    int result = do_operation_r(x, y, &operation_wrapper_func, &context);
+    if (context.failed)
+    {
+        return NULL;
+    }
+    return PyLong_FromLong(result);
 }
 
-/* The methods of the module.*/
+/*
+ * Register a native operation, and make it available in spam.ops.
+ * The registry of spamlib is shared by the whole process, but spam.ops is per module:
+ * only the interpreter that registers the operation sees it in spam.ops at once;
+ * other (sub)interpreters see it when they import spam afterwards.
+ */
+static PyObject * spam_register_operation(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (!check_nargs("register_operation", nargs, 2))
+    {
+        return NULL;
+    }
+    const char *name = PyUnicode_AsUTF8(args[0]);
+    if (name == NULL)
+    {
+        return NULL;
+    }
+    PyObject *capsule = args[1];
+
+    /* This raises a ValueError if the object is not an operation capsule */
+    operation_func operation = (operation_func) PyCapsule_GetPointer(capsule, OPERATION_CAPSULE_NAME);
+    if (operation == NULL)
+    {
+        return NULL;
+    }
+
+    if (register_operation(name, operation) != 0)
+    {
+        PyErr_Format(PyExc_ValueError, "cannot register operation '%s'", name);
+        return NULL;
+    }
+
+    if (PyObject_SetAttrString(get_spam_state(self)->ops, name, capsule) < 0)
+    {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/*
+ * The methods of the module.
+ * METH_FASTCALL functions receive their arguments as a C array,
+ * which avoids creating an argument tuple for every call.
+ */
 static PyMethodDef spam_methods[] = {
-        {"add", spam_add, METH_VARARGS, "Add two numbers."},
-        {"swap", spam_swap, METH_VARARGS, "Swap two values."},
-        { "do_operation", spam_do_operation, METH_VARARGS, "Perform operation on two numbers."},
+        {"add", (PyCFunction) (void (*)(void)) spam_add, METH_FASTCALL, "Add two numbers."},
+        {"swap", (PyCFunction) (void (*)(void)) spam_swap, METH_FASTCALL, "Swap two values."},
+        { "do_operation", (PyCFunction) (void (*)(void)) spam_do_operation, METH_FASTCALL,
+          "Perform operation on two numbers."},
+        { "register_operation", (PyCFunction) (void (*)(void)) spam_register_operation, METH_FASTCALL,
+          "Register a native operation capsule. The registry is shared by all interpreters of the process, "
+          "but only the spam.ops of the calling interpreter, and those of later imports, show it."},
         {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
+/*
+ * Create the spam.ops namespace, containing a capsule
+ * for each operation in the spamlib registry.
+ */
+static PyObject * create_ops(void)
+{
+    PyObject *ops = PyModule_New("spam.ops");
+    if (ops == NULL)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < operation_count(); ++i)
+    {
+        const char *name = operation_name(i);
+        PyObject *capsule = PyCapsule_New((void *) find_operation(name), OPERATION_CAPSULE_NAME, NULL);
+        if (capsule == NULL || PyModule_AddObject(ops, name, capsule) < 0)
+        {
+            Py_XDECREF(capsule);
+            Py_DECREF(ops);
+            return NULL;
+        }
+    }
+    return ops;
+}
+
+/*
+ * This function executes the module: it is called after the module object
+ * (including its state) has been created, and fills the module.
+ */
+static int spam_exec(PyObject *module)
+{
+    spam_state *state = get_spam_state(module);
+    state->ops = create_ops();
+    if (state->ops == NULL)
+    {
+        return -1;
+    }
+    Py_INCREF(state->ops);
+    if (PyModule_AddObject(module, "ops", state->ops) < 0)
+    {
+        Py_DECREF(state->ops);
+        return -1;
+    }
+    return 0;
+}
+
+/* The state holds Python references, so it takes part in garbage collection */
+static int spam_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    Py_VISIT(get_spam_state(module)->ops);
+    return 0;
+}
+
+static int spam_clear(PyObject *module)
+{
+    Py_CLEAR(get_spam_state(module)->ops);
+    return 0;
+}
+
+static void spam_free(void *module)
+{
+    spam_clear((PyObject *) module);
+}
+
+static PyModuleDef_Slot spam_slots[] = {
+        {Py_mod_exec, spam_exec},
+        {0, NULL}  /* Sentinel */
+};
+
 /* The actual definition of the module */
 static struct PyModuleDef spammodule = {
         PyModuleDef_HEAD_INIT,
         "spam",  /* name of the module */
         NULL,  /* module documentation, may be NULL */
-        -1,  /* size of per-interpreter state of the module, or -1 if module keeps state in global variables. */
-        spam_methods
+        sizeof(spam_state),  /* size of per-interpreter state of the module, or -1 if module keeps state in global variables. */
+        spam_methods,
+        spam_slots,  /* multi-phase initialization */
+        spam_traverse,
+        spam_clear,
+        spam_free
 };
 
-/* This is the initialization function that is called when the module is loaded */
+/*
+ * This is the initialization function that is called when the module is loaded.
+ * With multi-phase initialization it only returns the definition;
+ * Python creates the module object and then calls spam_exec.
+ */
 PyMODINIT_FUNC PyInit_spam(void)
 {
-    return PyModule_Create(&spammodule);
+    return PyModuleDef_Init(&spammodule);
 }
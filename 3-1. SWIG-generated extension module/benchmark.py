@@ -0,0 +1,32 @@
+import array
+import timeit
+
+import spam
+
+
+def subtract(x, y):
+    return x - y
+
+
+def ns_per_call(statement, number=200_000, repeat=5):
+    timer = timeit.Timer(statement, globals=globals())
+    return min(timer.repeat(repeat=repeat, number=number)) / number * 1e9
+
+
+if __name__ == '__main__':
+    n = 100_000
+    x = array.array('i', range(n))
+    y = array.array('i', range(n, 2 * n))
+    out = array.array('i', bytes(x.itemsize * n))
+
+    benchmarks = [
+        ("add", "spam.add(3, 5)"),
+        ("swap", "spam.swap(3, 5)"),
+        ("do_operation (Python callback)", "spam.do_operation(3, 5, subtract)"),
+        ("do_operation (spam.add)", "spam.do_operation(3, 5, spam.add)"),
+        ("do_operation (spam.ops.sub)", "spam.do_operation(3, 5, spam.ops.sub)"),
+    ]
+    for label, statement in benchmarks:
+        print(f"{label:<32} {ns_per_call(statement):10.1f} ns/call")
+    print(f"{'add_arrays (' + str(n) + ' elements)':<32} "
+          f"{ns_per_call('spam.add_arrays(x, y, out)', number=1000):10.1f} ns/call")
@@ -19,3 +19,6 @@ if __name__ == '__main__':
 
     result = spam.do_operation(x, y, subtract)
     print(f"do_operation({x}, {y}, subtract) gives {result}")
+
+    result = spam.do_operation(x, y, spam.ops.sub)
+    print(f"do_operation({x}, {y}, spam.ops.sub) gives {result}")
@@ -1,4 +1,4 @@
-%module(directors="1") spam
+%module spam
 
 %include "typemaps.i"
 
@@ -7,47 +7,298 @@
 %}
 
 %{
+#include <climits>
+#include <cstdint>
+
 /* Include header file in generated wrapper code */
 #include "spamlib.h"
+
+/*
+ * Native operations are passed around as capsules with this name,
+ * that contain a pointer to a C function int (*)(int, int).
+ * Other extension modules can create such capsules for their own functions,
+ * and register them with spam.register_operation.
+ */
+#define OPERATION_CAPSULE_NAME "spam.operation"
+
+/* Thrown when a Python callback raised an exception, which is then still set */
+struct PythonCallbackError {};
+
+/*
+ * Calls a Python callable as a std::function<int(int, int)>.
+ * It holds a reference to the callable, so the callable stays alive
+ * as long as the std::function (or one of its copies) exists.
+ */
+class PythonOperation
+{
+public:
+    explicit PythonOperation(PyObject* callable) : callable_(callable) { Py_INCREF(callable_); }
+    PythonOperation(const PythonOperation& other) : callable_(other.callable_) { Py_INCREF(callable_); }
+    PythonOperation& operator=(const PythonOperation&) = delete;
+    ~PythonOperation() { Py_DECREF(callable_); }
+
+    int operator()(int a, int b) const {
+        PyObject* result = PyObject_CallFunction(callable_, "ii", a, b);
+        if (result == NULL) {
+            throw PythonCallbackError();
+        }
+        long value = PyLong_AsLong(result);
+        Py_DECREF(result);
+        if (value == -1 && PyErr_Occurred()) {
+            throw PythonCallbackError();
+        }
+        if (value < INT_MIN || value > INT_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "Python int too large to convert to C int");
+            throw PythonCallbackError();
+        }
+        return static_cast<int>(value);
+    }
+
+private:
+    PyObject* callable_;
+};
+
+/*
+ * Convert a Python object to an operation. Native operations are used directly:
+ * spamlib functions wrapped by SWIG as callbacks (such as spam.add),
+ * and operation capsules (such as spam.ops.sub).
+ * Any other callable is called through PythonOperation.
+ * function_type is the SWIG type descriptor of int (*)(int, int).
+ * Returns false, with a Python exception set, if the object is not an operation.
+ */
+static bool operation_from_python(PyObject* obj, swig_type_info* function_type,
+                                  std::function<int(int, int)>& operation) {
+    void* pointer = NULL;
+    if (SWIG_IsOK(SWIG_ConvertFunctionPtr(obj, &pointer, function_type))) {
+        operation = reinterpret_cast<operation_func>(pointer);
+        return true;
+    }
+    if (PyCapsule_IsValid(obj, OPERATION_CAPSULE_NAME)) {
+        operation = reinterpret_cast<operation_func>(PyCapsule_GetPointer(obj, OPERATION_CAPSULE_NAME));
+        return true;
+    }
+    if (PyCallable_Check(obj)) {
+        operation = PythonOperation(obj);
+        return true;
+    }
+    PyErr_SetString(PyExc_TypeError, "operation must be callable or a native operation from spam.ops");
+    return false;
+}
+
+/*
+ * Get the data of a contiguous buffer of C ints. Objects exposing raw bytes
+ * (bytearray, bytes, memoryview of those, with format 'B') are reinterpreted as native ints;
+ * other single-byte formats are numbers of their own, and are rejected.
+ * Like SWIG's own pybuffer.i, the buffer is released right away:
+ * the argument keeps the object alive for the duration of the call.
+ * Returns false, with a Python exception set, on failure.
+ */
+static bool get_int_buffer(PyObject* obj, bool writable, int** data, size_t* size) {
+    Py_buffer view;
+    int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0);
+    if (PyObject_GetBuffer(obj, &view, flags) < 0) {
+        return false;
+    }
+    std::string format = view.format ? view.format : "B";
+    if (!format.empty() && (format[0] == '@' || format[0] == '=')) {
+        format.erase(0, 1);
+    }
+    bool int_items = view.itemsize == sizeof(int) && format == "i";
+    bool byte_items = view.itemsize == 1 && format == "B";
+    bool ok = false;
+    if (!int_items && !byte_items) {
+        PyErr_Format(PyExc_TypeError, "buffer must contain C ints or raw bytes, not format '%s'", format.c_str());
+    } else if (view.len % sizeof(int) != 0) {
+        PyErr_SetString(PyExc_ValueError, "buffer size is not a multiple of the size of a C int");
+    } else {
+        *data = static_cast<int*>(view.buf);
+        *size = static_cast<size_t>(view.len) / sizeof(int);
+        ok = true;
+    }
+    PyBuffer_Release(&view);
+    return ok;
+}
+
+/*
+ * The array functions allow arrays that are identical, or do not overlap at all.
+ * Returns false, with a Python exception set, for arrays that overlap partially.
+ */
+static bool check_no_partial_overlap(const int* a, size_t a_size, const int* b, size_t b_size) {
+    uintptr_t a_begin = reinterpret_cast<uintptr_t>(a);
+    uintptr_t b_begin = reinterpret_cast<uintptr_t>(b);
+    uintptr_t a_end = a_begin + a_size * sizeof(int);
+    uintptr_t b_end = b_begin + b_size * sizeof(int);
+    if (a_begin != b_begin && a_begin < b_end && b_begin < a_end) {
+        PyErr_SetString(PyExc_ValueError, "arrays must be identical or not overlap");
+        return false;
+    }
+    return true;
+}
 %}
 
+/*
+ * Typemaps that convert a Python callable to std::function<int(int, int)>.
+ * This replaces a director class, which had to be created (and stored in a global)
+ * on every call of do_operation.
+ */
+%typemap(in) std::function<int(int, int)> {
+    if (!operation_from_python($input, $descriptor(int (*)(int, int)), $1)) {
+        SWIG_fail;
+    }
+}
+
+%typemap(typecheck, precedence=SWIG_TYPECHECK_POINTER) std::function<int(int, int)> {
+    $1 = PyCallable_Check($input) || PyCapsule_IsValid($input, OPERATION_CAPSULE_NAME);
+}
+
+/* An exception raised by a Python callback is passed on to the caller */
+%exception do_operation {
+    try {
+        $action
+    } catch (const PythonCallbackError&) {
+        SWIG_fail;
+    }
+}
+
+/*
+ * Typemaps for arrays of C ints, with the signatures of numpy.i,
+ * implemented with the buffer protocol. This works for numpy arrays,
+ * array.array, bytearray and memoryview, without depending on numpy.
+ */
+%typemap(in) (const int* IN_ARRAY1, size_t DIM1) {
+    int* data;
+    if (!get_int_buffer($input, false, &data, &$2)) {
+        SWIG_fail;
+    }
+    $1 = data;
+}
+
+%typemap(in) (int* INPLACE_ARRAY1, size_t DIM1) {
+    if (!get_int_buffer($input, true, &$1, &$2)) {
+        SWIG_fail;
+    }
+}
+
+%apply (const int* IN_ARRAY1, size_t DIM1) { (const int* a, size_t a_size), (const int* b, size_t b_size) };
+%apply (int* INPLACE_ARRAY1, size_t DIM1) { (int* x, size_t x_size), (int* y, size_t y_size),
+                                             (int* result, size_t result_size) };
+
 /* Specify the Python-callable wrappers */
+%callback("%s");
 extern int add(int, int);
+%nocallback;
 extern void swap(int& INOUT, int& INOUT);
+extern int do_operation(int a, int b, std::function<int(int, int)> operator_func);
+extern const char* array_kernel_name();
 
-%feature("director") _OperationFuncClass;
-
+/*
+ * Array helpers. These return a Python object,
+ * or NULL with a Python exception set, which the SWIG wrapper passes on as is.
+ */
 %inline %{
-struct _OperationFuncClass {
-    virtual int operation_method(int a, int b) = 0;
-    virtual ~_OperationFuncClass() {}
-};
-%}
+PyObject* _add_arrays(const int* a, size_t a_size, const int* b, size_t b_size, int* result, size_t result_size) {
+    if (a_size != b_size || a_size != result_size) {
+        PyErr_SetString(PyExc_ValueError, "arrays must have the same number of elements");
+        return NULL;
+    }
+    if (!check_no_partial_overlap(a, a_size, result, result_size)
+            || !check_no_partial_overlap(b, b_size, result, result_size)) {
+        return NULL;
+    }
+    add_arrays(a, b, result, a_size);
+    Py_RETURN_NONE;
+}
 
-%{
-static _OperationFuncClass *operation_func_class_ptr = NULL;
+PyObject* _add_arrays_inplace(int* x, size_t x_size, const int* b, size_t b_size) {
+    if (x_size != b_size) {
+        PyErr_SetString(PyExc_ValueError, "arrays must have the same number of elements");
+        return NULL;
+    }
+    if (!check_no_partial_overlap(x, x_size, b, b_size)) {
+        return NULL;
+    }
+    add_arrays(x, b, x_size);
+    Py_RETURN_NONE;
+}
 
-static int operation_helper(int a, int b) {
-    return operation_func_class_ptr->operation_method(a, b);
+PyObject* _swap_arrays(int* x, size_t x_size, int* y, size_t y_size) {
+    if (x_size != y_size) {
+        PyErr_SetString(PyExc_ValueError, "arrays must have the same number of elements");
+        return NULL;
+    }
+    if (!check_no_partial_overlap(x, x_size, y, y_size)) {
+        return NULL;
+    }
+    swap_arrays(x, y, x_size);
+    Py_RETURN_NONE;
 }
 %}
 
+/*
+ * Helpers for native operations. These return a Python object,
+ * or NULL with a Python exception set, which the SWIG wrapper passes on as is.
+ */
 %inline %{
-int _operation_wrapper(int a, int b, _OperationFuncClass *operation_func_class) {
-    operation_func_class_ptr = operation_func_class;
-    int result = do_operation(a, b, &operation_helper);
-    operation_func_class_ptr = NULL;
-    return result;
+PyObject* _operation_names() {
+    PyObject* names = PyList_New(0);
+    for (const auto& name : operation_names()) {
+        PyObject* py_name = PyUnicode_FromString(name.c_str());
+        if (py_name == NULL || PyList_Append(names, py_name) < 0) {
+            Py_XDECREF(py_name);
+            Py_DECREF(names);
+            return NULL;
+        }
+        Py_DECREF(py_name);
+    }
+    return names;
+}
+
+PyObject* _operation_capsule(const char* name) {
+    operation_func operation = find_operation(name);
+    if (operation == NULL) {
+        PyErr_Format(PyExc_KeyError, "unknown operation '%s'", name);
+        return NULL;
+    }
+    return PyCapsule_New(reinterpret_cast<void*>(operation), OPERATION_CAPSULE_NAME, NULL);
+}
+
+PyObject* _register_operation(const char* name, PyObject* capsule) {
+    void* pointer = PyCapsule_GetPointer(capsule, OPERATION_CAPSULE_NAME);
+    if (pointer == NULL) {
+        return NULL;
+    }
+    register_operation(name, reinterpret_cast<operation_func>(pointer));
+    Py_RETURN_NONE;
 }
 %}
 
 %pythoncode
 %{
-def do_operation(x, y, operation_func):
-    class PythonOperation(_OperationFuncClass):
-        def operation_method(self, a, b):
-            return operation_func(a, b)
-    python_operation_object = PythonOperation()
-    return _operation_wrapper(x, y, python_operation_object)
-%}
+import types as _types
+
+ops = _types.SimpleNamespace(**{_name: _operation_capsule(_name) for _name in _operation_names()})
+
+
+def register_operation(name, operation):
+    _register_operation(name, operation)
+    setattr(ops, name, operation)
+
 
+def add_arrays(x, y, out=None):
+    """Add two int arrays element-wise. The result is written to 'out',
+    or to a new memoryview if 'out' is None"""
+    if out is None:
+        out = memoryview(bytearray(len(memoryview(x).cast('B')))).cast('i')
+    _add_arrays(x, y, out)
+    return out
+
+
+def add_arrays_inplace(x, y):
+    """Add int array y element-wise to int array x"""
+    _add_arrays_inplace(x, y)
+
+
+def swap_arrays(x, y):
+    """Swap the contents of two int arrays"""
+    _swap_arrays(x, y)
+%}
@@ -1,5 +1,30 @@
 #include "spamlib.h"
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SPAMLIB_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+/*
+ * GCC and Clang only allow AVX2 intrinsics in functions that are compiled for AVX2.
+ * Marking the kernels this way keeps the rest of the library at the baseline
+ * instruction set, so the runtime dispatch below decides what actually runs.
+ */
+#if defined(SPAMLIB_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SPAMLIB_TARGET_AVX2 __attribute__((target("avx2")))
+#define SPAMLIB_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define SPAMLIB_TARGET_AVX2
+#define SPAMLIB_TARGET_SSE2
+#endif
+
 int add(int a, int b)
 {
     return a + b;
@@ -16,3 +41,196 @@ int do_operation(int a, int b, std::function<int(int, int)> operator_func)
 {
     return operator_func(a, b);
 }
+
+namespace
+{
+struct OperationRegistry
+{
+    std::mutex mutex;
+    std::map<std::string, operation_func> operations{
+            /* Through unsigned, so that an overflow wraps around instead of being undefined */
+            {"add", [](int a, int b) { return static_cast<int>(static_cast<unsigned>(a) + static_cast<unsigned>(b)); }},
+            {"sub", [](int a, int b) { return static_cast<int>(static_cast<unsigned>(a) - static_cast<unsigned>(b)); }},
+            {"mul", [](int a, int b) { return static_cast<int>(static_cast<unsigned>(a) * static_cast<unsigned>(b)); }},
+            {"min", [](int a, int b) { return std::min(a, b); }},
+            {"max", [](int a, int b) { return std::max(a, b); }},
+    };
+};
+
+OperationRegistry& registry()
+{
+    static OperationRegistry instance;
+    return instance;
+}
+}
+
+operation_func find_operation(const std::string& name)
+{
+    auto& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    auto found = reg.operations.find(name);
+    return found == reg.operations.end() ? nullptr : found->second;
+}
+
+void register_operation(const std::string& name, operation_func operation)
+{
+    auto& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.operations[name] = operation;
+}
+
+std::vector<std::string> operation_names()
+{
+    auto& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    std::vector<std::string> names;
+    for (const auto& entry : reg.operations)
+    {
+        names.push_back(entry.first);
+    }
+    return names;
+}
+
+namespace
+{
+using AddKernel = void (*)(const int* a, const int* b, int* result, std::size_t n);
+using SwapKernel = void (*)(int* a, int* b, std::size_t n);
+
+struct ArrayKernels
+{
+    const char* name;
+    AddKernel add;
+    SwapKernel swap;
+};
+
+/* The vector kernels wrap around on overflow, so the scalar kernel does the same */
+void add_scalar(const int* a, const int* b, int* result, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        result[i] = static_cast<int>(static_cast<unsigned>(a[i]) + static_cast<unsigned>(b[i]));
+    }
+}
+
+void swap_scalar(int* a, int* b, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        swap(a[i], b[i]);
+    }
+}
+
+#if defined(SPAMLIB_X86)
+SPAMLIB_TARGET_SSE2 void add_sse2(const int* a, const int* b, int* result, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(result + i), _mm_add_epi32(va, vb));
+    }
+    add_scalar(a + i, b + i, result + i, n - i);
+}
+
+SPAMLIB_TARGET_SSE2 void swap_sse2(int* a, int* b, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(a + i), vb);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(b + i), va);
+    }
+    swap_scalar(a + i, b + i, n - i);
+}
+
+SPAMLIB_TARGET_AVX2 void add_avx2(const int* a, const int* b, int* result, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i va0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i va1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i + 8));
+        __m256i vb1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i + 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(result + i), _mm256_add_epi32(va0, vb0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(result + i + 8), _mm256_add_epi32(va1, vb1));
+    }
+    add_sse2(a + i, b + i, result + i, n - i);
+}
+
+SPAMLIB_TARGET_AVX2 void swap_avx2(int* a, int* b, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(a + i), vb);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(b + i), va);
+    }
+    swap_sse2(a + i, b + i, n - i);
+}
+
+bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return false;
+    }
+    /* AVX2 also requires the OS to save the YMM registers on a context switch */
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 0x6) == 0x6);
+    __cpuidex(info, 7, 0);
+    return os_saves_ymm && (info[1] & (1 << 5));
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+ArrayKernels select_kernels()
+{
+#if defined(SPAMLIB_X86)
+    if (cpu_has_avx2())
+    {
+        return {"avx2", add_avx2, swap_avx2};
+    }
+    return {"sse2", add_sse2, swap_sse2};
+#else
+    return {"scalar", add_scalar, swap_scalar};
+#endif
+}
+
+const ArrayKernels& kernels()
+{
+    static const ArrayKernels selected = select_kernels();
+    return selected;
+}
+}
+
+void add_arrays(const int* a, const int* b, int* result, std::size_t n)
+{
+    kernels().add(a, b, result, n);
+}
+
+void add_arrays(int* a, const int* b, std::size_t n)
+{
+    kernels().add(a, b, a, n);
+}
+
+void swap_arrays(int* a, int* b, std::size_t n)
+{
+    kernels().swap(a, b, n);
+}
+
+const char* array_kernel_name()
+{
+    return kernels().name;
+}
@@ -1,10 +1,37 @@
 #ifndef PYTHON_C_CPP
 #define PYTHON_C_CPP
 
+#include <cstddef>
 #include <functional>
+#include <string>
+#include <vector>
+
+using operation_func = int (*)(int a, int b);
 
 int add(int a, int b);
 void swap(int& a, int& b);
 int do_operation(int a, int b, std::function<int(int, int)> operator_func);
 
+/*
+ * Element-wise variants of add and swap, operating on arrays of n elements.
+ * The in-place add stores the result in a. Arrays may be identical,
+ * but must not partially overlap.
+ */
+void add_arrays(const int* a, const int* b, int* result, std::size_t n);
+void add_arrays(int* a, const int* b, std::size_t n);
+void swap_arrays(int* a, int* b, std::size_t n);
+
+/* Name of the instruction set selected at runtime for the array functions */
+const char* array_kernel_name();
+
+/*
+ * Registry of named native operations that can be passed to do_operation.
+ * The registry is filled with add, sub, mul, min and max.
+ * find_operation returns nullptr for an unknown name.
+ * Registering an existing name replaces its operation.
+ */
+operation_func find_operation(const std::string& name);
+void register_operation(const std::string& name, operation_func operation);
+std::vector<std::string> operation_names();
+
 #endif //PYTHON_C_CPP
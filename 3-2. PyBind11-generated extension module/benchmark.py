@@ -0,0 +1,81 @@
+import array
+import asyncio
+import random
+import time
+
+import spam
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+
+def elements_per_second(func, n, repeat=5):
+    best = min(timed(func) for _ in range(repeat))
+    return n / best
+
+
+def timed(func):
+    start = time.perf_counter()
+    func()
+    return time.perf_counter() - start
+
+
+def report(label, rate, baseline=None):
+    speedup = f" ({rate / baseline:8.1f}x)" if baseline else ""
+    print(f"{label:<40} {rate:16,.0f} elements/s{speedup}")
+
+
+async def run_async_operations(n, operation):
+    await asyncio.gather(*(spam.do_operation_async(i, i, operation) for i in range(n)))
+
+
+if __name__ == '__main__':
+    n = 1_000_000
+    values = [random.randint(-2**20, 2**20) for _ in range(2 * n)]
+    x = array.array('i', values[:n])
+    y = array.array('i', values[n:])
+    out = array.array('i', bytes(x.itemsize * n))
+
+    print(f"Array kernel: {spam.array_kernel}, {n:,} elements")
+
+    scalar = elements_per_second(lambda: [spam.add(a, b) for a, b in zip(x, y)], n)
+    report("spam.add loop", scalar)
+    report("spam.add_arrays(array.array)", elements_per_second(lambda: spam.add_arrays(x, y, out), n), scalar)
+    report("spam.add_arrays_inplace(array.array)", elements_per_second(lambda: spam.add_arrays_inplace(x, y), n), scalar)
+    report("spam.swap_arrays(array.array)", elements_per_second(lambda: spam.swap_arrays(x, y), n), scalar)
+
+    for threads in (1, 2, 4, 8, 16, 32):
+        report(f"spam.parallel_map(ops.sub, threads={threads})",
+               elements_per_second(lambda: spam.parallel_map(x, y, spam.ops.sub, threads=threads, out=out), n), scalar)
+    report("spam.reduce(ops.max)", elements_per_second(lambda: spam.reduce(x, spam.ops.max), n), scalar)
+
+    in_flight = 10_000
+    report(f"spam.do_operation_async(ops.sub), {in_flight:,} in flight",
+           elements_per_second(lambda: asyncio.run(run_async_operations(in_flight, spam.ops.sub)), in_flight),
+           scalar)
+
+    # The element type comes from the buffer format, so raw bytes are cast to C ints
+    raw_x = memoryview(bytearray(x.tobytes())).cast('i')
+    raw_y = memoryview(bytearray(y.tobytes())).cast('i')
+    report("spam.add_arrays_inplace(bytearray)",
+           elements_per_second(lambda: spam.add_arrays_inplace(raw_x, raw_y), n), scalar)
+
+    if numpy is not None:
+        nx = numpy.frombuffer(x, dtype=numpy.intc).copy()
+        ny = numpy.frombuffer(y, dtype=numpy.intc).copy()
+        nout = numpy.empty_like(nx)
+        report("spam.add_arrays(numpy)", elements_per_second(lambda: spam.add_arrays(nx, ny, nout), n), scalar)
+        report("numpy.add", elements_per_second(lambda: numpy.add(nx, ny, out=nout), n), scalar)
+
+        def subtract(a, b):
+            return a - b
+
+        def subtract_chunk(a, b):
+            return numpy.subtract(a, b)
+
+        callback = elements_per_second(lambda: [spam.do_operation(a, b, subtract) for a, b in zip(x, y)], n)
+        report("spam.do_operation loop", callback)
+        report("spam.do_operation_batch(numpy op)",
+               elements_per_second(lambda: spam.do_operation_batch(nx, ny, subtract_chunk, out=nout), n), callback)
@@ -1,3 +1,6 @@
+import array
+import asyncio
+
 import spam
 
 
@@ -6,6 +9,15 @@ def subtract(x, y):
     return x - y
 
 
+async def do_operations_async(x, y):
+    result = await spam.do_operation_async(x, y, subtract)
+    print(f"await do_operation_async({x}, {y}, subtract) gives {result}")
+
+    # Many operations can be in flight at once; their results reach the event loop in batches
+    results = await asyncio.gather(*(spam.do_operation_async(i, y, spam.ops.mul) for i in range(1000)))
+    print(f"1000 concurrent do_operation_async(i, {y}, spam.ops.mul) give a sum of {sum(results)}")
+
+
 if __name__ == '__main__':
     x = 3
     y = 5
@@ -19,3 +31,24 @@ if __name__ == '__main__':
 
     result = spam.do_operation(x, y, subtract)
     print(f"do_operation({x}, {y}, subtract) gives {result}")
+
+    result = spam.do_operation(x, y, spam.ops.sub)
+    print(f"do_operation({x}, {y}, spam.ops.sub) gives {result}")
+
+    asyncio.run(do_operations_async(x, y))
+
+    ids = array.array('q', [2 ** 40, 2 ** 41])
+    offsets = array.array('q', [1, 2])
+    print(f"spam.add_arrays on 64-bit ints gives {list(spam.add_arrays(ids, offsets))}")
+
+    values = array.array('d', [0.5, 1.25])
+    print(f"spam.add_arrays on doubles gives {list(spam.add_arrays(values, values))}")
+
+    small = array.array('b', [100, -100])
+    result = spam.add_arrays(small, small, overflow=spam.Overflow.SATURATE)
+    print(f"spam.add_arrays on int8 with Overflow.SATURATE gives {list(result)}")
+
+    # A bytearray holds C ints for add_arrays, and bytes for add_typed_arrays
+    raw = bytearray(array.array('i', [1, 2]).tobytes())
+    print(f"spam.add_arrays on a bytearray of C ints gives {list(spam.add_arrays(raw, raw))}")
+    print(f"spam.add_typed_arrays on a bytearray gives {list(spam.add_typed_arrays(raw, raw))}")
@@ -1,3 +1,4 @@
+#include <cstdint>
 #include <cstdio>
 #include "spamlib.h"
 
@@ -22,5 +23,17 @@ int main()
     result = do_operation(x, y, subtract);
     printf("do_operation(%d, %d, subtract) gives %d\n", x, y, result);
 
+    result = do_operation(x, y, find_operation("mul"));
+    printf("do_operation(%d, %d, find_operation(\"mul\")) gives %d\n", x, y, result);
+
+    std::int64_t id = std::int64_t(1) << 40;
+    printf("spamlib.add<int64_t>(%lld, 1) gives %lld\n", static_cast<long long>(id),
+           static_cast<long long>(add<std::int64_t>(id, 1)));
+
+    printf("spamlib.add<double>(0.5, 1.25) gives %g\n", add(0.5, 1.25));
+
+    std::int8_t small = add<std::int8_t, Overflow::Saturate>(100, 100);
+    printf("spamlib.add<int8_t, Overflow::Saturate>(100, 100) gives %d\n", small);
+
     return 0;
 }
@@ -1,18 +1,751 @@
 #include "pybind11/pybind11.h"
 #include "pybind11/functional.h"
 
+#include <algorithm>
+#include <bit>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
 #include "spamlib.h"
 
 namespace py = pybind11;
 
 using namespace py::literals;
 
+namespace
+{
+/*
+ * Native operations are passed around as capsules with this name,
+ * that contain a pointer to a C function int (*)(int, int).
+ * Other extension modules can create such capsules for their own functions,
+ * and register them with spam.register_operation.
+ */
+constexpr const char* operation_capsule_name = "spam.operation";
+
+py::capsule make_operation_capsule(operation_func operation)
+{
+    return py::capsule(reinterpret_cast<void*>(operation), operation_capsule_name);
+}
+
+operation_func operation_from_capsule(const py::capsule& capsule)
+{
+    void* pointer = PyCapsule_GetPointer(capsule.ptr(), operation_capsule_name);
+    if (pointer == nullptr)
+    {
+        throw py::error_already_set();
+    }
+    return reinterpret_cast<operation_func>(pointer);
+}
+
+/*
+ * A one-dimensional, contiguous view on the ints in a Python buffer.
+ * The buffer_info keeps the buffer exported (and thus the memory pinned)
+ * for as long as the view exists, so no data needs to be copied.
+ */
+struct IntBuffer
+{
+    py::buffer_info info;
+    int* data;
+    std::size_t size;
+};
+
+bool is_int_format(const std::string& format)
+{
+    std::string code = (!format.empty() && (format[0] == '@' || format[0] == '=')) ? format.substr(1) : format;
+    return code == "i" || code == "l";
+}
+
+/*
+ * Objects exposing raw bytes (bytearray, bytes, memoryview of those)
+ * are reinterpreted as native ints. Only unsigned bytes count as raw:
+ * the other single-byte formats are numbers of their own.
+ */
+bool is_byte_format(const std::string& format)
+{
+    std::string code = (!format.empty() && (format[0] == '@' || format[0] == '=')) ? format.substr(1) : format;
+    return code == "B";
+}
+
+IntBuffer request_int_buffer(const py::buffer& buffer, bool writable)
+{
+    py::buffer_info info = buffer.request(writable);
+    if (info.ndim != 1 || info.strides[0] != info.itemsize)
+    {
+        throw py::value_error("buffer must be one-dimensional and contiguous");
+    }
+    bool int_items = info.itemsize == sizeof(int) && is_int_format(info.format);
+    if (!int_items && !(info.itemsize == 1 && is_byte_format(info.format)))
+    {
+        throw py::type_error("buffer must contain C ints or raw bytes, not format '" + info.format + "'");
+    }
+    std::size_t bytes = static_cast<std::size_t>(info.size * info.itemsize);
+    if (bytes % sizeof(int) != 0)
+    {
+        throw py::value_error("buffer size is not a multiple of the size of a C int");
+    }
+    auto data = static_cast<int*>(info.ptr);
+    return {std::move(info), data, bytes / sizeof(int)};
+}
+
+void check_same_size(const IntBuffer& a, const IntBuffer& b)
+{
+    if (a.size != b.size)
+    {
+        throw py::value_error("arrays must have the same number of elements");
+    }
+}
+
+/* A new memoryview of n items of the given struct format, backed by a bytearray */
+py::object new_array(std::size_t n, std::size_t itemsize, const std::string& format)
+{
+    auto storage = py::reinterpret_steal<py::object>(
+            PyByteArray_FromStringAndSize(nullptr, static_cast<Py_ssize_t>(n * itemsize)));
+    if (!storage)
+    {
+        throw py::error_already_set();
+    }
+    auto view = py::reinterpret_steal<py::object>(PyMemoryView_FromObject(storage.ptr()));
+    if (!view)
+    {
+        throw py::error_already_set();
+    }
+    return view.attr("cast")(format);
+}
+
+/* A new memoryview of n C ints */
+py::object new_int_array(std::size_t n)
+{
+    return new_array(n, sizeof(int), "i");
+}
+
+/*
+ * Element types of the typed array functions. A buffer gets its type from
+ * its struct format, so a numpy array, array.array or memoryview.cast
+ * selects the instantiation of spamlib that is used for the whole array.
+ */
+enum class Dtype
+{
+    Int8,
+    Int16,
+    Int32,
+    Int64,
+    UInt8,
+    UInt16,
+    UInt32,
+    UInt64,
+    Float32,
+    Float64
+};
+
+/* Whether a struct format prefix selects the native byte order */
+bool is_native_byte_order(char prefix)
+{
+    bool little = std::endian::native == std::endian::little;
+    return prefix == '@' || prefix == '=' || prefix == (little ? '<' : '>') || (!little && prefix == '!');
+}
+
+Dtype dtype_from_format(const std::string& format, py::ssize_t itemsize)
+{
+    std::string code = (!format.empty() && is_native_byte_order(format[0])) ? format.substr(1) : format;
+    if (code.size() == 1)
+    {
+        bool is_signed = std::string("bhilqn").find(code[0]) != std::string::npos;
+        bool is_unsigned = std::string("BHILQN").find(code[0]) != std::string::npos;
+        if (code[0] == 'f' && itemsize == 4)
+        {
+            return Dtype::Float32;
+        }
+        if (code[0] == 'd' && itemsize == 8)
+        {
+            return Dtype::Float64;
+        }
+        if (is_signed || is_unsigned)
+        {
+            switch (itemsize)
+            {
+                case 1:
+                    return is_signed ? Dtype::Int8 : Dtype::UInt8;
+                case 2:
+                    return is_signed ? Dtype::Int16 : Dtype::UInt16;
+                case 4:
+                    return is_signed ? Dtype::Int32 : Dtype::UInt32;
+                case 8:
+                    return is_signed ? Dtype::Int64 : Dtype::UInt64;
+                default:
+                    break;
+            }
+        }
+    }
+    throw py::type_error("buffer must contain integers or floating point numbers, not format '" + format + "'");
+}
+
+/* Calls function with a value of the C++ type of dtype, which selects the instantiation */
+template<typename Function>
+void visit_dtype(Dtype dtype, Function&& function)
+{
+    switch (dtype)
+    {
+        case Dtype::Int8:
+            return function(std::int8_t());
+        case Dtype::Int16:
+            return function(std::int16_t());
+        case Dtype::Int32:
+            return function(std::int32_t());
+        case Dtype::Int64:
+            return function(std::int64_t());
+        case Dtype::UInt8:
+            return function(std::uint8_t());
+        case Dtype::UInt16:
+            return function(std::uint16_t());
+        case Dtype::UInt32:
+            return function(std::uint32_t());
+        case Dtype::UInt64:
+            return function(std::uint64_t());
+        case Dtype::Float32:
+            return function(float());
+        case Dtype::Float64:
+            return function(double());
+    }
+}
+
+/* Calls function with a std::integral_constant for the overflow policy */
+template<typename Function>
+void visit_overflow(Overflow overflow, Function&& function)
+{
+    switch (overflow)
+    {
+        case Overflow::Wrap:
+            return function(std::integral_constant<Overflow, Overflow::Wrap>());
+        case Overflow::Saturate:
+            return function(std::integral_constant<Overflow, Overflow::Saturate>());
+        case Overflow::Check:
+            return function(std::integral_constant<Overflow, Overflow::Check>());
+    }
+}
+
+/* A one-dimensional, contiguous view on the items of a Python buffer, like IntBuffer */
+struct TypedBuffer
+{
+    py::buffer_info info;
+    Dtype dtype;
+    void* data;
+    std::size_t size;
+
+    template<typename T>
+    T* As() const
+    {
+        return static_cast<T*>(data);
+    }
+};
+
+/*
+ * With raw_bytes_as_ints, a buffer of raw bytes (bytearray, bytes, memoryview of those)
+ * holds native ints, as it did before the array functions became typed;
+ * otherwise its bytes are uint8 elements.
+ */
+TypedBuffer request_typed_buffer(const py::buffer& buffer, bool writable, bool raw_bytes_as_ints)
+{
+    py::buffer_info info = buffer.request(writable);
+    if (info.ndim != 1 || info.strides[0] != info.itemsize)
+    {
+        throw py::value_error("buffer must be one-dimensional and contiguous");
+    }
+    if (raw_bytes_as_ints && info.itemsize == 1 && is_byte_format(info.format))
+    {
+        auto bytes = static_cast<std::size_t>(info.size);
+        if (bytes % sizeof(int) != 0)
+        {
+            throw py::value_error("buffer size is not a multiple of the size of a C int");
+        }
+        void* data = info.ptr;
+        return {std::move(info), Dtype::Int32, data, bytes / sizeof(int)};
+    }
+    Dtype dtype = dtype_from_format(info.format, info.itemsize);
+    void* data = info.ptr;
+    auto size = static_cast<std::size_t>(info.size);
+    return {std::move(info), dtype, data, size};
+}
+
+void check_same_layout(const TypedBuffer& a, const TypedBuffer& b)
+{
+    if (a.dtype != b.dtype)
+    {
+        throw py::type_error("arrays must have the same element type, not '" + a.info.format +
+                             "' and '" + b.info.format + "'");
+    }
+    if (a.size != b.size)
+    {
+        throw py::value_error("arrays must have the same number of elements");
+    }
+}
+
+/* The array functions allow arrays that are identical, or do not overlap at all */
+void check_no_partial_overlap(const TypedBuffer& a, const TypedBuffer& b)
+{
+    auto a_begin = reinterpret_cast<std::uintptr_t>(a.info.ptr);
+    auto b_begin = reinterpret_cast<std::uintptr_t>(b.info.ptr);
+    auto a_end = a_begin + static_cast<std::uintptr_t>(a.info.size * a.info.itemsize);
+    auto b_end = b_begin + static_cast<std::uintptr_t>(b.info.size * b.info.itemsize);
+    if (a_begin != b_begin && a_begin < b_end && b_begin < a_end)
+    {
+        throw py::value_error("arrays must be identical or not overlap");
+    }
+}
+
+/* A new memoryview with the element type and number of elements of buffer */
+py::object new_array_like(const TypedBuffer& buffer)
+{
+    py::object result;
+    visit_dtype(buffer.dtype, [&](auto tag)
+    {
+        using T = decltype(tag);
+        result = new_array(buffer.size, sizeof(T), py::format_descriptor<T>::format());
+    });
+    return result;
+}
+
+/* A memoryview of the ints in a buffer, which can be sliced without copying */
+py::object int_memoryview(const py::buffer& buffer)
+{
+    auto view = py::reinterpret_steal<py::object>(PyMemoryView_FromObject(buffer.ptr()));
+    if (!view)
+    {
+        throw py::error_already_set();
+    }
+    return view.attr("cast")("B").attr("cast")("i");
+}
+
+template<bool raw_bytes_as_ints>
+py::object py_add_arrays(const py::buffer& x, const py::buffer& y, const py::object& out, Overflow overflow)
+{
+    TypedBuffer a = request_typed_buffer(x, false, raw_bytes_as_ints);
+    TypedBuffer b = request_typed_buffer(y, false, raw_bytes_as_ints);
+    check_same_layout(a, b);
+    py::object result = out.is_none() ? new_array_like(a) : out;
+    TypedBuffer r = request_typed_buffer(result, true, raw_bytes_as_ints);
+    check_same_layout(a, r);
+    check_no_partial_overlap(a, r);
+    check_no_partial_overlap(b, r);
+    {
+        py::gil_scoped_release release;
+        visit_dtype(a.dtype, [&](auto tag)
+        {
+            using T = decltype(tag);
+            visit_overflow(overflow, [&](auto policy)
+            {
+                add_arrays<T, decltype(policy)::value>(a.As<T>(), b.As<T>(), r.As<T>(), a.size);
+            });
+        });
+    }
+    return result;
+}
+
+template<bool raw_bytes_as_ints>
+void py_add_arrays_inplace(const py::buffer& x, const py::buffer& y, Overflow overflow)
+{
+    TypedBuffer a = request_typed_buffer(x, true, raw_bytes_as_ints);
+    TypedBuffer b = request_typed_buffer(y, false, raw_bytes_as_ints);
+    check_same_layout(a, b);
+    check_no_partial_overlap(a, b);
+    py::gil_scoped_release release;
+    visit_dtype(a.dtype, [&](auto tag)
+    {
+        using T = decltype(tag);
+        visit_overflow(overflow, [&](auto policy)
+        {
+            add_arrays<T, decltype(policy)::value>(a.As<T>(), b.As<T>(), a.size);
+        });
+    });
+}
+
+template<bool raw_bytes_as_ints>
+void py_swap_arrays(const py::buffer& x, const py::buffer& y)
+{
+    TypedBuffer a = request_typed_buffer(x, true, raw_bytes_as_ints);
+    TypedBuffer b = request_typed_buffer(y, true, raw_bytes_as_ints);
+    check_same_layout(a, b);
+    check_no_partial_overlap(a, b);
+    py::gil_scoped_release release;
+    visit_dtype(a.dtype, [&](auto tag)
+    {
+        using T = decltype(tag);
+        swap_arrays(a.As<T>(), b.As<T>(), a.size);
+    });
+}
+
+/*
+ * The Python operation is called once per chunk, with a memoryview on the
+ * corresponding part of each input array. It must return a buffer with
+ * the same number of ints, which is copied into the result.
+ */
+py::object py_do_operation_batch(const py::buffer& x, const py::buffer& y, const py::function& operation,
+                                 std::size_t chunk_size, const py::object& out)
+{
+    if (chunk_size == 0)
+    {
+        throw py::value_error("chunk_size must be positive");
+    }
+    IntBuffer a = request_int_buffer(x, false);
+    IntBuffer b = request_int_buffer(y, false);
+    check_same_size(a, b);
+    py::object result = out.is_none() ? new_int_array(a.size) : out;
+    IntBuffer r = request_int_buffer(result, true);
+    check_same_size(a, r);
+
+    py::object x_view = int_memoryview(x);
+    py::object y_view = int_memoryview(y);
+    do_operation_batch(a.data, b.data, r.data, a.size, chunk_size,
+                       [&](const int* chunk_a, const int*, int* chunk_result, std::size_t n)
+                       {
+                           auto start = static_cast<py::ssize_t>(chunk_a - a.data);
+                           py::slice chunk(start, start + static_cast<py::ssize_t>(n), 1);
+                           py::object x_chunk = x_view[chunk];
+                           py::object y_chunk = y_view[chunk];
+                           py::object returned = operation(x_chunk, y_chunk);
+                           IntBuffer c = request_int_buffer(returned, false);
+                           if (c.size != n)
+                           {
+                               throw py::value_error("operation returned " + std::to_string(c.size) +
+                                                     " elements for a chunk of " + std::to_string(n));
+                           }
+                           std::copy(c.data, c.data + n, chunk_result);
+                       });
+    return result;
+}
+
+/* With a native operation the whole batch runs without the GIL */
+py::object py_do_native_operation_batch(const py::buffer& x, const py::buffer& y, const py::capsule& operation,
+                                        std::size_t chunk_size, const py::object& out)
+{
+    if (chunk_size == 0)
+    {
+        throw py::value_error("chunk_size must be positive");
+    }
+    operation_func native_operation = operation_from_capsule(operation);
+    IntBuffer a = request_int_buffer(x, false);
+    IntBuffer b = request_int_buffer(y, false);
+    check_same_size(a, b);
+    py::object result = out.is_none() ? new_int_array(a.size) : out;
+    IntBuffer r = request_int_buffer(result, true);
+    check_same_size(a, r);
+    {
+        py::gil_scoped_release release;
+        do_operation_batch(a.data, b.data, r.data, a.size, chunk_size, make_batch_operation(native_operation));
+    }
+    return result;
+}
+
+py::object py_parallel_map(const py::buffer& x, const py::buffer& y, const py::capsule& operation,
+                           std::size_t threads, const py::object& out)
+{
+    operation_func native_operation = operation_from_capsule(operation);
+    IntBuffer a = request_int_buffer(x, false);
+    IntBuffer b = request_int_buffer(y, false);
+    check_same_size(a, b);
+    py::object result = out.is_none() ? new_int_array(a.size) : out;
+    IntBuffer r = request_int_buffer(result, true);
+    check_same_size(a, r);
+    {
+        py::gil_scoped_release release;
+        parallel_map(a.data, b.data, r.data, a.size, native_operation, threads);
+    }
+    return result;
+}
+
+/*
+ * Delivers the results of do_operation_async to their asyncio futures.
+ * Workers queue results without taking the GIL. Only the first result that is
+ * queued after a drain takes it, to schedule one Drain on the event loop with
+ * call_soon_threadsafe, so a burst of results wakes up the loop once.
+ * There is one instance per event loop, see completions_for_loop.
+ */
+class AsyncCompletions : public std::enable_shared_from_this<AsyncCompletions>
+{
+public:
+    /* Takes over the reference to future; it is only used by Drain, with the GIL held */
+    void Post(PyObject* future, int result, std::exception_ptr error)
+    {
+        bool schedule;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            completions_.push_back({future, result, std::move(error)});
+            schedule = !scheduled_;
+            scheduled_ = true;
+        }
+        if (schedule)
+        {
+            py::gil_scoped_acquire gil;
+            auto self = shared_from_this();
+            try
+            {
+                py::handle(future).attr("get_loop")().attr("call_soon_threadsafe")(
+                        py::cpp_function([self]() { self->Drain(); }));
+            }
+            catch (const py::error_already_set&)
+            {
+                /*
+                 * The loop is closed, so its futures can no longer be awaited. Drop them, and let
+                 * the next Post try again, rather than queueing for a Drain that never comes.
+                 */
+                std::vector<Completion> dropped;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    dropped.swap(completions_);
+                    scheduled_ = false;
+                }
+                for (auto& completion : dropped)
+                {
+                    Py_DECREF(completion.future);
+                }
+            }
+        }
+    }
+
+    /* Runs on the event loop: completes every queued future that was not cancelled */
+    void Drain()
+    {
+        std::vector<Completion> completions;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            completions.swap(completions_);
+            scheduled_ = false;
+        }
+        for (auto& completion : completions)
+        {
+            auto future = py::reinterpret_steal<py::object>(completion.future);
+            if (future.attr("done")().cast<bool>())
+            {
+                continue;
+            }
+            if (completion.error)
+            {
+                future.attr("set_exception")(python_exception(completion.error));
+            }
+            else
+            {
+                future.attr("set_result")(completion.result);
+            }
+        }
+    }
+
+private:
+    struct Completion
+    {
+        PyObject* future;
+        int result;
+        std::exception_ptr error;
+    };
+
+    /* The Python exception for an exception thrown by an operation */
+    static py::object python_exception(const std::exception_ptr& error)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (py::error_already_set& e)
+        {
+            e.restore();
+            PyObject* type;
+            PyObject* value;
+            PyObject* traceback;
+            PyErr_Fetch(&type, &value, &traceback);
+            PyErr_NormalizeException(&type, &value, &traceback);
+            if (traceback != nullptr)
+            {
+                PyException_SetTraceback(value, traceback);
+            }
+            Py_XDECREF(type);
+            Py_XDECREF(traceback);
+            return py::reinterpret_steal<py::object>(value);
+        }
+        catch (const std::exception& e)
+        {
+            return py::reinterpret_borrow<py::object>(PyExc_RuntimeError)(e.what());
+        }
+        catch (...)
+        {
+            return py::reinterpret_borrow<py::object>(PyExc_RuntimeError)("unknown C++ exception");
+        }
+    }
+
+    std::mutex mutex_;
+    std::vector<Completion> completions_;
+    bool scheduled_ = false;
+};
+
+/*
+ * Number of do_operation_async calls whose result has not been posted yet.
+ * At exit, the interpreter waits for these, because a worker that
+ * still needs the GIL must not run into a finalized interpreter.
+ */
+struct AsyncOperations
+{
+    std::mutex mutex;
+    std::condition_variable idle_cv;
+    std::size_t in_flight = 0;
+};
+
+AsyncOperations& async_operations()
+{
+    static AsyncOperations instance;
+    return instance;
+}
+
+void wait_for_async_operations()
+{
+    py::gil_scoped_release release;
+    auto& operations = async_operations();
+    std::unique_lock<std::mutex> lock(operations.mutex);
+    operations.idle_cv.wait(lock, [&operations]() { return operations.in_flight == 0; });
+}
+
+/* completions_by_loop is a WeakKeyDictionary, so an instance goes away with its loop */
+std::shared_ptr<AsyncCompletions> completions_for_loop(const py::object& completions_by_loop, const py::object& loop)
+{
+    py::object completions = completions_by_loop.attr("get")(loop);
+    if (completions.is_none())
+    {
+        completions = py::cast(std::make_shared<AsyncCompletions>());
+        completions_by_loop[loop] = completions;
+    }
+    return completions.cast<std::shared_ptr<AsyncCompletions>>();
+}
+
+/*
+ * Runs do_operation on the thread pool, and returns an asyncio future for its result.
+ * Must be called from a coroutine, or a callback, of the running event loop.
+ */
+py::object py_do_operation_async(const py::object& completions_by_loop, int x, int y,
+                                 std::function<int(int, int)> operation)
+{
+    py::object loop = py::module::import("asyncio").attr("get_running_loop")();
+    py::object future = loop.attr("create_future")();
+    std::shared_ptr<AsyncCompletions> completions = completions_for_loop(completions_by_loop, loop);
+    {
+        std::lock_guard<std::mutex> lock(async_operations().mutex);
+        async_operations().in_flight++;
+    }
+    PyObject* raw_future = future.inc_ref().ptr();
+    do_operation_async(x, y, std::move(operation), [completions, raw_future](int result, std::exception_ptr error)
+    {
+        completions->Post(raw_future, result, std::move(error));
+        auto& operations = async_operations();
+        std::lock_guard<std::mutex> lock(operations.mutex);
+        if (--operations.in_flight == 0)
+        {
+            operations.idle_cv.notify_all();
+        }
+    });
+    return future;
+}
+
+int py_reduce(const py::buffer& x, const py::capsule& operation, std::size_t threads)
+{
+    operation_func native_operation = operation_from_capsule(operation);
+    IntBuffer a = request_int_buffer(x, false);
+    py::gil_scoped_release release;
+    return parallel_reduce(a.data, a.size, native_operation, threads);
+}
+}
+
 PYBIND11_MODULE(spam, m)
 {
     m.doc() = "Example extension module";
-    m.def("add", &add, "Add two integers", "x"_a, "y"_a);
-    m.def("swap", [](int x, int y) { swap(x, y); return std::make_tuple(x, y); },
+    py::enum_<Overflow>(m, "Overflow", "What integer addition does with a result that does not fit")
+            .value("WRAP", Overflow::Wrap)
+            .value("SATURATE", Overflow::Saturate)
+            .value("CHECK", Overflow::Check);
+
+    /* Integers are tried first, so only floats (or integers beyond 64 bits) use double */
+    m.def("add", &add<std::int64_t>, "Add two integers", "x"_a, "y"_a);
+    m.def("add", &add<double>, "Add two floating point numbers", "x"_a, "y"_a);
+    m.def("swap", [](std::int64_t x, std::int64_t y) { swap(x, y); return std::make_tuple(x, y); },
           "Swap two values", "x"_a, "y"_a);
-    m.def("do_operation", &do_operation, "Perform operation on two integers",
+    m.def("swap", [](double x, double y) { swap(x, y); return std::make_tuple(x, y); },
+          "Swap two values", "x"_a, "y"_a);
+    m.def("do_operation",
+          [](int x, int y, const py::capsule& operation) { return do_operation(x, y, operation_from_capsule(operation)); },
+          "Perform a native operation from spam.ops on two integers",
+          "x"_a, "y"_a, "operation"_a);
+    m.def("do_operation", &do_operation<int>, "Perform operation on two integers",
+          "x"_a, "y"_a, "operation"_a);
+
+    py::class_<AsyncCompletions, std::shared_ptr<AsyncCompletions>>(m, "_AsyncCompletions");
+    py::object completions_by_loop = py::module::import("weakref").attr("WeakKeyDictionary")();
+    m.attr("_completions_by_loop") = completions_by_loop;
+    m.def("do_operation_async",
+          [completions_by_loop](int x, int y, const py::capsule& operation)
+          {
+              return py_do_operation_async(completions_by_loop, x, y, operation_from_capsule(operation));
+          },
+          "Perform a native operation from spam.ops on a worker thread, and return an asyncio future for the result",
           "x"_a, "y"_a, "operation"_a);
+    m.def("do_operation_async",
+          [completions_by_loop](int x, int y, std::function<int(int, int)> operation)
+          {
+              return py_do_operation_async(completions_by_loop, x, y, std::move(operation));
+          },
+          "Perform operation on a worker thread, and return an asyncio future for the result. "
+          "Must be called while an event loop is running",
+          "x"_a, "y"_a, "operation"_a);
+    py::module::import("atexit").attr("register")(py::cpp_function(&wait_for_async_operations));
+
+    py::module ops = m.def_submodule("ops", "Native operations, for use with do_operation");
+    for (const auto& name : operation_names())
+    {
+        ops.attr(name.c_str()) = make_operation_capsule(find_operation(name));
+    }
+    m.def("register_operation",
+          [ops](const std::string& name, const py::capsule& operation)
+          {
+              register_operation(name, operation_from_capsule(operation));
+              ops.attr(name.c_str()) = operation;
+          },
+          "Register a native operation capsule, and make it available in spam.ops",
+          "name"_a, "operation"_a);
+
+    /* Raw bytes hold C ints here, as they always did; the typed variants below read them as uint8 */
+    m.def("add_arrays", &py_add_arrays<true>,
+          "Add two arrays of the same element type element-wise. The result is written to 'out', "
+          "or to a new memoryview if 'out' is None. Integer overflow is handled according to 'overflow'; "
+          "Overflow.CHECK raises OverflowError after the whole result is written. "
+          "Raw bytes, such as a bytearray, are read as C ints",
+          "x"_a, "y"_a, "out"_a = py::none(), "overflow"_a = Overflow::Wrap);
+    m.def("add_arrays_inplace", &py_add_arrays_inplace<true>,
+          "Add array y element-wise to array x of the same element type. Raw bytes are read as C ints",
+          "x"_a, "y"_a, "overflow"_a = Overflow::Wrap);
+    m.def("swap_arrays", &py_swap_arrays<true>,
+          "Swap the contents of two arrays of the same element type. Raw bytes are read as C ints",
+          "x"_a, "y"_a);
+    m.def("add_typed_arrays", &py_add_arrays<false>,
+          "Like add_arrays, but raw bytes are uint8 elements",
+          "x"_a, "y"_a, "out"_a = py::none(), "overflow"_a = Overflow::Wrap);
+    m.def("add_typed_arrays_inplace", &py_add_arrays_inplace<false>,
+          "Like add_arrays_inplace, but raw bytes are uint8 elements",
+          "x"_a, "y"_a, "overflow"_a = Overflow::Wrap);
+    m.def("swap_typed_arrays", &py_swap_arrays<false>,
+          "Like swap_arrays, but raw bytes are uint8 elements", "x"_a, "y"_a);
+    m.def("do_operation_batch", &py_do_operation_batch,
+          "Perform operation on two int arrays, calling it once per chunk of memoryviews. "
+          "The result is written to 'out', or to a new memoryview if 'out' is None",
+          "x"_a, "y"_a, "operation"_a, "chunk_size"_a = 4096, "out"_a = py::none());
+    m.def("do_operation_batch", &py_do_native_operation_batch,
+          "Perform a native operation from spam.ops on two int arrays, without holding the GIL",
+          "x"_a, "y"_a, "operation"_a, "chunk_size"_a = 4096, "out"_a = py::none());
+    m.def("parallel_map", &py_parallel_map,
+          "Perform a native operation from spam.ops on two int arrays, using multiple threads. "
+          "threads=0 uses all hardware threads",
+          "x"_a, "y"_a, "operation"_a, "threads"_a = 0, "out"_a = py::none());
+    m.def("reduce", &py_reduce,
+          "Fold an int array with a native operation from spam.ops, using multiple threads. "
+          "For associative operations the result does not depend on the number of threads",
+          "x"_a, "operation"_a, "threads"_a = 0);
+    m.attr("array_kernel") = array_kernel_name();
 }
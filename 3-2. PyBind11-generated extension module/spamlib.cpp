@@ -1,18 +1,471 @@
 #include "spamlib.h"
 
-int add(int a, int b)
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include "thread_pool.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SPAMLIB_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+/*
+ * GCC and Clang only allow AVX2 intrinsics in functions that are compiled for AVX2.
+ * Marking the kernels this way keeps the rest of the library at the baseline
+ * instruction set, so the runtime dispatch below decides what actually runs.
+ */
+#if defined(SPAMLIB_X86) && (defined(__GNUC__) || defined(__clang__))
+#define SPAMLIB_TARGET_AVX2 __attribute__((target("avx2")))
+#define SPAMLIB_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define SPAMLIB_TARGET_AVX2
+#define SPAMLIB_TARGET_SSE2
+#endif
+
+namespace
+{
+/* Integer addition that wraps around, without the undefined behaviour of signed overflow */
+template<typename T>
+T wrapping_add(T a, T b)
+{
+    using Unsigned = std::make_unsigned_t<T>;
+    return static_cast<T>(static_cast<Unsigned>(static_cast<Unsigned>(a) + static_cast<Unsigned>(b)));
+}
+
+/* Whether result, the wrapped sum of a and b, differs from the true sum */
+template<typename T>
+bool add_overflowed(T a, T b, T result)
+{
+    if constexpr (std::is_signed_v<T>)
+    {
+        /* The sum overflowed if its sign differs from the sign of both operands */
+        return ((a ^ result) & (b ^ result)) < 0;
+    }
+    else
+    {
+        return result < a;
+    }
+}
+
+/* The limit that an overflowing sum of a and b is clamped to */
+template<typename T>
+T saturated_sum(T a)
+{
+    if constexpr (std::is_signed_v<T>)
+    {
+        return a < 0 ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+    }
+    else
+    {
+        return std::numeric_limits<T>::max();
+    }
+}
+
+[[noreturn]] void throw_add_overflow()
 {
-    return a + b;
+    throw std::overflow_error("integer overflow in add");
+}
 }
 
-void swap(int& a, int& b)
+template<typename T, Overflow policy>
+T add(T a, T b)
 {
-    int tmp = a;
+    if constexpr (std::is_floating_point_v<T>)
+    {
+        return a + b;
+    }
+    else
+    {
+        T result = wrapping_add(a, b);
+        if constexpr (policy == Overflow::Saturate)
+        {
+            return add_overflowed(a, b, result) ? saturated_sum(a) : result;
+        }
+        else if constexpr (policy == Overflow::Check)
+        {
+            if (add_overflowed(a, b, result))
+            {
+                throw_add_overflow();
+            }
+        }
+        return result;
+    }
+}
+
+template<typename T>
+void swap(T& a, T& b)
+{
+    T tmp = a;
     a = b;
     b = tmp;
 }
 
-int do_operation(int a, int b, std::function<int(int, int)> operator_func)
+template<typename T>
+T do_operation(T a, T b, const std::type_identity_t<std::function<T(T, T)>>& operator_func)
 {
     return operator_func(a, b);
 }
+
+void do_operation_async(int a, int b, std::function<int(int, int)> operator_func, OperationCallback done)
+{
+    ThreadPool::Default().Submit([a, b, operator_func = std::move(operator_func), done = std::move(done)]() mutable
+    {
+        int result = 0;
+        std::exception_ptr error;
+        {
+            /* Swapping leaves the captured function empty, so the operation dies with this scope */
+            std::function<int(int, int)> operation;
+            operation.swap(operator_func);
+            try
+            {
+                result = do_operation(a, b, operation);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }
+        done(result, std::move(error));
+    });
+}
+
+void do_operation_batch(const int* a, const int* b, int* result, std::size_t n,
+                        std::size_t chunk_size, const BatchOperation& operator_func)
+{
+    for (std::size_t offset = 0; offset < n; offset += chunk_size)
+    {
+        std::size_t count = std::min(chunk_size, n - offset);
+        operator_func(a + offset, b + offset, result + offset, count);
+    }
+}
+
+BatchOperation make_batch_operation(std::function<int(int, int)> operator_func)
+{
+    return [operator_func = std::move(operator_func)](const int* a, const int* b, int* result, std::size_t n)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            result[i] = do_operation(a[i], b[i], operator_func);
+        }
+    };
+}
+
+namespace
+{
+/* Number of elements that one task of the parallel functions processes */
+constexpr std::size_t parallel_chunk_size = std::size_t(1) << 16;
+
+std::size_t chunk_count(std::size_t n)
+{
+    return (n + parallel_chunk_size - 1) / parallel_chunk_size;
+}
+}
+
+void parallel_map(const int* a, const int* b, int* result, std::size_t n, operation_func operation,
+                  std::size_t threads)
+{
+    ThreadPool::Default().ParallelFor(chunk_count(n), [=](std::size_t chunk)
+    {
+        std::size_t begin = chunk * parallel_chunk_size;
+        std::size_t end = std::min(n, begin + parallel_chunk_size);
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            result[i] = operation(a[i], b[i]);
+        }
+    }, threads);
+}
+
+int parallel_reduce(const int* a, std::size_t n, operation_func operation, std::size_t threads)
+{
+    if (n == 0)
+    {
+        throw std::invalid_argument("cannot reduce an empty array");
+    }
+    std::vector<int> partial(chunk_count(n));
+    ThreadPool::Default().ParallelFor(partial.size(), [&](std::size_t chunk)
+    {
+        std::size_t begin = chunk * parallel_chunk_size;
+        std::size_t end = std::min(n, begin + parallel_chunk_size);
+        int value = a[begin];
+        for (std::size_t i = begin + 1; i < end; ++i)
+        {
+            value = operation(value, a[i]);
+        }
+        partial[chunk] = value;
+    }, threads);
+    int value = partial[0];
+    for (std::size_t chunk = 1; chunk < partial.size(); ++chunk)
+    {
+        value = operation(value, partial[chunk]);
+    }
+    return value;
+}
+
+namespace
+{
+struct OperationRegistry
+{
+    std::mutex mutex;
+    std::map<std::string, operation_func> operations{
+            /* Through unsigned, so that an overflow wraps around instead of being undefined */
+            {"add", [](int a, int b) { return static_cast<int>(static_cast<unsigned>(a) + static_cast<unsigned>(b)); }},
+            {"sub", [](int a, int b) { return static_cast<int>(static_cast<unsigned>(a) - static_cast<unsigned>(b)); }},
+            {"mul", [](int a, int b) { return static_cast<int>(static_cast<unsigned>(a) * static_cast<unsigned>(b)); }},
+            {"min", [](int a, int b) { return std::min(a, b); }},
+            {"max", [](int a, int b) { return std::max(a, b); }},
+    };
+};
+
+OperationRegistry& registry()
+{
+    static OperationRegistry instance;
+    return instance;
+}
+}
+
+operation_func find_operation(const std::string& name)
+{
+    auto& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    auto found = reg.operations.find(name);
+    return found == reg.operations.end() ? nullptr : found->second;
+}
+
+void register_operation(const std::string& name, operation_func operation)
+{
+    auto& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.operations[name] = operation;
+}
+
+std::vector<std::string> operation_names()
+{
+    auto& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    std::vector<std::string> names;
+    for (const auto& entry : reg.operations)
+    {
+        names.push_back(entry.first);
+    }
+    return names;
+}
+
+namespace
+{
+using AddKernel = void (*)(const int* a, const int* b, int* result, std::size_t n);
+using SwapKernel = void (*)(int* a, int* b, std::size_t n);
+
+struct ArrayKernels
+{
+    const char* name;
+    AddKernel add;
+    SwapKernel swap;
+};
+
+/* The vector kernels wrap around on overflow, so the scalar kernel does the same */
+void add_scalar(const int* a, const int* b, int* result, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        result[i] = static_cast<int>(static_cast<unsigned>(a[i]) + static_cast<unsigned>(b[i]));
+    }
+}
+
+void swap_scalar(int* a, int* b, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        swap(a[i], b[i]);
+    }
+}
+
+#if defined(SPAMLIB_X86)
+SPAMLIB_TARGET_SSE2 void add_sse2(const int* a, const int* b, int* result, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(result + i), _mm_add_epi32(va, vb));
+    }
+    add_scalar(a + i, b + i, result + i, n - i);
+}
+
+SPAMLIB_TARGET_SSE2 void swap_sse2(int* a, int* b, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(a + i), vb);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(b + i), va);
+    }
+    swap_scalar(a + i, b + i, n - i);
+}
+
+SPAMLIB_TARGET_AVX2 void add_avx2(const int* a, const int* b, int* result, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i va0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i va1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i + 8));
+        __m256i vb1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i + 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(result + i), _mm256_add_epi32(va0, vb0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(result + i + 8), _mm256_add_epi32(va1, vb1));
+    }
+    add_sse2(a + i, b + i, result + i, n - i);
+}
+
+SPAMLIB_TARGET_AVX2 void swap_avx2(int* a, int* b, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(a + i), vb);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(b + i), va);
+    }
+    swap_sse2(a + i, b + i, n - i);
+}
+
+bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+    {
+        return false;
+    }
+    /* AVX2 also requires the OS to save the YMM registers on a context switch */
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 0x6) == 0x6);
+    __cpuidex(info, 7, 0);
+    return os_saves_ymm && (info[1] & (1 << 5));
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+ArrayKernels select_kernels()
+{
+#if defined(SPAMLIB_X86)
+    if (cpu_has_avx2())
+    {
+        return {"avx2", add_avx2, swap_avx2};
+    }
+    return {"sse2", add_sse2, swap_sse2};
+#else
+    return {"scalar", add_scalar, swap_scalar};
+#endif
+}
+
+const ArrayKernels& kernels()
+{
+    static const ArrayKernels selected = select_kernels();
+    return selected;
+}
+}
+
+template<typename T, Overflow policy>
+void add_arrays(const T* a, const T* b, T* result, std::size_t n)
+{
+    if constexpr (std::is_same_v<T, int> && policy == Overflow::Wrap)
+    {
+        kernels().add(a, b, result, n);
+    }
+    else if constexpr (std::is_floating_point_v<T> || policy == Overflow::Wrap)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            result[i] = add<T, Overflow::Wrap>(a[i], b[i]);
+        }
+    }
+    else if constexpr (policy == Overflow::Saturate)
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            result[i] = add<T, Overflow::Saturate>(a[i], b[i]);
+        }
+    }
+    else
+    {
+        /* Collect overflows without branching, so the loop still vectorizes */
+        bool overflowed = false;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            T sum = wrapping_add(a[i], b[i]);
+            overflowed |= add_overflowed(a[i], b[i], sum);
+            result[i] = sum;
+        }
+        if (overflowed)
+        {
+            throw_add_overflow();
+        }
+    }
+}
+
+template<typename T, Overflow policy>
+void add_arrays(T* a, const T* b, std::size_t n)
+{
+    add_arrays<T, policy>(a, b, a, n);
+}
+
+template<typename T>
+void swap_arrays(T* a, T* b, std::size_t n)
+{
+    if constexpr (std::is_same_v<T, int>)
+    {
+        kernels().swap(a, b, n);
+    }
+    else
+    {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            swap(a[i], b[i]);
+        }
+    }
+}
+
+const char* array_kernel_name()
+{
+    return kernels().name;
+}
+
+#define SPAMLIB_INSTANTIATE_ADD(T, policy) \
+    template T add<T, policy>(T a, T b); \
+    template void add_arrays<T, policy>(const T* a, const T* b, T* result, std::size_t n); \
+    template void add_arrays<T, policy>(T* a, const T* b, std::size_t n);
+
+#define SPAMLIB_INSTANTIATE(T) \
+    SPAMLIB_INSTANTIATE_ADD(T, Overflow::Wrap) \
+    SPAMLIB_INSTANTIATE_ADD(T, Overflow::Saturate) \
+    SPAMLIB_INSTANTIATE_ADD(T, Overflow::Check) \
+    template void swap<T>(T& a, T& b); \
+    template T do_operation<T>(T a, T b, const std::function<T(T, T)>& operator_func); \
+    template void swap_arrays<T>(T* a, T* b, std::size_t n);
+
+SPAMLIB_INSTANTIATE(std::int8_t)
+SPAMLIB_INSTANTIATE(std::int16_t)
+SPAMLIB_INSTANTIATE(std::int32_t)
+SPAMLIB_INSTANTIATE(std::int64_t)
+SPAMLIB_INSTANTIATE(std::uint8_t)
+SPAMLIB_INSTANTIATE(std::uint16_t)
+SPAMLIB_INSTANTIATE(std::uint32_t)
+SPAMLIB_INSTANTIATE(std::uint64_t)
+SPAMLIB_INSTANTIATE(float)
+SPAMLIB_INSTANTIATE(double)
@@ -1,10 +1,106 @@
 #ifndef PYTHON_C_CPP
 #define PYTHON_C_CPP
 
+#include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <functional>
+#include <string>
+#include <type_traits>
+#include <vector>
 
-int add(int a, int b);
-void swap(int& a, int& b);
-int do_operation(int a, int b, std::function<int(int, int)> operator_func);
+using operation_func = int (*)(int a, int b);
+
+/*
+ * What integer arithmetic does with a result that does not fit in the type:
+ * wrap around (two's complement), clamp to the limits of the type,
+ * or throw std::overflow_error. Floating point types ignore the policy.
+ * The policy is a template argument, so the unchecked code has no branches for it.
+ */
+enum class Overflow
+{
+    Wrap,
+    Saturate,
+    Check
+};
+
+/*
+ * add, swap, do_operation and the array functions are templates on the element type.
+ * They are defined in spamlib.cpp, and instantiated there for
+ * std::int8_t ... std::int64_t, std::uint8_t ... std::uint64_t, float and double.
+ */
+template<typename T, Overflow policy = Overflow::Wrap>
+T add(T a, T b);
+
+template<typename T>
+void swap(T& a, T& b);
+
+/* The type of the operation is not deduced, so any callable that converts to std::function works */
+template<typename T>
+T do_operation(T a, T b, const std::type_identity_t<std::function<T(T, T)>>& operator_func);
+
+/*
+ * Element-wise variants of add and swap, operating on arrays of n elements.
+ * The in-place add stores the result in a. Arrays may be identical,
+ * but must not partially overlap. With Overflow::Check, the results are
+ * all written before std::overflow_error is thrown.
+ */
+template<typename T, Overflow policy = Overflow::Wrap>
+void add_arrays(const T* a, const T* b, T* result, std::size_t n);
+
+template<typename T, Overflow policy = Overflow::Wrap>
+void add_arrays(T* a, const T* b, std::size_t n);
+
+template<typename T>
+void swap_arrays(T* a, T* b, std::size_t n);
+
+/*
+ * Runs do_operation on ThreadPool::Default(), and calls done on the worker thread
+ * with the result, or with the exception that the operation threw.
+ * operator_func is destroyed before done is called.
+ */
+using OperationCallback = std::function<void(int result, std::exception_ptr error)>;
+void do_operation_async(int a, int b, std::function<int(int, int)> operator_func, OperationCallback done);
+
+/*
+ * An operation on whole chunks: computes result[i] = op(a[i], b[i]) for the n elements of a chunk.
+ * do_operation_batch splits the arrays into chunks of (at most) chunk_size elements,
+ * and calls the batch operation once per chunk.
+ */
+using BatchOperation = std::function<void(const int* a, const int* b, int* result, std::size_t n)>;
+void do_operation_batch(const int* a, const int* b, int* result, std::size_t n,
+                        std::size_t chunk_size, const BatchOperation& operator_func);
+
+/* Turns an element-wise operation into a batch operation that applies do_operation per element */
+BatchOperation make_batch_operation(std::function<int(int, int)> operator_func);
+
+/*
+ * Parallel do_operation on arrays, for native operations.
+ * The arrays are split into chunks of a fixed size, which are processed by ThreadPool::Default().
+ * threads limits the number of threads that is used; 0 means all of them.
+ */
+void parallel_map(const int* a, const int* b, int* result, std::size_t n, operation_func operation,
+                  std::size_t threads = 0);
+
+/*
+ * Fold the n elements of a with operation, in parallel.
+ * The chunks only depend on n, and their partial results are combined in order,
+ * so for an associative operation the result is that of a sequential fold,
+ * whatever the number of threads. Throws std::invalid_argument if n is 0.
+ */
+int parallel_reduce(const int* a, std::size_t n, operation_func operation, std::size_t threads = 0);
+
+/* Name of the instruction set selected at runtime for the array functions */
+const char* array_kernel_name();
+
+/*
+ * Registry of named native operations that can be passed to do_operation.
+ * The registry is filled with add, sub, mul, min and max.
+ * find_operation returns nullptr for an unknown name.
+ * Registering an existing name replaces its operation.
+ */
+operation_func find_operation(const std::string& name);
+void register_operation(const std::string& name, operation_func operation);
+std::vector<std::string> operation_names();
 
 #endif //PYTHON_C_CPP
@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <exception>
+
+#include "thread_pool.h"
+
+namespace
+{
+/* The pool and worker index of the current thread, if it is a pool worker */
+thread_local const ThreadPool* current_pool = nullptr;
+thread_local std::size_t current_worker = 0;
+}
+
+ThreadPool::ThreadPool(std::size_t threads) :
+        queues_(),
+        workers_(),
+        next_queue_(0),
+        pending_(0),
+        sleep_mutex_(),
+        wake_cv_(),
+        stop_(false)
+{
+    threads = std::max<std::size_t>(threads, 1);
+    for (std::size_t i = 0; i < threads; ++i)
+    {
+        queues_.emplace_back(std::make_unique<WorkerQueue>());
+    }
+    for (std::size_t i = 0; i < threads; ++i)
+    {
+        workers_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_cv_.notify_all();
+    for (auto& worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+std::size_t ThreadPool::Size() const
+{
+    return workers_.size();
+}
+
+void ThreadPool::Submit(ThreadPool::Task task)
+{
+    std::size_t queue = (current_pool == this) ? current_worker : next_queue_++ % queues_.size();
+    {
+        /* Counted under the queue lock, like the pops, so that pending_ never drops below zero */
+        std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+        queues_[queue]->tasks.push_back(std::move(task));
+        pending_++;
+    }
+    /* Taking the mutex ensures a worker is either waiting, or will see the new pending count */
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    wake_cv_.notify_one();
+}
+
+bool ThreadPool::TryPop(std::size_t worker, ThreadPool::Task& task)
+{
+    std::lock_guard<std::mutex> lock(queues_[worker]->mutex);
+    if (queues_[worker]->tasks.empty())
+    {
+        return false;
+    }
+    task = std::move(queues_[worker]->tasks.back());
+    queues_[worker]->tasks.pop_back();
+    pending_--;
+    return true;
+}
+
+bool ThreadPool::TrySteal(std::size_t thief, ThreadPool::Task& task)
+{
+    for (std::size_t offset = 1; offset < queues_.size(); ++offset)
+    {
+        auto& victim = *queues_[(thief + offset) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            pending_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(std::size_t worker)
+{
+    current_pool = this;
+    current_worker = worker;
+    Task task;
+    while (true)
+    {
+        if (TryPop(worker, task) || TrySteal(worker, task))
+        {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_cv_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+        if (stop_ && pending_ == 0)
+        {
+            return;
+        }
+    }
+}
+
+void ThreadPool::ParallelFor(std::size_t n, const std::function<void(std::size_t)>& body, std::size_t max_threads)
+{
+    if (n == 0)
+    {
+        return;
+    }
+
+    /*
+     * Participants claim indices from a shared counter until all are taken.
+     * A helper that only starts after the caller has returned finds no indices left,
+     * so it never uses body; the state it does use is shared with it.
+     */
+    struct State
+    {
+        std::atomic<std::size_t> next{0};
+        std::atomic<std::size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable done_cv;
+        std::exception_ptr error;
+    };
+    auto state = std::make_shared<State>();
+    auto run = [state, &body, n]()
+    {
+        std::size_t i;
+        while ((i = state->next++) < n)
+        {
+            try
+            {
+                body(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (!state->error)
+                {
+                    state->error = std::current_exception();
+                }
+            }
+            if (++state->done == n)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->done_cv.notify_all();
+            }
+        }
+    };
+
+    std::size_t threads = (max_threads == 0) ? Size() + 1 : std::min(max_threads, Size() + 1);
+    std::size_t helpers = std::min(threads, n) - 1;
+    for (std::size_t i = 0; i < helpers; ++i)
+    {
+        Submit(run);
+    }
+    run();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done_cv.wait(lock, [&state, n]() { return state->done == n; });
+    if (state->error)
+    {
+        std::rethrow_exception(state->error);
+    }
+}
+
+ThreadPool& ThreadPool::Default()
+{
+    static ThreadPool pool;
+    return pool;
+}
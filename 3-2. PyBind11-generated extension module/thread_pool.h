@@ -0,0 +1,69 @@
+#ifndef PYTHON_C_CPP_THREAD_POOL_H
+#define PYTHON_C_CPP_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed-size pool of worker threads with work stealing.
+ * Every worker has its own task queue. A worker takes new work from the back of
+ * its own queue, and when that is empty it steals from the front of the queues
+ * of the other workers, so a long task on one worker does not hold up the rest.
+ */
+class ThreadPool
+{
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    std::size_t Size() const;
+
+    /*
+     * Queue a task. Tasks submitted from a worker go to the queue of that worker,
+     * other tasks are spread round-robin over the workers.
+     */
+    void Submit(Task task);
+
+    /*
+     * Call body(i) for every i in [0, n), and wait until all calls are done.
+     * The calling thread takes part, so this may also be called from a task.
+     * At most max_threads threads (including the caller) are used; 0 means all workers.
+     * The first exception thrown by body is rethrown in the caller.
+     */
+    void ParallelFor(std::size_t n, const std::function<void(std::size_t)>& body, std::size_t max_threads = 0);
+
+    /* The pool shared by spamlib, with one worker per hardware thread */
+    static ThreadPool& Default();
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool TryPop(std::size_t worker, Task& task);
+    bool TrySteal(std::size_t thief, Task& task);
+    void WorkerLoop(std::size_t worker);
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<std::size_t> next_queue_;
+    std::atomic<std::size_t> pending_;
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_cv_;
+    bool stop_;
+};
+
+#endif //PYTHON_C_CPP_THREAD_POOL_H
@@ -0,0 +1,371 @@
+/*
+ * Throughput of traffic light transitions in virtual time, on a SimulatedClock,
+ * so that it measures the cost of running transitions rather than their delays.
+ * Also checks how fast an Emergency request takes over, and how fast a busy light is destroyed,
+ * and fails if that is slower than the bound, and counts the writes to the lights per step.
+ * Also fails if a wait for a state that a transition only passes through misses it,
+ * or if a subscriber that keeps every change loses one while it falls behind,
+ * or if a MoveTo from a callback blocks a Scheduler worker on a full queue.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "event_channel.h"
+#include "light_driver.h"
+#include "shared_state.h"
+#include "simulated_clock.h"
+#include "traffic_light.h"
+
+namespace
+{
+/* Runs transitions requests to alternately open and close each of lights, and returns the transitions per second */
+double transitions_per_second(std::size_t lights, std::size_t transitions, bool subscribed)
+{
+    SimulatedClock clock;
+    std::size_t changes = 0;
+    std::vector<std::unique_ptr<TrafficLight>> traffic_lights;
+    for (std::size_t i = 0; i < lights; ++i)
+    {
+        auto& traffic_light = traffic_lights.emplace_back(std::make_unique<TrafficLight>(TrafficLight::State::Closed, clock));
+        if (subscribed)
+        {
+            traffic_light->Subscribe([&changes](TrafficLight*, const std::vector<TrafficLight::StateChange>& batch)
+                                     {
+                                         changes += batch.size();
+                                     });
+        }
+        for (std::size_t j = 0; j < transitions; ++j)
+        {
+            traffic_light->MoveTo(j % 2 == 0 ? TrafficLight::State::Open : TrafficLight::State::Closed);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    clock.RunUntil(std::chrono::hours(24 * 365 * 100));
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (subscribed && changes == 0)
+    {
+        printf("No state changes were delivered\n");
+    }
+    traffic_lights.clear();
+    return static_cast<double>(lights * transitions) / elapsed.count();
+}
+
+/*
+ * The longest time, on a SimulatedClock, from an Emergency request for Warning until the light shows it,
+ * for requests at every 100 ms of a transition to Closed and back to Open
+ */
+Clock::Duration simulated_override_delay()
+{
+    using namespace std::chrono_literals;
+    Clock::Duration worst = Clock::Duration::zero();
+    for (Clock::Duration offset = 0ms; offset < 10s; offset += 100ms)
+    {
+        SimulatedClock clock;
+        TrafficLight traffic_light(TrafficLight::State::Open, clock);
+        clock.RunFor(5s);
+        traffic_light.MoveTo(TrafficLight::State::Closed);
+        traffic_light.MoveTo(TrafficLight::State::Open);
+        clock.RunFor(offset);
+        auto requested = clock.Now();
+        Clock::Duration delay = Clock::Duration::max();
+        traffic_light.MoveTo(TrafficLight::State::Warning, TrafficLight::Priority::Emergency);
+        traffic_light.NotifyWhenInState(TrafficLight::State::Warning, [&](bool) { delay = clock.Now() - requested; });
+        clock.RunFor(1min);
+        worst = std::max(worst, delay);
+    }
+    return worst;
+}
+
+/* A light that counts its SetState calls, which would each be a write to a backend */
+class CountingLight : public Light
+{
+public:
+    explicit CountingLight(std::size_t& writes) :
+            writes_(writes)
+    {
+    }
+
+    void SetState(State state) override
+    {
+        writes_++;
+        Light::SetState(state);
+    }
+
+private:
+    std::size_t& writes_;
+};
+
+/* Prints the writes per transition step with a light per write, and with a driver that commits whole patterns */
+void write_amplification(std::size_t transitions)
+{
+    std::size_t light_writes = 0;
+    auto steps = [transitions](TrafficLight& traffic_light, SimulatedClock& clock)
+    {
+        for (std::size_t j = 0; j < transitions; ++j)
+        {
+            traffic_light.MoveTo(j % 2 == 0 ? TrafficLight::State::Open : TrafficLight::State::Closed);
+        }
+        clock.RunUntil(std::chrono::hours(24 * 365));
+        return traffic_light.GetSnapshot().sequence;
+    };
+    {
+        SimulatedClock clock;
+        TrafficLight traffic_light(TrafficLight::State::Closed, clock,
+                                   [&light_writes]() { return std::make_shared<CountingLight>(light_writes); });
+        auto changes = steps(traffic_light, clock);
+        printf("Lights set one by one: %zu writes for %u state changes\n", light_writes, changes);
+    }
+    {
+        SimulatedClock clock;
+        auto driver = std::make_shared<SimulatedLightDriver>(clock);
+        TrafficLight traffic_light(TrafficLight::State::Closed, clock, driver);
+        auto changes = steps(traffic_light, clock);
+        printf("Patterns committed by a driver: %llu writes for %u state changes, which change %llu lights\n",
+               static_cast<unsigned long long>(driver->Commits()), changes,
+               static_cast<unsigned long long>(driver->ChangedLights()));
+    }
+}
+
+/* A light that counts how often it is asked for a program, which for a Python subclass means taking the GIL */
+class PlanningLight : public TrafficLight
+{
+public:
+    PlanningLight(State initial_state, Clock& clock, std::size_t& calls) :
+            TrafficLight(initial_state, clock),
+            calls_(calls)
+    {
+    }
+
+protected:
+    TransitionProgram PrepareTransition(State from_state, State target_state) override
+    {
+        calls_++;
+        return TrafficLight::PrepareTransition(from_state, target_state);
+    }
+
+private:
+    std::size_t& calls_;
+};
+
+/* Prints how often PrepareTransition is called for transitions between two states, with the plans invalidated once */
+void plan_cache(std::size_t transitions)
+{
+    std::size_t calls = 0;
+    SimulatedClock clock;
+    PlanningLight traffic_light(TrafficLight::State::Closed, clock, calls);
+    for (std::size_t j = 0; j < transitions; ++j)
+    {
+        traffic_light.MoveTo(j % 2 == 0 ? TrafficLight::State::Open : TrafficLight::State::Closed);
+        if (j == transitions / 2)
+        {
+            clock.RunUntil(std::chrono::hours(24 * 365));
+            traffic_light.InvalidatePlans();
+        }
+    }
+    clock.RunUntil(std::chrono::hours(24 * 365 * 2));
+    printf("Cached plans: PrepareTransition called %zu times for %zu transitions\n", calls, transitions);
+}
+
+/* Whether waits set up before a MoveTo(Open) see Opening, which only the start of the transition shows */
+bool opening_seen()
+{
+    using namespace std::chrono_literals;
+    SimulatedClock clock;
+    TrafficLight simulated(TrafficLight::State::Closed, clock);
+    clock.RunUntil(std::chrono::hours(1));
+    bool notified = false;
+    simulated.NotifyWhenInState(TrafficLight::State::Opening, [&notified](bool reached) { notified = reached; });
+    simulated.MoveTo(TrafficLight::State::Open);
+    clock.RunUntil(std::chrono::hours(2));
+
+    TrafficLight real_time(TrafficLight::State::Closed);
+    real_time.WaitIdle();
+    bool waited = false;
+    std::thread waiter([&]() { waited = real_time.WaitForState(TrafficLight::State::Opening, 5000ms); });
+    std::this_thread::sleep_for(50ms);
+    real_time.MoveTo(TrafficLight::State::Open);
+    waiter.join();
+    printf("Waiting for Opening: %s with a callback, %s with WaitForState\n",
+           notified ? "seen" : "missed", waited ? "seen" : "missed");
+    return notified && waited;
+}
+
+/* Whether received holds 0 .. count - 1, in order */
+bool all_in_order(const std::vector<int>& received, int count)
+{
+    bool in_order = received.size() == static_cast<std::size_t>(count);
+    for (std::size_t i = 0; in_order && i < received.size(); ++i)
+    {
+        in_order = received[i] == static_cast<int>(i);
+    }
+    return in_order;
+}
+
+/*
+ * Whether a Keep subscriber with a queue of 4 gets all events in order: 100 that are published
+ * before it runs, 100 more that its first batch publishes while the rest still wait, and,
+ * in real time, 100000 that are published while it drains the queue
+ */
+bool keep_delivers_all()
+{
+    SimulatedClock clock;
+    std::vector<int> received;
+    EventChannel<int>* publisher = nullptr;
+    auto channel = std::make_shared<EventChannel<int>>(
+            [&received, &publisher](const std::vector<int>& batch)
+            {
+                bool first = received.empty();
+                received.insert(received.end(), batch.begin(), batch.end());
+                for (int i = 100; first && i < 200; ++i)
+                {
+                    publisher->Publish(i);
+                }
+            },
+            DeliveryPolicy::Keep, 4, clock);
+    publisher = channel.get();
+    for (int i = 0; i < 100; ++i)
+    {
+        channel->Publish(i);
+    }
+    clock.RunUntil(std::chrono::hours(1));
+    channel->Close();
+    bool in_order = all_in_order(received, 200);
+
+    constexpr int concurrent = 100000;
+    Scheduler dispatcher(1);
+    std::vector<int> received_concurrently;
+    auto concurrent_channel = std::make_shared<EventChannel<int>>(
+            [&received_concurrently](const std::vector<int>& batch)
+            {
+                received_concurrently.insert(received_concurrently.end(), batch.begin(), batch.end());
+            },
+            DeliveryPolicy::Keep, 4, dispatcher);
+    for (int i = 0; i < concurrent; ++i)
+    {
+        concurrent_channel->Publish(i);
+    }
+    concurrent_channel->Flush();
+    concurrent_channel->Close();
+    bool concurrently_in_order = all_in_order(received_concurrently, concurrent);
+    printf("Keep subscriber with a queue of 4: %s when behind by 200 events, %zu of %d %s while draining\n",
+           in_order ? "in order" : "not in order", received_concurrently.size(), concurrent,
+           concurrently_in_order ? "in order" : "not in order");
+    return in_order && concurrently_in_order;
+}
+
+/* Whether MoveTo from a NotifyWhenInState callback is rejected, rather than blocking its worker, when the queue is full */
+bool callback_move_never_blocks()
+{
+    using namespace std::chrono_literals;
+    TrafficLight traffic_light(TrafficLight::State::Closed);
+    traffic_light.WaitIdle();
+    TrafficLight::QueueConfig config;
+    config.capacity = 1;
+    config.overflow = TrafficLight::OverflowPolicy::Block;
+    traffic_light.SetQueueConfig(config);
+    std::promise<TrafficLight::EnqueueResult> second;
+    traffic_light.NotifyWhenInState(TrafficLight::State::Opening, [&](bool)
+    {
+        traffic_light.MoveTo(TrafficLight::State::Closed);
+        second.set_value(traffic_light.MoveTo(TrafficLight::State::Warning));
+    });
+    traffic_light.MoveTo(TrafficLight::State::Open);
+    auto result = second.get_future();
+    bool rejected = result.wait_for(2s) == std::future_status::ready &&
+                    result.get() == TrafficLight::EnqueueResult::Rejected;
+    printf("MoveTo on a full Block queue from a callback: %s\n", rejected ? "rejected" : "blocked");
+    return rejected;
+}
+
+struct RealTimeOverride
+{
+    std::chrono::microseconds worst_delay;
+    std::chrono::microseconds worst_destruction;
+};
+
+/* The same in real time, for requests while the light shows Open, and the time to destroy a light in transition */
+RealTimeOverride real_time_override(int trials)
+{
+    using namespace std::chrono_literals;
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    using std::chrono::steady_clock;
+    RealTimeOverride result{0us, 0us};
+    for (int i = 0; i < trials; ++i)
+    {
+        auto traffic_light = std::make_unique<TrafficLight>(TrafficLight::State::Open);
+        traffic_light->WaitForState(TrafficLight::State::Open);
+        std::this_thread::sleep_for(100ms);
+        auto requested = steady_clock::now();
+        traffic_light->MoveTo(TrafficLight::State::Warning, TrafficLight::Priority::Emergency);
+        traffic_light->WaitForState(TrafficLight::State::Warning);
+        result.worst_delay = std::max(result.worst_delay, duration_cast<microseconds>(steady_clock::now() - requested));
+
+        traffic_light->MoveTo(TrafficLight::State::Closed);
+        traffic_light->MoveTo(TrafficLight::State::Open);
+        traffic_light->WaitForState(TrafficLight::State::Closing);
+        auto destroying = steady_clock::now();
+        traffic_light.reset();
+        result.worst_destruction = std::max(result.worst_destruction,
+                                            duration_cast<microseconds>(steady_clock::now() - destroying));
+    }
+    return result;
+}
+}
+
+int main()
+{
+    constexpr std::size_t lights = 8;
+    constexpr std::size_t transitions = 200000;
+    for (bool subscribed : {false, true})
+    {
+        double rate = transitions_per_second(lights, transitions, subscribed);
+        printf("%zu lights, %zu transitions each, %s: %.0f transitions/s\n", lights, transitions,
+               subscribed ? "with a subscriber" : "without subscribers", rate);
+    }
+    /* Every change is also written to a shared memory segment */
+    SharedStatePublisher::Default().Open("/traffic_benchmark");
+    printf("%zu lights, %zu transitions each, publishing to shared memory: %.0f transitions/s\n", lights, transitions,
+           transitions_per_second(lights, transitions, false));
+    SharedStatePublisher::Default().Close();
+
+    write_amplification(10000);
+    plan_cache(10000);
+
+    /* Allows for the time the scheduler takes to run a due task */
+    constexpr auto tolerance = std::chrono::milliseconds(50);
+    auto bound = TrafficLight::MaxOverrideDelay();
+    auto simulated = simulated_override_delay();
+    auto real_time = real_time_override(5);
+    printf("Emergency override: at most %lld ms in simulated time, %lld us in real time, bound %lld ms\n",
+           static_cast<long long>(simulated.count()), static_cast<long long>(real_time.worst_delay.count()),
+           static_cast<long long>(bound.count()));
+    printf("Destroying a light in transition: at most %lld us\n",
+           static_cast<long long>(real_time.worst_destruction.count()));
+    if (simulated > bound || real_time.worst_delay > bound + tolerance || real_time.worst_destruction > tolerance)
+    {
+        printf("FAILED: slower than the bound\n");
+        return 1;
+    }
+    if (!opening_seen())
+    {
+        printf("FAILED: a state that is passed through was missed\n");
+        return 1;
+    }
+    if (!keep_delivers_all())
+    {
+        printf("FAILED: a subscriber that keeps every change lost one\n");
+        return 1;
+    }
+    if (!callback_move_never_blocks())
+    {
+        printf("FAILED: a callback blocked a Scheduler worker\n");
+        return 1;
+    }
+}
@@ -0,0 +1,201 @@
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "binary_log.h"
+
+namespace
+{
+template<typename TimeSource>
+std::int64_t NanosecondsSinceEpoch()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(TimeSource::now().time_since_epoch()).count();
+}
+}
+
+BinaryLog::ThreadBuffer::ThreadBuffer(std::uint32_t thread) :
+        ring(buffer_capacity),
+        thread(thread),
+        exited(false)
+{
+}
+
+BinaryLog::BinaryLog() :
+        open_(false),
+        buffers_mutex_(),
+        buffers_(),
+        next_thread_(0),
+        drain_mutex_(),
+        drain_cv_(),
+        stopping_(false),
+        drainer_(),
+        file_(),
+        batch_(),
+        written_(0),
+        dropped_(0),
+        open_mutex_()
+{
+}
+
+BinaryLog& BinaryLog::Default()
+{
+    static BinaryLog* instance = []()
+    {
+        auto log = new BinaryLog();
+        std::atexit([]() { Default().Close(); });
+        return log;
+    }();
+    return *instance;
+}
+
+void BinaryLog::Open(const std::string& path, std::chrono::milliseconds drain_interval)
+{
+    std::lock_guard<std::mutex> lock(open_mutex_);
+    CloseFile();
+    /* Records that were written while the previous file was being closed */
+    Drain(false);
+    file_.open(path, std::ios::binary | std::ios::trunc);
+    if (!file_)
+    {
+        throw std::runtime_error("Cannot open " + path + " for the log");
+    }
+    LogFileHeader header{{}, file_version, sizeof(LogRecord),
+                         NanosecondsSinceEpoch<std::chrono::steady_clock>(),
+                         NanosecondsSinceEpoch<std::chrono::system_clock>()};
+    std::memcpy(header.magic, file_magic, sizeof(header.magic));
+    file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    written_ = 0;
+    dropped_ = 0;
+    stopping_ = false;
+    drainer_ = std::thread([this, drain_interval]() { DrainLoop(drain_interval); });
+    open_ = true;
+}
+
+void BinaryLog::Close()
+{
+    std::lock_guard<std::mutex> lock(open_mutex_);
+    CloseFile();
+}
+
+void BinaryLog::CloseFile()
+{
+    if (!open_)
+    {
+        return;
+    }
+    open_ = false;
+    {
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        stopping_ = true;
+    }
+    drain_cv_.notify_all();
+    drainer_.join();
+    Drain(true);
+    file_.close();
+}
+
+std::uint64_t BinaryLog::Written() const
+{
+    return written_;
+}
+
+std::uint64_t BinaryLog::Dropped() const
+{
+    return dropped_;
+}
+
+void BinaryLog::Append(LogEvent event, const void* object, std::uint64_t value)
+{
+    auto& buffer = LocalBuffer();
+    LogRecord record{NanosecondsSinceEpoch<std::chrono::steady_clock>(),
+                     reinterpret_cast<std::uintptr_t>(object), value, buffer.thread,
+                     static_cast<std::uint16_t>(event), 0};
+    if (!buffer.ring.TryPush(record))
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+BinaryLog::ThreadBuffer& BinaryLog::LocalBuffer()
+{
+    /* Owns the buffer of the thread, and marks it when the thread ends */
+    struct Handle
+    {
+        std::shared_ptr<ThreadBuffer> buffer;
+
+        ~Handle()
+        {
+            if (buffer)
+            {
+                buffer->exited = true;
+            }
+        }
+    };
+    thread_local Handle handle;
+    if (!handle.buffer)
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex_);
+        handle.buffer = std::make_shared<ThreadBuffer>(next_thread_++);
+        buffers_.push_back(handle.buffer);
+    }
+    return *handle.buffer;
+}
+
+void BinaryLog::DrainLoop(std::chrono::milliseconds drain_interval)
+{
+    std::unique_lock<std::mutex> lock(drain_mutex_);
+    while (!stopping_)
+    {
+        drain_cv_.wait_for(lock, drain_interval, [this]() { return stopping_; });
+        lock.unlock();
+        Drain(true);
+        lock.lock();
+    }
+}
+
+void BinaryLog::Drain(bool write)
+{
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex_);
+        buffers = buffers_;
+    }
+    batch_.clear();
+    LogRecord record;
+    for (auto& buffer : buffers)
+    {
+        /* At most a buffer full, so a thread that keeps writing cannot keep the others waiting */
+        for (std::size_t i = 0; i < buffer->ring.Capacity() && buffer->ring.TryPop(record); ++i)
+        {
+            batch_.push_back(record);
+        }
+    }
+    if (write && !batch_.empty())
+    {
+        file_.write(reinterpret_cast<const char*>(batch_.data()),
+                    static_cast<std::streamsize>(batch_.size() * sizeof(LogRecord)));
+        file_.flush();
+        written_ += batch_.size();
+    }
+
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    std::erase_if(buffers_, [](const auto& buffer) { return buffer->exited && buffer->ring.Empty(); });
+}
+
+std::vector<LogRecord> BinaryLog::ReadFile(const std::string& path, LogFileHeader& header)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, file_magic, sizeof(header.magic)) != 0 ||
+        header.version != file_version || header.record_size != sizeof(LogRecord))
+    {
+        throw std::runtime_error(path + " is not a log file");
+    }
+    std::vector<LogRecord> records;
+    LogRecord record;
+    while (file.read(reinterpret_cast<char*>(&record), sizeof(record)))
+    {
+        records.push_back(record);
+    }
+    return records;
+}
@@ -0,0 +1,154 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_BINARY_LOG_H
+#define PYTHON_C_C_EXAMPLE_4_BINARY_LOG_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "spsc_ring.h"
+
+/* What a log record is about; the meaning of its value depends on it */
+enum class LogEvent : std::uint16_t
+{
+    /* A MoveTo call: the target state, the priority << 8, and the EnqueueResult << 16 */
+    MoveRequested,
+    /* A transition that starts: the state it starts from, and the target state << 8 */
+    TransitionStarted,
+    /* A new snapshot of a traffic light, packed by TrafficLight::PackSnapshot */
+    StateChanged,
+    /* A traffic light that is destroyed */
+    LightDestroyed,
+    /* An exception thrown by a subscriber callback: the number of exceptions so far */
+    CallbackError,
+    /* A snapshot seen by a monitor of a demo, packed by TrafficLight::PackSnapshot */
+    Monitor
+};
+
+constexpr std::array<std::string_view, 6> log_event_names{
+        "MoveRequested", "TransitionStarted", "StateChanged", "LightDestroyed", "CallbackError", "Monitor"};
+
+static_assert(log_event_names.size() == static_cast<std::size_t>(LogEvent::Monitor) + 1,
+              "Every log event must have a name");
+
+/* One event, in the machine's byte order, as it is written to the file */
+struct LogRecord
+{
+    /* steady_clock time of the event */
+    std::int64_t time_ns;
+    /* The address of the object the event is about, which tells objects apart */
+    std::uint64_t object;
+    std::uint64_t value;
+    /* Numbered in the order in which threads first write to the log */
+    std::uint32_t thread;
+    std::uint16_t event;
+    std::uint16_t reserved;
+};
+
+static_assert(sizeof(LogRecord) == 32, "LogRecord must not have padding");
+
+/*
+ * The file starts with this header, which has the steady_clock and system_clock times
+ * of the moment it was opened, so that the record times can be shown as wall clock times.
+ */
+struct LogFileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t record_size;
+    std::int64_t steady_origin_ns;
+    std::int64_t system_origin_ns;
+};
+
+/*
+ * A log of fixed-size binary records, for tracing without slowing down what is traced.
+ *
+ * Every thread writes to a ring buffer of its own, so writing takes no lock and makes
+ * no system call; when the buffer is full, the record is dropped and counted.
+ * A background thread drains the buffers to the file at a fixed interval.
+ * The records of different threads are therefore not in time order in the file;
+ * the decode_log tool sorts them. While the log is closed, writing a record costs one atomic load.
+ */
+class BinaryLog
+{
+public:
+    static constexpr char file_magic[8] = {'T', 'L', 'L', 'O', 'G', '\0', '\0', '\0'};
+    static constexpr std::uint32_t file_version = 1;
+    static constexpr std::size_t buffer_capacity = 4096;
+
+    /* The log of the process, which is never destroyed, so it can be written to during exit */
+    static BinaryLog& Default();
+
+    BinaryLog(const BinaryLog&) = delete;
+    BinaryLog& operator=(const BinaryLog&) = delete;
+
+    /* Start writing to a new file at path, closing the current one. Throws std::runtime_error. */
+    void Open(const std::string& path, std::chrono::milliseconds drain_interval = std::chrono::milliseconds(10));
+    /* Write what is buffered, and close the file */
+    void Close();
+
+    void Write(LogEvent event, const void* object, std::uint64_t value)
+    {
+        if (open_.load(std::memory_order_relaxed))
+        {
+            Append(event, object, value);
+        }
+    }
+
+    /* The numbers of records written to the file, and dropped because a buffer was full, since Open */
+    std::uint64_t Written() const;
+    std::uint64_t Dropped() const;
+
+    /* Read a file written by a log, with its header. Throws std::runtime_error for a file in another format. */
+    static std::vector<LogRecord> ReadFile(const std::string& path, LogFileHeader& header);
+
+private:
+    struct ThreadBuffer
+    {
+        explicit ThreadBuffer(std::uint32_t thread);
+
+        SpscRing<LogRecord> ring;
+        const std::uint32_t thread;
+        /* Set when the thread ends, after which the buffer is removed once it is drained */
+        std::atomic<bool> exited;
+    };
+
+    BinaryLog();
+
+    void Append(LogEvent event, const void* object, std::uint64_t value);
+    ThreadBuffer& LocalBuffer();
+    void DrainLoop(std::chrono::milliseconds drain_interval);
+    /* With open_mutex_ held */
+    void CloseFile();
+    /* Only called by one thread at a time, the drain thread or the one that opens or closes */
+    void Drain(bool write);
+
+    std::atomic<bool> open_;
+
+    std::mutex buffers_mutex_;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+    std::uint32_t next_thread_;
+
+    std::mutex drain_mutex_;
+    std::condition_variable drain_cv_;
+    bool stopping_;
+    std::thread drainer_;
+    std::ofstream file_;
+    std::vector<LogRecord> batch_;
+    std::atomic<std::uint64_t> written_;
+    std::atomic<std::uint64_t> dropped_;
+
+    /* Serializes Open and Close */
+    std::mutex open_mutex_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_BINARY_LOG_H
@@ -0,0 +1,42 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_CLOCK_H
+#define PYTHON_C_C_EXAMPLE_4_CLOCK_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+/*
+ * The time source of a traffic light, which also runs its delayed work.
+ * Scheduler runs tasks in real time; SimulatedClock runs them in virtual time,
+ * as fast as possible.
+ */
+class Clock
+{
+public:
+    using Duration = std::chrono::milliseconds;
+    using Task = std::function<void()>;
+    using TimerId = std::uint64_t;
+
+    virtual ~Clock() = default;
+
+    /* Time since the clock started */
+    virtual Duration Now() const = 0;
+
+    /* Run task once delay has passed */
+    virtual TimerId Schedule(Duration delay, Task task) = 0;
+
+    /*
+     * Cancel a task that has not started yet. Returns whether it was cancelled.
+     * A clock may start a task with a delay of zero or less at once, and then cannot cancel it;
+     * the caller must be prepared for a false result, as for a task that is already running.
+     */
+    virtual bool Cancel(TimerId id) = 0;
+
+    /* Whether time only advances when the owner of the clock says so */
+    virtual bool IsSimulated() const
+    {
+        return false;
+    }
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_CLOCK_H
@@ -0,0 +1,106 @@
+/*
+ * Turns a log written by BinaryLog into text, one line per record, in time order:
+ * the seconds since the log was opened, the thread, the event, the object, and what the value means.
+ * Objects are numbered in the order in which they first appear, rather than shown as addresses.
+ */
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "binary_log.h"
+#include "traffic_light.h"
+
+namespace
+{
+constexpr std::array<std::string_view, 2> priority_names{"Normal", "Emergency"};
+constexpr std::array<std::string_view, 6> enqueue_result_names{
+        "Queued", "Coalesced", "Replaced", "Rejected", "TimedOut", "Invalid"};
+
+static_assert(priority_names.size() == static_cast<std::size_t>(TrafficLight::Priority::Emergency) + 1,
+              "Every priority must have a name");
+static_assert(enqueue_result_names.size() == static_cast<std::size_t>(TrafficLight::EnqueueResult::Invalid) + 1,
+              "Every enqueue result must have a name");
+
+/* The name at index of names, or a placeholder for a value that no version of the enum has */
+template<std::size_t size>
+std::string_view Name(const std::array<std::string_view, size>& names, std::uint64_t index)
+{
+    return index < size ? names[index] : std::string_view("?");
+}
+
+std::string_view StateName(std::uint64_t state)
+{
+    return Name(TrafficLight::state_names, state);
+}
+
+std::string DescribeSnapshot(std::uint64_t packed)
+{
+    auto snapshot = TrafficLight::UnpackSnapshot(packed);
+    std::string description = "#" + std::to_string(snapshot.sequence) + " " +
+                              std::string(StateName(static_cast<std::uint64_t>(snapshot.state))) + " (";
+    for (std::size_t i = 0; i < TrafficLight::light_count; ++i)
+    {
+        description += (i ? ", " : "") + TrafficLight::light_names[i] + ": " +
+                       std::string(Name(Light::state_names, static_cast<std::uint64_t>(snapshot.pattern[i])));
+    }
+    return description + ")";
+}
+
+std::string Describe(const LogRecord& record)
+{
+    auto field = [&record](unsigned index) { return (record.value >> (8 * index)) & 0xff; };
+    switch (static_cast<LogEvent>(record.event))
+    {
+        case LogEvent::MoveRequested:
+            return "to " + std::string(StateName(field(0))) + ", " + std::string(Name(priority_names, field(1))) +
+                   ": " + std::string(Name(enqueue_result_names, field(2)));
+        case LogEvent::TransitionStarted:
+            return "from " + std::string(StateName(field(0))) + " to " + std::string(StateName(field(1)));
+        case LogEvent::StateChanged:
+        case LogEvent::Monitor:
+            return DescribeSnapshot(record.value);
+        case LogEvent::LightDestroyed:
+            return "";
+        case LogEvent::CallbackError:
+            return std::to_string(record.value) + " so far";
+    }
+    return "value " + std::to_string(record.value);
+}
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        std::fprintf(stderr, "Usage: %s LOG_FILE\n", argv[0]);
+        return 2;
+    }
+    LogFileHeader header{};
+    std::vector<LogRecord> records;
+    try
+    {
+        records = BinaryLog::ReadFile(argv[1], header);
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const LogRecord& a, const LogRecord& b) { return a.time_ns < b.time_ns; });
+
+    std::map<std::uint64_t, std::size_t> objects;
+    for (const auto& record : records)
+    {
+        auto object = objects.try_emplace(record.object, objects.size() + 1).first->second;
+        auto event = record.event < log_event_names.size() ? log_event_names[record.event] : std::string_view("Unknown");
+        std::printf("%14.6f  thread %-3u %-18.*s object %-4zu %s\n",
+                    static_cast<double>(record.time_ns - header.steady_origin_ns) / 1e9, record.thread,
+                    static_cast<int>(event.size()), event.data(), object, Describe(record).c_str());
+    }
+}
@@ -1,10 +1,30 @@
+import asyncio
+import os
+import tempfile
 import traffic
-from datetime import datetime
-import time
+from datetime import datetime, timedelta
+
+import numpy as np
 
 
 def monitor(tl):
-    print(f"{datetime.now().time()} {tl.state.name} ({', '.join(f'{n}: {s.name}' for n, s in zip(tl.names, tl.pattern))})")
+    # The state and the pattern as they were at the same moment
+    snapshot = tl.snapshot
+    print(f"{datetime.now().time()} #{snapshot.sequence} {snapshot.state.name} "
+          f"({', '.join(f'{n}: {s.name}' for n, s in zip(tl.names, snapshot.pattern))})")
+
+
+def log_changes(tl, changes):
+    print(f"Batch of {len(changes)}: {', '.join(f'{c.state.name} at {c.time}' for c in changes)}")
+
+
+async def open_and_close(tl):
+    tl.MoveTo(tl.State.Open)
+    await tl.wait_for_state_async(tl.State.Open)
+    print("Open, now closing again")
+    tl.MoveTo(tl.State.Closed)
+    await asyncio.wait_for(tl.wait_idle_async(), timeout=10)
+    print(f"Idle in state {tl.state.name}")
 
 
 def force_closed(tl):
@@ -13,6 +33,8 @@ def force_closed(tl):
 
 
 if __name__ == '__main__':
+    log_path = os.path.join(tempfile.gettempdir(), "demo.tlog")
+    traffic.open_log(log_path)
     print("Testing light")
     l = traffic.Light()
     print(f"New light should be off. Actual state is {l.state.name}")
@@ -29,6 +51,137 @@ if __name__ == '__main__':
     t.MoveTo(t.State.Closed)
     print("Moving to Open (expect return to Closed)")
     t.MoveTo(t.State.Open)
-    while t.in_transition:
-        time.sleep(0.1)
+    t.wait_idle()
+    print()
+    print("Testing batched delivery")
+    subscription = t.Subscribe(log_changes, traffic.DeliveryPolicy.Drop)
+    t.MoveTo(t.State.Warning)
+    t.MoveTo(t.State.Off)
+    t.wait_idle()
+    # The last batch may still be on its way from the dispatcher thread
+    subscription.flush()
+    metrics = subscription.metrics
+    print(f"Delivered {metrics.delivered} of {metrics.published} changes in {metrics.batches} batches, "
+          f"maximum lag {metrics.max_lag}")
+    t.Unsubscribe(subscription)
+    print()
+    print("Testing waiting with asyncio")
+    asyncio.run(open_and_close(t))
 
+    print()
+    print("Testing traffic light on a simulated clock")
+    sim = traffic.SimulatedClock()
+    s = traffic.TrafficLight(clock=sim)
+    s.AddCallback(lambda tl: print(f"{sim.now} {tl.state.name}"))
+    s.AddCallback(force_closed)
+    s.MoveTo(s.State.Closed)
+    s.MoveTo(s.State.Open)
+    s.MoveTo(s.State.Warning)
+    # A minute of traffic light time passes without waiting for it
+    events = sim.run_for(timedelta(minutes=1))
+    print(f"Ran {events} events, simulated time is now {sim.now}")
+    print()
+    print("Testing a grid of traffic lights")
+    grid_clock = traffic.SimulatedClock()
+    grid = traffic.TrafficLightGrid(50000, clock=grid_clock)
+    states = grid.states  # A view, which follows the grid
+    grid.MoveTo(np.arange(0, len(grid), 2), traffic.TrafficLight.State.Closed)
+    grid.MoveTo(np.arange(1, len(grid), 2), traffic.TrafficLight.State.Warning)
+    for seconds in (1, 2, 3):
+        grid_clock.run_until(timedelta(seconds=seconds))
+        counts = np.bincount(states, minlength=len(traffic.TrafficLight.State.__members__))
+        print(f"{grid_clock.now}: " + ", ".join(f"{name}: {counts[int(state)]}"
+                                                for name, state in traffic.TrafficLight.State.__members__.items()))
+    print(f"Red lights on: {np.count_nonzero(grid.patterns[:, 0] == int(traffic.Light.On))}")
+    print()
+    print("Testing the transition history")
+    history_light = traffic.TrafficLight(clock=sim)
+    history = history_light.EnableHistory(capacity=16)
+    history_path = os.path.join(tempfile.gettempdir(), "traffic_history.bin")
+    if os.path.exists(history_path):
+        os.remove(history_path)
+    history.spill_to(history_path)
+    for i in range(20):
+        history_light.MoveTo(history_light.State.Open if i % 2 else history_light.State.Closed)
+    sim.run_for(timedelta(hours=1))
+    ring = np.asarray(history)  # No copy: a view of the ring buffer
+    print(f"{history.head} records, the ring holds the last {len(ring)}; newest: {ring[(history.head - 1) % len(ring)]}")
+    history.flush()
+    spilled = traffic.read_history_file(history_path)
+    print(f"Spilled {len(spilled)} records, from {spilled['clock_ms'][0]} ms to {spilled['clock_ms'][-1]} ms")
+    print()
+    print("Latency of the traffic light on the simulated clock")
+    stats = s.stats()
+    if stats is not None:
+        for name, summary in stats.items():
+            print(f"{name}: {summary['count']} samples, p50 {summary['p50']}, p99 {summary['p99']}, max {summary['max']}")
+        s.write_stats(os.path.join(tempfile.gettempdir(), "traffic_light.prom"), {"light": "simulated"})
+    print()
+    print("Testing a flapping controller with a bounded, coalescing queue")
+    flapping = traffic.TrafficLight(clock=sim)
+    flapping.queue_config = traffic.TrafficLight.QueueConfig(policy=traffic.TrafficLight.QueuePolicy.LatestOnly)
+    results = [flapping.MoveTo(flapping.State.Open if i % 2 else flapping.State.Closed) for i in range(100)]
+    print({result.name: results.count(result) for result in set(results)}, f"queue length {flapping.queue_length}")
+    sim.run_for(timedelta(minutes=1))
+    print(f"Ends {flapping.state.name}")
+    print()
+    print("Testing an emergency override")
+    override = traffic.TrafficLight(traffic.TrafficLight.State.Open, clock=sim)
+    warnings = []
+    override.AddCallback(lambda tl: warnings.append(sim.now) if tl.state == tl.State.Warning else None)
+    sim.run_for(timedelta(seconds=5))
+    override.MoveTo(override.State.Closed)
+    override.MoveTo(override.State.Open)
+    sim.run_for(timedelta(seconds=1))
+    # During Closing, which always runs to its end
+    requested = sim.now
+    print(f"Emergency request: {override.MoveTo(override.State.Warning, override.Priority.Emergency).name}")
+    sim.run_for(timedelta(minutes=1))
+    print(f"Warning after {warnings[0] - requested}, the bound is {traffic.TrafficLight.max_override_delay}")
+    print()
+    print("Testing a light driver that records its commits")
+    driver = traffic.SimulatedLightDriver(clock=sim)
+    driven = traffic.TrafficLight(clock=sim, driver=driver)
+    for state in (driven.State.Open, driven.State.Closed, driven.State.Warning):
+        driven.MoveTo(state)
+    sim.run_for(timedelta(minutes=1))
+    print(f"{driver.commits} commits changed {driver.changed_lights} lights, "
+          f"{3 * driver.commits} writes with a Light per light; last {driver.last_pattern}")
+    print()
+    print("Testing a light with its own transition programs")
+
+    class SlowAmberLight(traffic.TrafficLight):
+        """Shows every step twice as long as the built-in programs"""
+
+        def __init__(self, *args, **kwargs):
+            super().__init__(*args, **kwargs)
+            self.plans = 0
+
+        def PrepareTransition(self, from_state, target_state):
+            self.plans += 1
+            return [traffic.TrafficLight.TransitionStep(step.state, step.pattern, step.delay * 2)
+                    for step in self.default_program(from_state, target_state)]
+
+    slow = SlowAmberLight(traffic.TrafficLight.State.Closed, clock=sim)
+    sim.run_for(timedelta(minutes=1))
+    for i in range(10):
+        slow.MoveTo(slow.State.Open if i % 2 == 0 else slow.State.Closed)
+    sim.run_for(timedelta(minutes=5))
+    slow.invalidate_plans()
+    slow.MoveTo(slow.State.Open)
+    sim.run_for(timedelta(minutes=1))
+    print(f"11 transitions, {slow.plans} calls of PrepareTransition, ends {slow.state.name}")
+    print()
+    print("Testing the shared memory state, as a monitor in another process would read it")
+    traffic.open_shared_state("/traffic_demo")
+    published = [traffic.TrafficLight(state, clock=sim) for state in (traffic.TrafficLight.State.Open,
+                                                                       traffic.TrafficLight.State.Warning)]
+    sim.run_for(timedelta(minutes=1))
+    reader = traffic.SharedStateReader("/traffic_demo")
+    for slot in reader.read():
+        record = slot["record"]
+        print(f"Light {slot['light']}: {traffic.TrafficLight.State(int(record['state'])).name}, "
+              f"pattern {list(record['pattern'])}, sequence {record['sequence']}")
+    traffic.close_shared_state()
+    print()
+    print(f"Logged {traffic.close_log()} records to {log_path}, decode them with decode_log")
@@ -0,0 +1,385 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_EVENT_CHANNEL_H
+#define PYTHON_C_C_EXAMPLE_4_EVENT_CHANNEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "binary_log.h"
+#include "clock.h"
+#include "latency_stats.h"
+#include "mpsc_ring.h"
+
+/* What a subscriber gets when it falls behind, and its queue fills up */
+enum class DeliveryPolicy
+{
+    /* Every queued event, in order; events published while the queue is full are dropped */
+    Drop,
+    /* Only the latest event, which replaces the ones that were not delivered yet */
+    Coalesce,
+    /* Every event, in order; events published while the queue is full wait in an unbounded overflow */
+    Keep
+};
+
+struct DeliveryMetrics
+{
+    std::uint64_t published;
+    std::uint64_t delivered;
+    std::uint64_t dropped;
+    std::uint64_t coalesced;
+    std::uint64_t batches;
+    /* Exceptions thrown by the callback, which are reported and otherwise ignored */
+    std::uint64_t errors;
+    std::size_t queue_depth;
+    std::size_t max_queue_depth;
+    /* Time from publishing an event to the start of the callback that receives it */
+    std::chrono::microseconds last_lag;
+    std::chrono::microseconds max_lag;
+    std::chrono::microseconds mean_lag;
+};
+
+namespace event_channel_detail
+{
+/* Set while a thread runs a delivery callback, which must not wait for deliveries itself */
+inline thread_local bool delivering = false;
+}
+
+/*
+ * Delivers the events of one publisher to one subscriber, without making the publisher wait.
+ *
+ * Publish puts the event in a lock-free ring buffer, and, if no delivery is pending yet,
+ * schedules one on the dispatcher clock; the publisher never runs the callback itself.
+ * A delivery hands everything that was queued to the callback as one batch.
+ * At most one delivery runs at a time, so the callback needs no locking of its own.
+ */
+template<typename Event>
+class EventChannel : public std::enable_shared_from_this<EventChannel<Event>>
+{
+public:
+    using BatchCallback = std::function<void(const std::vector<Event>&)>;
+    using SteadyClock = std::chrono::steady_clock;
+
+    /* If callback_durations is given, it records how long every call of callback takes, and must outlive the channel */
+    EventChannel(BatchCallback callback, DeliveryPolicy policy, std::size_t capacity, Clock& dispatcher,
+                 LatencyHistogram* callback_durations = nullptr) :
+            callback_(std::move(callback)),
+            policy_(policy),
+            dispatcher_(dispatcher),
+            callback_durations_(callback_durations),
+            ring_(capacity),
+            next_sequence_(0),
+            scheduled_(false),
+            overflow_mutex_(),
+            overflow_(),
+            kept_(),
+            keeping_(false),
+            state_mutex_(),
+            idle_cv_(),
+            draining_(false),
+            closed_(false),
+            published_(0),
+            delivered_(0),
+            dropped_(0),
+            coalesced_(0),
+            batches_(0),
+            errors_(0),
+            max_queue_depth_(0),
+            last_lag_us_(0),
+            max_lag_us_(0),
+            total_lag_us_(0)
+    {
+    }
+
+    EventChannel(const EventChannel&) = delete;
+    EventChannel& operator=(const EventChannel&) = delete;
+
+    DeliveryPolicy Policy() const
+    {
+        return policy_;
+    }
+
+    /* Safe to call from any thread. Only takes a lock when a coalescing or keeping queue is full. */
+    void Publish(Event event)
+    {
+        if (closed_)
+        {
+            return;
+        }
+        Stamped stamped{std::move(event), next_sequence_++, SteadyClock::now()};
+        published_++;
+        bool kept = false;
+        if (policy_ == DeliveryPolicy::Keep && keeping_)
+        {
+            /* Queue behind the events that already overflowed, rather than overtake them through the ring */
+            std::lock_guard<std::mutex> lock(overflow_mutex_);
+            if (keeping_)
+            {
+                kept_.push_back(std::move(stamped));
+                kept = true;
+            }
+        }
+        if (!kept && !ring_.TryPush(std::move(stamped)))
+        {
+            if (policy_ == DeliveryPolicy::Drop)
+            {
+                dropped_++;
+                return;
+            }
+            std::lock_guard<std::mutex> lock(overflow_mutex_);
+            if (policy_ == DeliveryPolicy::Keep)
+            {
+                kept_.push_back(std::move(stamped));
+                keeping_ = true;
+            }
+            else if (!overflow_)
+            {
+                overflow_ = std::move(stamped);
+            }
+            else
+            {
+                coalesced_++;
+                if (stamped.sequence > overflow_->sequence)
+                {
+                    *overflow_ = std::move(stamped);
+                }
+            }
+        }
+        UpdateMax(max_queue_depth_, ring_.Size());
+        /* Pairs with the fence in Drain: either it sees the new event, or this sees it is done */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!scheduled_.exchange(true))
+        {
+            dispatcher_.Schedule(Clock::Duration::zero(), [self = this->shared_from_this()]() { self->Drain(); });
+        }
+    }
+
+    /* Wait until the events that were published so far have been delivered */
+    void Flush()
+    {
+        std::unique_lock<std::mutex> lock(state_mutex_);
+        if (event_channel_detail::delivering)
+        {
+            /* The dispatcher is busy with this call, so it cannot deliver anything now */
+            return;
+        }
+        idle_cv_.wait(lock, [this]() { return closed_ || (!scheduled_ && !draining_); });
+    }
+
+    /*
+     * Stop delivering. Afterwards, the callback is not called anymore, and is not running,
+     * unless Close is called by the callback itself.
+     */
+    void Close()
+    {
+        std::unique_lock<std::mutex> lock(state_mutex_);
+        closed_ = true;
+        if (!event_channel_detail::delivering)
+        {
+            idle_cv_.wait(lock, [this]() { return !draining_; });
+        }
+    }
+
+    DeliveryMetrics Metrics() const
+    {
+        std::uint64_t delivered = delivered_;
+        return {published_, delivered, dropped_, coalesced_, batches_, errors_,
+                ring_.Size(), max_queue_depth_,
+                std::chrono::microseconds(last_lag_us_), std::chrono::microseconds(max_lag_us_),
+                std::chrono::microseconds(delivered ? total_lag_us_ / delivered : 0)};
+    }
+
+private:
+    struct Stamped
+    {
+        Event event;
+        std::uint64_t sequence;
+        SteadyClock::time_point published;
+    };
+
+    static void UpdateMax(std::atomic<std::uint64_t>& maximum, std::uint64_t value)
+    {
+        std::uint64_t current = maximum.load(std::memory_order_relaxed);
+        while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    /* Take what is queued, in publishing order, and reduce it to what the policy delivers */
+    void TakeBatch(std::vector<Stamped>& batch)
+    {
+        Stamped stamped;
+        bool drained = false;
+        for (std::size_t i = 0; i < ring_.Capacity(); ++i)
+        {
+            if (!ring_.TryPop(stamped))
+            {
+                drained = true;
+                break;
+            }
+            batch.push_back(std::move(stamped));
+        }
+        if (policy_ == DeliveryPolicy::Keep)
+        {
+            if (!drained)
+            {
+                /* The kept events are later than whatever is still in the ring */
+                return;
+            }
+            std::lock_guard<std::mutex> lock(overflow_mutex_);
+            batch.insert(batch.end(), std::make_move_iterator(kept_.begin()), std::make_move_iterator(kept_.end()));
+            kept_.clear();
+            keeping_ = false;
+            return;
+        }
+        if (policy_ != DeliveryPolicy::Coalesce)
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(overflow_mutex_);
+            if (overflow_)
+            {
+                batch.push_back(std::move(*overflow_));
+                overflow_.reset();
+            }
+        }
+        if (batch.size() > 1)
+        {
+            auto latest = std::max_element(batch.begin(), batch.end(),
+                                           [](const Stamped& a, const Stamped& b) { return a.sequence < b.sequence; });
+            coalesced_ += batch.size() - 1;
+            std::swap(batch.front(), *latest);
+            batch.resize(1);
+        }
+    }
+
+    void Deliver(std::vector<Stamped>& batch, std::vector<Event>& events)
+    {
+        auto now = SteadyClock::now();
+        events.clear();
+        for (auto& stamped : batch)
+        {
+            auto lag = static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(now - stamped.published).count());
+            last_lag_us_ = lag;
+            UpdateMax(max_lag_us_, lag);
+            total_lag_us_ += lag;
+            events.push_back(std::move(stamped.event));
+        }
+        delivered_ += events.size();
+        batches_++;
+        try
+        {
+            if constexpr (latency_stats_enabled)
+            {
+                if (callback_durations_)
+                {
+                    auto start = SteadyClock::now();
+                    callback_(events);
+                    callback_durations_->Record(SteadyClock::now() - start);
+                    return;
+                }
+            }
+            callback_(events);
+        }
+        catch (const std::exception& e)
+        {
+            BinaryLog::Default().Write(LogEvent::CallbackError, this, ++errors_);
+            std::cerr << "Exception in event callback: " << e.what() << '\n';
+        }
+    }
+
+    bool KeptEmpty()
+    {
+        if (policy_ != DeliveryPolicy::Keep)
+        {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(overflow_mutex_);
+        return kept_.empty();
+    }
+
+    void Drain()
+    {
+        {
+            std::lock_guard<std::mutex> lock(state_mutex_);
+            if (closed_)
+            {
+                scheduled_ = false;
+                idle_cv_.notify_all();
+                return;
+            }
+            draining_ = true;
+        }
+        event_channel_detail::delivering = true;
+        std::vector<Stamped> batch;
+        std::vector<Event> events;
+        while (true)
+        {
+            batch.clear();
+            TakeBatch(batch);
+            if (!batch.empty() && !closed_)
+            {
+                Deliver(batch, events);
+                continue;
+            }
+            scheduled_ = false;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (closed_ || (ring_.Empty() && KeptEmpty()) || scheduled_.exchange(true))
+            {
+                break;
+            }
+        }
+        event_channel_detail::delivering = false;
+        std::lock_guard<std::mutex> lock(state_mutex_);
+        draining_ = false;
+        idle_cv_.notify_all();
+    }
+
+    const BatchCallback callback_;
+    const DeliveryPolicy policy_;
+    Clock& dispatcher_;
+    LatencyHistogram* const callback_durations_;
+
+    MpscRing<Stamped> ring_;
+    std::atomic<std::uint64_t> next_sequence_;
+    /* Whether a delivery is scheduled or running, which new events then do not have to schedule */
+    std::atomic<bool> scheduled_;
+
+    /* The latest event that did not fit in the ring, for Coalesce, and all of them, for Keep */
+    std::mutex overflow_mutex_;
+    std::optional<Stamped> overflow_;
+    std::deque<Stamped> kept_;
+    /* Whether kept_ has events, which new Keep events then have to queue behind */
+    std::atomic<bool> keeping_;
+
+    std::mutex state_mutex_;
+    std::condition_variable idle_cv_;
+    bool draining_;
+    std::atomic<bool> closed_;
+
+    std::atomic<std::uint64_t> published_;
+    std::atomic<std::uint64_t> delivered_;
+    std::atomic<std::uint64_t> dropped_;
+    std::atomic<std::uint64_t> coalesced_;
+    std::atomic<std::uint64_t> batches_;
+    std::atomic<std::uint64_t> errors_;
+    std::atomic<std::uint64_t> max_queue_depth_;
+    std::atomic<std::uint64_t> last_lag_us_;
+    std::atomic<std::uint64_t> max_lag_us_;
+    std::atomic<std::uint64_t> total_lag_us_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_EVENT_CHANNEL_H
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cmath>
+
+#include "latency_stats.h"
+
+LatencyHistogram::LatencyHistogram() :
+        buckets_(),
+        count_(0),
+        sum_(0),
+        max_(0)
+{
+}
+
+void LatencyHistogram::Record(LatencyHistogram::Duration duration)
+{
+    auto value = static_cast<std::uint64_t>(std::max<Duration::rep>(duration.count(), 0));
+    value = std::min(value, max_value);
+    buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    std::uint64_t current = max_.load(std::memory_order_relaxed);
+    while (value > current && !max_.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::Read() const
+{
+    Snapshot snapshot{};
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+        snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.buckets[i];
+    }
+    snapshot.sum = Duration(sum_.load(std::memory_order_relaxed));
+    snapshot.max = Duration(max_.load(std::memory_order_relaxed));
+    return snapshot;
+}
+
+LatencyHistogram::Duration LatencyHistogram::Snapshot::Percentile(double quantile) const
+{
+    if (count == 0)
+    {
+        return Duration::zero();
+    }
+    auto rank = static_cast<std::uint64_t>(std::ceil(std::clamp(quantile, 0.0, 1.0) * static_cast<double>(count)));
+    rank = std::max<std::uint64_t>(rank, 1);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+        {
+            return std::min(Duration(BucketUpperBound(i)), max);
+        }
+    }
+    return max;
+}
+
+std::uint64_t LatencyHistogram::Snapshot::CountAtOrBelow(LatencyHistogram::Duration limit) const
+{
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < bucket_count && Duration(BucketUpperBound(i)) <= limit; ++i)
+    {
+        total += buckets[i];
+    }
+    return total;
+}
+
+namespace
+{
+std::string EscapeLabelValue(const std::string& value)
+{
+    std::string escaped;
+    for (char c : value)
+    {
+        switch (c)
+        {
+            case '\\':
+                escaped += "\\\\";
+                break;
+            case '"':
+                escaped += "\\\"";
+                break;
+            case '\n':
+                escaped += "\\n";
+                break;
+            default:
+                escaped += c;
+        }
+    }
+    return escaped;
+}
+
+/* The labels, followed by le if it is not empty, in braces */
+std::string FormatLabels(const std::map<std::string, std::string>& labels, const std::string& le = "")
+{
+    std::string formatted;
+    for (const auto& [name, value] : labels)
+    {
+        formatted += (formatted.empty() ? "" : ",") + name + "=\"" + EscapeLabelValue(value) + "\"";
+    }
+    if (!le.empty())
+    {
+        formatted += (formatted.empty() ? "" : ",") + std::string("le=\"") + le + "\"";
+    }
+    return formatted.empty() ? formatted : "{" + formatted + "}";
+}
+}
+
+void WritePrometheusHistogram(std::ostream& out, const std::string& name, const std::string& help,
+                              const std::map<std::string, std::string>& labels,
+                              const LatencyHistogram::Snapshot& snapshot)
+{
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " histogram\n";
+    for (const char* bound : {"1e-06", "2.5e-06", "5e-06", "1e-05", "2.5e-05", "5e-05", "0.0001", "0.00025",
+                              "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "0.25",
+                              "0.5", "1", "2.5", "5", "10", "25", "50", "100"})
+    {
+        auto limit = std::chrono::round<LatencyHistogram::Duration>(
+                std::chrono::duration<double>(std::stod(bound)));
+        out << name << "_bucket" << FormatLabels(labels, bound) << " " << snapshot.CountAtOrBelow(limit) << "\n";
+    }
+    out << name << "_bucket" << FormatLabels(labels, "+Inf") << " " << snapshot.count << "\n";
+    out << name << "_sum" << FormatLabels(labels) << " "
+        << std::chrono::duration<double>(snapshot.sum).count() << "\n";
+    out << name << "_count" << FormatLabels(labels) << " " << snapshot.count << "\n";
+}
@@ -0,0 +1,107 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_LATENCY_STATS_H
+#define PYTHON_C_C_EXAMPLE_4_LATENCY_STATS_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+
+/* Set by the TRAFFIC_LATENCY_STATS option of CMake; with 0, nothing is measured or recorded */
+#ifndef TRAFFIC_LATENCY_STATS
+#define TRAFFIC_LATENCY_STATS 1
+#endif
+
+constexpr bool latency_stats_enabled = TRAFFIC_LATENCY_STATS != 0;
+
+/*
+ * A histogram of durations in the style of HdrHistogram: below 2^sub_bucket_bits nanoseconds,
+ * every value has a bucket of its own, and every power of two above that is split in
+ * half that many buckets, so a value is known to within 1 / 2^(sub_bucket_bits - 1) of itself.
+ * The buckets are fixed, so recording is a few relaxed atomic increments, from any thread,
+ * without locking or allocating.
+ */
+class LatencyHistogram
+{
+public:
+    using Duration = std::chrono::nanoseconds;
+
+    static constexpr unsigned sub_bucket_bits = 5;
+    static constexpr std::size_t sub_bucket_count = std::size_t(1) << sub_bucket_bits;
+    /* Longer durations are recorded as this, which is about 5 hours */
+    static constexpr std::uint64_t max_value = (std::uint64_t(1) << 44) - 1;
+    static constexpr std::size_t bucket_count = (44 - sub_bucket_bits) * (sub_bucket_count / 2) + sub_bucket_count;
+
+    /* A copy of the histogram, taken while it may be recorded to, so the totals can be off by the latest values */
+    struct Snapshot
+    {
+        std::array<std::uint64_t, bucket_count> buckets;
+        std::uint64_t count;
+        Duration sum;
+        Duration max;
+
+        /* The upper bound of the bucket that holds the value at quantile, which is between 0 and 1 */
+        Duration Percentile(double quantile) const;
+        /* The number of values whose bucket ends at or below limit */
+        std::uint64_t CountAtOrBelow(Duration limit) const;
+    };
+
+    LatencyHistogram();
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    /* Negative durations are recorded as 0 */
+    void Record(Duration duration);
+    Snapshot Read() const;
+
+    static constexpr std::size_t BucketIndex(std::uint64_t value)
+    {
+        if (value < sub_bucket_count)
+        {
+            return static_cast<std::size_t>(value);
+        }
+        auto shift = static_cast<unsigned>(std::bit_width(value)) - sub_bucket_bits;
+        return shift * (sub_bucket_count / 2) + static_cast<std::size_t>(value >> shift);
+    }
+
+    /* The largest value in the bucket at index */
+    static constexpr std::uint64_t BucketUpperBound(std::size_t index)
+    {
+        if (index < sub_bucket_count)
+        {
+            return index;
+        }
+        auto shift = static_cast<unsigned>(index / (sub_bucket_count / 2) - 1);
+        auto sub_bucket = static_cast<std::uint64_t>(index % (sub_bucket_count / 2) + sub_bucket_count / 2);
+        return ((sub_bucket + 1) << shift) - 1;
+    }
+
+private:
+    std::array<std::atomic<std::uint64_t>, bucket_count> buckets_;
+    std::atomic<std::uint64_t> count_;
+    std::atomic<std::uint64_t> sum_;
+    std::atomic<std::uint64_t> max_;
+};
+
+static_assert(LatencyHistogram::BucketIndex(LatencyHistogram::max_value) == LatencyHistogram::bucket_count - 1,
+              "The largest value must fall in the last bucket");
+static_assert(LatencyHistogram::BucketUpperBound(LatencyHistogram::bucket_count - 1) == LatencyHistogram::max_value,
+              "The last bucket must end at the largest value");
+static_assert(LatencyHistogram::BucketIndex(LatencyHistogram::BucketUpperBound(100) + 1) == 101,
+              "Every bucket must start right after the one before it");
+
+/*
+ * Write a histogram in the Prometheus text format, with the buckets converted to le bounds in
+ * seconds from 1 microsecond to 100 seconds. A value counts for a bound when its bucket ends
+ * at or below it, so a bound can miss values that are at most a bucket width below it.
+ * labels are added to every sample.
+ */
+void WritePrometheusHistogram(std::ostream& out, const std::string& name, const std::string& help,
+                              const std::map<std::string, std::string>& labels,
+                              const LatencyHistogram::Snapshot& snapshot);
+
+#endif //PYTHON_C_C_EXAMPLE_4_LATENCY_STATS_H
@@ -1,16 +1,26 @@
 #ifndef PYTHON_C_C_EXAMPLE_4_LIGHT_H
 #define PYTHON_C_C_EXAMPLE_4_LIGHT_H
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <memory>
+#include <string_view>
 
 class Light
 {
 public:
-    enum class State {Off, On, Flashing};
+    enum class State : std::uint8_t {Off, On, Flashing};
     static constexpr auto Off = State::Off;
     static constexpr auto On = State::On;
     static constexpr auto Flashing = State::Flashing;
+    static constexpr std::array<std::string_view, 3> state_names{"Off", "On", "Flashing"};
+
+    static constexpr std::string_view StateName(State state)
+    {
+        return state_names[static_cast<std::size_t>(state)];
+    }
 
     explicit Light(State state=Off);
     ~Light();
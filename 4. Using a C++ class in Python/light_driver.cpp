@@ -0,0 +1,69 @@
+#include "light_driver.h"
+
+PerLightDriver::PerLightDriver(const PerLightDriver::LightFactory& light_factory)
+{
+    for (std::size_t i = 0; i < light_count; ++i)
+    {
+        lights_.push_back(light_factory());
+    }
+}
+
+void PerLightDriver::Commit(const LightDriver::Pattern& pattern)
+{
+    for (std::size_t i = 0; i < light_count; ++i)
+    {
+        lights_[i]->SetState(pattern[i]);
+    }
+}
+
+const std::vector<std::shared_ptr<Light>>& PerLightDriver::Lights() const
+{
+    return lights_;
+}
+
+SimulatedLightDriver::SimulatedLightDriver(Clock& clock) :
+        clock_(clock),
+        mutex_(),
+        commits_(0),
+        changed_lights_(0),
+        last_pattern_{Light::Off, Light::Off, Light::Off},
+        commit_times_()
+{
+}
+
+void SimulatedLightDriver::Commit(const LightDriver::Pattern& pattern)
+{
+    auto now = clock_.Now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    commits_++;
+    for (std::size_t i = 0; i < light_count; ++i)
+    {
+        changed_lights_ += pattern[i] != last_pattern_[i];
+    }
+    last_pattern_ = pattern;
+    commit_times_.push_back(now);
+}
+
+std::uint64_t SimulatedLightDriver::Commits() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return commits_;
+}
+
+std::uint64_t SimulatedLightDriver::ChangedLights() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return changed_lights_;
+}
+
+LightDriver::Pattern SimulatedLightDriver::LastPattern() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return last_pattern_;
+}
+
+std::vector<Clock::Duration> SimulatedLightDriver::CommitTimes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return commit_times_;
+}
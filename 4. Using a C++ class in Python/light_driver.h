@@ -0,0 +1,75 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_LIGHT_DRIVER_H
+#define PYTHON_C_C_EXAMPLE_4_LIGHT_DRIVER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "clock.h"
+#include "light.h"
+#include "scheduler.h"
+
+/*
+ * Shows the light patterns of one traffic light, e.g. on a hardware controller.
+ * A traffic light commits the whole pattern of a step in one call, so a driver
+ * for which every write is an I/O can write all lights at once.
+ */
+class LightDriver
+{
+public:
+    static constexpr std::size_t light_count = 3;
+    using Pattern = std::array<Light::State, light_count>;
+
+    virtual ~LightDriver() = default;
+
+    /* Called by the clock task of every transition step, never by two threads at once */
+    virtual void Commit(const Pattern& pattern) = 0;
+};
+
+/* Sets a Light object per light, one after the other, which is what a traffic light does by default */
+class PerLightDriver : public LightDriver
+{
+public:
+    using LightFactory = std::function<std::shared_ptr<Light>()>;
+
+    explicit PerLightDriver(const LightFactory& light_factory = Light::MakeLight);
+
+    void Commit(const Pattern& pattern) override;
+    const std::vector<std::shared_ptr<Light>>& Lights() const;
+
+private:
+    std::vector<std::shared_ptr<Light>> lights_;
+};
+
+/*
+ * Records the commits instead of showing them, to measure how often a backend is written to,
+ * and how much of what is written changes anything. Keeps the time of every commit,
+ * on the clock it is given, so it grows with every commit. Its getters can be called from any thread.
+ */
+class SimulatedLightDriver : public LightDriver
+{
+public:
+    explicit SimulatedLightDriver(Clock& clock = Scheduler::Default());
+
+    void Commit(const Pattern& pattern) override;
+
+    std::uint64_t Commits() const;
+    /* The number of lights whose state differs from the commit before, which is all a driver needs to write */
+    std::uint64_t ChangedLights() const;
+    Pattern LastPattern() const;
+    std::vector<Clock::Duration> CommitTimes() const;
+
+private:
+    Clock& clock_;
+    mutable std::mutex mutex_;
+    std::uint64_t commits_;
+    std::uint64_t changed_lights_;
+    Pattern last_pattern_;
+    std::vector<Clock::Duration> commit_times_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_LIGHT_DRIVER_H
@@ -2,16 +2,21 @@
 #include <iostream>
 #include <memory>
 #include <sstream>
+#include "binary_log.h"
 #include "light.h"
+#include "simulated_clock.h"
 #include "traffic_light.h"
 
 
 void monitor(TrafficLight* traffic_light)
 {
-    auto names = traffic_light->GetLightNames();
-    auto pattern = traffic_light->GetLightPattern();
+    const auto& names = traffic_light->GetLightNames();
+    /* The state and the pattern as they were at the same moment */
+    auto snapshot = traffic_light->GetSnapshot();
+    BinaryLog::Default().Write(LogEvent::Monitor, traffic_light, TrafficLight::PackSnapshot(snapshot));
+    auto& pattern = snapshot.pattern;
     auto pattern_iterator = pattern.begin();
-    std::cout << "State: " << traffic_light->GetState() << " (";
+    std::cout << "State: " << snapshot.state << " (";
     std::for_each(names.begin(), names.end(),
                   [&](const auto& name)
                   {
@@ -21,24 +26,27 @@ void monitor(TrafficLight* traffic_light)
                           std::cout << ", ";
                       }
                   });
-    std::cout << ")" << std::endl;
+    std::cout << ")\n";
 }
 
 using std::to_string;
 
 int main()
 {
-    std::cout << "Testing Light class" << std::endl;
+    /* The traffic lights trace what they do to this file, which decode_log turns into text */
+    BinaryLog::Default().Open("main.tlog");
+
+    std::cout << "Testing Light class\n";
     std::shared_ptr<Light> light = std::make_shared<Light>();
-    std::cout << "Light initialized with " << light->GetState() << std::endl;
+    std::cout << "Light initialized with " << light->GetState() << '\n';
     light->SetState(Light::State::On);
     std::ostringstream ss;
     ss << light->GetState();
     std::string light_state = ss.str();
-    std::cout << "Light changed to " << light_state << std::endl;
+    std::cout << "Light changed to " << light_state << '\n';
 
-    std::cout << "-----------" << std::endl;
-    std::cout << "Testing traffic light" << std::endl;
+    std::cout << "-----------\n";
+    std::cout << "Testing traffic light\n";
 
     constexpr auto Off = TrafficLight::State::Off;
     constexpr auto Closed = TrafficLight::State::Closed;
@@ -52,4 +60,29 @@ int main()
     traffic_light->MoveTo(Closed);
     traffic_light->MoveTo(Warning);
     traffic_light->MoveTo(Off);
+    /* The destructor would drop the transitions that have not run yet */
+    traffic_light->WaitIdle();
+    traffic_light.reset();
+
+    std::cout << "-----------\n";
+    std::cout << "Testing traffic light on a simulated clock\n";
+
+    /* The transitions take no real time, and run on this thread in a fixed order */
+    SimulatedClock clock;
+    TrafficLight simulated_light(Off, clock);
+    simulated_light.AddCallback(
+            [&clock](TrafficLight* tl)
+            {
+                std::cout << clock.Now().count() << " ms: ";
+                monitor(tl);
+            });
+    simulated_light.MoveTo(Closed);
+    simulated_light.MoveTo(Open);
+    simulated_light.MoveTo(Warning);
+    auto events = clock.RunFor(std::chrono::minutes(1));
+    std::cout << "Ran " << events << " events in " << clock.Now().count() << " ms of simulated time\n";
+
+    BinaryLog::Default().Close();
+    std::cout << "Logged " << BinaryLog::Default().Written() << " records to main.tlog, dropped "
+              << BinaryLog::Default().Dropped() << '\n';
 }
@@ -0,0 +1,122 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_MPSC_RING_H
+#define PYTHON_C_C_EXAMPLE_4_MPSC_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+/*
+ * A bounded lock-free queue for many producers and a single consumer.
+ *
+ * Every cell has a sequence number that tells whose turn it is: a producer claims
+ * the cell at the head position once its sequence equals that position, and publishes
+ * it by setting the sequence to the position plus one, which is what the consumer waits for.
+ * The consumer hands the cell back to the producers by advancing its sequence by the capacity.
+ * Producers never wait for each other, and a full queue makes TryPush fail instead of blocking.
+ */
+template<typename T>
+class MpscRing
+{
+public:
+    /* The capacity is rounded up to a power of two */
+    explicit MpscRing(std::size_t capacity) :
+            mask_(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1),
+            cells_(std::make_unique<Cell[]>(mask_ + 1)),
+            head_(0),
+            tail_(0)
+    {
+        for (std::size_t i = 0; i <= mask_; ++i)
+        {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    /* Safe to call from any thread. Returns false, leaving value as it is, if the queue is full. */
+    bool TryPush(T&& value)
+    {
+        std::size_t position = head_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true)
+        {
+            cell = &cells_[position & mask_];
+            std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+            if (difference == 0)
+            {
+                if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = head_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Only to be called by the consumer. Returns false if the queue is empty. */
+    bool TryPop(T& value)
+    {
+        std::size_t position = tail_.load(std::memory_order_relaxed);
+        Cell& cell = cells_[position & mask_];
+        if (cell.sequence.load(std::memory_order_acquire) != position + 1)
+        {
+            return false;
+        }
+        value = std::move(cell.value);
+        cell.sequence.store(position + mask_ + 1, std::memory_order_release);
+        tail_.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Whether the consumer would find nothing to pop */
+    bool Empty() const
+    {
+        std::size_t position = tail_.load(std::memory_order_relaxed);
+        return cells_[position & mask_].sequence.load(std::memory_order_acquire) != position + 1;
+    }
+
+    /* The number of queued values, which is only a snapshot while producers are active */
+    std::size_t Size() const
+    {
+        std::size_t tail = tail_.load(std::memory_order_acquire);
+        std::size_t head = head_.load(std::memory_order_acquire);
+        return head > tail ? head - tail : 0;
+    }
+
+    std::size_t Capacity() const
+    {
+        return mask_ + 1;
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    const std::size_t mask_;
+    const std::unique_ptr<Cell[]> cells_;
+    /* On separate cache lines, so producers and the consumer do not slow each other down */
+    alignas(64) std::atomic<std::size_t> head_;
+    alignas(64) std::atomic<std::size_t> tail_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_MPSC_RING_H
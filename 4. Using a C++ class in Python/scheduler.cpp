@@ -0,0 +1,236 @@
+#include <algorithm>
+
+#include "scheduler.h"
+
+namespace
+{
+/* Set on the worker threads of every Scheduler, whose tasks must not block */
+thread_local bool on_worker = false;
+}
+
+Scheduler::Scheduler(std::size_t workers, std::chrono::milliseconds tick) :
+        tick_(std::max(tick, std::chrono::milliseconds(1))),
+        start_(SteadyClock::now()),
+        mutex_(),
+        driver_cv_(),
+        wheel_(),
+        timers_(),
+        current_tick_(0),
+        next_id_(1),
+        ready_mutex_(),
+        ready_cv_(),
+        ready_(),
+        stop_(false),
+        driver_(),
+        workers_()
+{
+    driver_ = std::thread(&Scheduler::DriverLoop, this);
+    workers = std::max<std::size_t>(workers, 1);
+    for (std::size_t i = 0; i < workers; ++i)
+    {
+        workers_.emplace_back(&Scheduler::WorkerLoop, this);
+    }
+}
+
+Scheduler::~Scheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::lock_guard<std::mutex> ready_lock(ready_mutex_);
+        stop_ = true;
+    }
+    driver_cv_.notify_all();
+    ready_cv_.notify_all();
+    driver_.join();
+    for (auto& worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+Clock::Duration Scheduler::Now() const
+{
+    return std::chrono::duration_cast<Duration>(SteadyClock::now() - start_);
+}
+
+Clock::TimerId Scheduler::Schedule(Clock::Duration delay, Clock::Task task)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    TimerId id = next_id_++;
+    if (delay <= std::chrono::milliseconds::zero())
+    {
+        Dispatch(std::move(task));
+        return id;
+    }
+
+    std::uint64_t now = TickAt(SteadyClock::now());
+    if (timers_.empty())
+    {
+        /* Nothing can be due in between, so the wheel can skip the ticks that passed while idle */
+        current_tick_ = std::max(current_tick_, now);
+    }
+    /* The current tick has partly passed, so the delay only starts counting from the next one */
+    auto ticks = static_cast<std::uint64_t>((delay + tick_ - std::chrono::milliseconds(1)) / tick_);
+    Slot pending;
+    pending.push_back({id, now + 1 + ticks, std::move(task)});
+    timers_[id] = {&pending, pending.begin()};
+    Insert(pending, pending.begin());
+    driver_cv_.notify_one();
+    return id;
+}
+
+bool Scheduler::Cancel(Clock::TimerId id)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = timers_.find(id);
+    if (found == timers_.end())
+    {
+        return false;
+    }
+    found->second.slot->erase(found->second.timer);
+    timers_.erase(found);
+    return true;
+}
+
+bool Scheduler::OnWorkerThread()
+{
+    return on_worker;
+}
+
+Scheduler& Scheduler::Default()
+{
+    static Scheduler instance;
+    return instance;
+}
+
+std::uint64_t Scheduler::TickAt(Scheduler::SteadyClock::time_point time) const
+{
+    return static_cast<std::uint64_t>((time - start_) / tick_);
+}
+
+/* Move a timer from source to the slot for its expiry, relative to the current tick */
+void Scheduler::Insert(Scheduler::Slot& source, Scheduler::Slot::iterator timer)
+{
+    std::uint64_t delta = timer->expiry > current_tick_ ? timer->expiry - current_tick_ : 0;
+    std::size_t level = 0;
+    while (level + 1 < levels && delta >= (std::uint64_t(1) << (slot_bits * (level + 1))))
+    {
+        level++;
+    }
+    Slot& target = wheel_[level][(timer->expiry >> (slot_bits * level)) & (slots - 1)];
+    target.splice(target.end(), source, timer);
+    timers_[timer->id].slot = &target;
+}
+
+/* Move the timers of the slot of level that ends at tick down to the lower levels */
+void Scheduler::Cascade(std::size_t level, std::uint64_t tick)
+{
+    Slot& slot = wheel_[level][(tick >> (slot_bits * level)) & (slots - 1)];
+    Slot cascading;
+    cascading.splice(cascading.end(), slot);
+    while (!cascading.empty())
+    {
+        Insert(cascading, cascading.begin());
+    }
+}
+
+void Scheduler::ProcessTick(std::uint64_t tick)
+{
+    for (std::size_t level = levels - 1; level > 0; --level)
+    {
+        if ((tick & ((std::uint64_t(1) << (slot_bits * level)) - 1)) == 0)
+        {
+            Cascade(level, tick);
+        }
+    }
+    Slot& slot = wheel_[0][tick & (slots - 1)];
+    while (!slot.empty())
+    {
+        timers_.erase(slot.front().id);
+        Dispatch(std::move(slot.front().task));
+        slot.pop_front();
+    }
+}
+
+/* The first tick, from the current tick on, at which a slot has to be processed */
+std::uint64_t Scheduler::NextDueTick() const
+{
+    if (timers_.empty())
+    {
+        return no_tick;
+    }
+    std::uint64_t due = no_tick;
+    for (std::size_t level = 0; level < levels; ++level)
+    {
+        std::uint64_t unit = std::uint64_t(1) << (slot_bits * level);
+        std::uint64_t first = (current_tick_ + unit - 1) / unit * unit;
+        for (std::size_t k = 0; k < slots; ++k)
+        {
+            std::uint64_t tick = first + k * unit;
+            if (tick >= due)
+            {
+                break;
+            }
+            if (!wheel_[level][(tick >> (slot_bits * level)) & (slots - 1)].empty())
+            {
+                due = tick;
+                break;
+            }
+        }
+    }
+    return due;
+}
+
+void Scheduler::Dispatch(Clock::Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(ready_mutex_);
+        ready_.push_back(std::move(task));
+    }
+    ready_cv_.notify_one();
+}
+
+void Scheduler::DriverLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_)
+    {
+        std::uint64_t due = NextDueTick();
+        if (due == no_tick)
+        {
+            driver_cv_.wait(lock);
+            continue;
+        }
+        auto deadline = start_ + tick_ * due;
+        if (SteadyClock::now() < deadline)
+        {
+            /* Wakes up early for a timer that is scheduled before the deadline */
+            driver_cv_.wait_until(lock, deadline);
+            continue;
+        }
+        /* No slot needs processing before the due tick, so the ticks in between are skipped */
+        current_tick_ = due;
+        ProcessTick(due);
+        current_tick_ = due + 1;
+    }
+}
+
+void Scheduler::WorkerLoop()
+{
+    on_worker = true;
+    while (true)
+    {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(ready_mutex_);
+            ready_cv_.wait(lock, [this]() { return stop_ || !ready_.empty(); });
+            if (ready_.empty())
+            {
+                return;
+            }
+            task = std::move(ready_.front());
+            ready_.pop_front();
+        }
+        task();
+    }
+}
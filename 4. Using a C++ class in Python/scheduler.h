@@ -0,0 +1,106 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_SCHEDULER_H
+#define PYTHON_C_C_EXAMPLE_4_SCHEDULER_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "clock.h"
+
+/*
+ * Runs delayed tasks for any number of clients on a fixed number of threads.
+ *
+ * Timers are kept in a hierarchical timer wheel: four levels of 256 slots,
+ * where a slot of level 0 covers one tick, and a slot of level n covers 256^n ticks.
+ * A timer is put in the lowest level that reaches its expiry, and moves down
+ * ("cascades") as time passes, so scheduling and cancelling take constant time.
+ * One driver thread sleeps until the next tick that has work, or indefinitely
+ * when there are no timers, and hands expired tasks to a small pool of workers.
+ * Tasks may schedule new tasks, and must not block for long, because that holds up a worker.
+ * Tasks that are due at the same tick may run in parallel, on different workers.
+ */
+class Scheduler : public Clock
+{
+public:
+    using SteadyClock = std::chrono::steady_clock;
+
+    explicit Scheduler(std::size_t workers = 2, std::chrono::milliseconds tick = std::chrono::milliseconds(1));
+    ~Scheduler() override;
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    Duration Now() const override;
+
+    /*
+     * Run task on a worker after delay, rounded up to whole ticks. A delay of zero or less hands it
+     * to a worker right away, without a timer, so Cancel always returns false for its id.
+     */
+    TimerId Schedule(Duration delay, Task task) override;
+    bool Cancel(TimerId id) override;
+
+    /* The scheduler shared by all traffic lights */
+    static Scheduler& Default();
+
+    /* Whether the calling thread runs the tasks of a Scheduler, which must then not block */
+    static bool OnWorkerThread();
+
+private:
+    static constexpr std::size_t levels = 4;
+    static constexpr std::size_t slot_bits = 8;
+    static constexpr std::size_t slots = std::size_t(1) << slot_bits;
+    static constexpr std::uint64_t no_tick = UINT64_MAX;
+
+    struct Timer
+    {
+        TimerId id;
+        std::uint64_t expiry;
+        Task task;
+    };
+    using Slot = std::list<Timer>;
+
+    struct Location
+    {
+        Slot* slot;
+        Slot::iterator timer;
+    };
+
+    std::uint64_t TickAt(SteadyClock::time_point time) const;
+    void Insert(Slot& source, Slot::iterator timer);
+    void Cascade(std::size_t level, std::uint64_t tick);
+    void ProcessTick(std::uint64_t tick);
+    std::uint64_t NextDueTick() const;
+    void Dispatch(Task task);
+    void DriverLoop();
+    void WorkerLoop();
+
+    const std::chrono::milliseconds tick_;
+    const SteadyClock::time_point start_;
+
+    /* The wheel, guarded by mutex_. Every tick before current_tick_ has been processed. */
+    std::mutex mutex_;
+    std::condition_variable driver_cv_;
+    std::array<std::array<Slot, slots>, levels> wheel_;
+    std::unordered_map<TimerId, Location> timers_;
+    std::uint64_t current_tick_;
+    TimerId next_id_;
+
+    /* Tasks that are due, guarded by ready_mutex_ */
+    std::mutex ready_mutex_;
+    std::condition_variable ready_cv_;
+    std::deque<Task> ready_;
+
+    bool stop_;
+    std::thread driver_;
+    std::vector<std::thread> workers_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_SCHEDULER_H
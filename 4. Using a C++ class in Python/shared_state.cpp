@@ -0,0 +1,446 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "shared_state.h"
+
+namespace
+{
+/* A reader gives up on a slot whose writer has stopped in the middle of writing it */
+constexpr int max_read_attempts = 1000;
+
+std::atomic_ref<std::uint32_t> VersionOf(const SharedStateSlot& slot)
+{
+    /* Only loaded through, for a slot of a read-only mapping */
+    return std::atomic_ref<std::uint32_t>(const_cast<std::uint32_t&>(slot.version));
+}
+
+void WriteSlot(SharedStateSlot& slot, std::uint32_t light, const HistoryRecord& record)
+{
+    auto version = VersionOf(slot);
+    std::uint32_t before = version.load(std::memory_order_relaxed);
+    version.store(before + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(&slot.light, &light, sizeof(slot.light));
+    std::memcpy(&slot.record, &record, sizeof(slot.record));
+    version.store(before + 2, std::memory_order_release);
+}
+
+[[noreturn]] void ThrowSystemError(const std::string& what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+#ifndef _WIN32
+
+/*
+ * Whether the segment called name was left behind by a publisher that is gone, or was published
+ * by this process, which replaces it. A segment that is still being created, or is in another
+ * format, is not ours to remove.
+ */
+bool IsStale(const std::string& name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat status{};
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && static_cast<std::size_t>(status.st_size) >= sizeof(SharedStateHeader))
+    {
+        mapping = mmap(nullptr, sizeof(SharedStateHeader), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+    SharedStateHeader header;
+    std::memcpy(&header, mapping, sizeof(header));
+    munmap(mapping, sizeof(SharedStateHeader));
+    if (std::memcmp(header.magic, SharedStatePublisher::segment_magic, sizeof(header.magic)) != 0)
+    {
+        return false;
+    }
+    return header.publisher_pid == getpid() || (kill(header.publisher_pid, 0) != 0 && errno == ESRCH);
+}
+
+#endif
+}
+
+/* A segment, mapped read-write, which stays mapped as long as a light has a slot in it */
+class SharedStateSegment
+{
+public:
+    SharedStateSegment(const std::string& name, std::size_t capacity);
+    ~SharedStateSegment();
+    SharedStateSegment(const SharedStateSegment&) = delete;
+    SharedStateSegment& operator=(const SharedStateSegment&) = delete;
+
+    /* Remove the name, so that new readers no longer find the segment */
+    void Unlink();
+    /* A free slot, marked as used by a new light, if there is one */
+    std::optional<std::uint32_t> Acquire();
+    void Release(std::uint32_t index);
+
+    SharedStateSlot& SlotAt(std::uint32_t index)
+    {
+        return slots_[index];
+    }
+
+private:
+    const std::string name_;
+    void* mapping_;
+    std::size_t size_;
+    SharedStateSlot* slots_;
+    std::mutex mutex_;
+    bool linked_;
+    /* Tell this segment from one that was created under the same name after it */
+    std::uint64_t device_;
+    std::uint64_t inode_;
+    std::vector<std::uint32_t> free_;
+    std::uint32_t next_light_;
+};
+
+#ifndef _WIN32
+
+SharedStateSegment::SharedStateSegment(const std::string& name, std::size_t capacity) :
+        name_(name),
+        mapping_(nullptr),
+        size_(sizeof(SharedStateHeader) + capacity * sizeof(SharedStateSlot)),
+        slots_(nullptr),
+        mutex_(),
+        linked_(false),
+        device_(0),
+        inode_(0),
+        free_(),
+        next_light_(1)
+{
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    /* A segment that a process left behind may still be mapped by readers, who keep their copy */
+    if (fd < 0 && errno == EEXIST && IsStale(name))
+    {
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd < 0)
+    {
+        ThrowSystemError("Cannot create the shared memory segment " + name);
+    }
+    linked_ = true;
+    struct stat status{};
+    if (fstat(fd, &status) != 0 || ftruncate(fd, static_cast<off_t>(size_)) != 0 ||
+        (mapping_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        int error = errno;
+        close(fd);
+        shm_unlink(name.c_str());
+        errno = error;
+        ThrowSystemError("Cannot map the shared memory segment " + name);
+    }
+    close(fd);
+    device_ = static_cast<std::uint64_t>(status.st_dev);
+    inode_ = static_cast<std::uint64_t>(status.st_ino);
+    auto* header = static_cast<SharedStateHeader*>(mapping_);
+    header->version = SharedStatePublisher::segment_version;
+    header->slot_size = sizeof(SharedStateSlot);
+    header->capacity = static_cast<std::uint32_t>(capacity);
+    header->publisher_pid = static_cast<std::int32_t>(getpid());
+    std::memcpy(header->magic, SharedStatePublisher::segment_magic, sizeof(header->magic));
+    slots_ = reinterpret_cast<SharedStateSlot*>(header + 1);
+    for (std::size_t i = capacity; i > 0; --i)
+    {
+        free_.push_back(static_cast<std::uint32_t>(i - 1));
+    }
+}
+
+SharedStateSegment::~SharedStateSegment()
+{
+    munmap(mapping_, size_);
+}
+
+void SharedStateSegment::Unlink()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!linked_)
+    {
+        return;
+    }
+    linked_ = false;
+    /* Leave the name alone if it now refers to a segment that another publisher created after this one */
+    int fd = shm_open(name_.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return;
+    }
+    struct stat status{};
+    bool same = fstat(fd, &status) == 0 && static_cast<std::uint64_t>(status.st_dev) == device_ &&
+                static_cast<std::uint64_t>(status.st_ino) == inode_;
+    close(fd);
+    if (same)
+    {
+        shm_unlink(name_.c_str());
+    }
+}
+
+#else
+
+SharedStateSegment::SharedStateSegment(const std::string& name, std::size_t) :
+        name_(name),
+        mapping_(nullptr),
+        size_(0),
+        slots_(nullptr),
+        mutex_(),
+        linked_(false),
+        device_(0),
+        inode_(0),
+        free_(),
+        next_light_(1)
+{
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported),
+                            "Cannot create the shared memory segment " + name);
+}
+
+SharedStateSegment::~SharedStateSegment() = default;
+
+void SharedStateSegment::Unlink()
+{
+}
+
+#endif
+
+std::optional<std::uint32_t> SharedStateSegment::Acquire()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty())
+    {
+        return std::nullopt;
+    }
+    std::uint32_t index = free_.back();
+    free_.pop_back();
+    WriteSlot(slots_[index], next_light_++, {});
+    return index;
+}
+
+void SharedStateSegment::Release(std::uint32_t index)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    WriteSlot(slots_[index], 0, {});
+    free_.push_back(index);
+}
+
+SharedStatePublisher::Slot::Slot() :
+        segment_(),
+        index_(0),
+        generation_(0)
+{
+}
+
+SharedStatePublisher::Slot::~Slot()
+{
+    Release();
+}
+
+void SharedStatePublisher::Slot::Release()
+{
+    if (segment_)
+    {
+        segment_->Release(index_);
+        segment_.reset();
+    }
+}
+
+SharedStatePublisher::SharedStatePublisher() :
+        generation_(0),
+        mutex_(),
+        segment_(),
+        unpublished_(0)
+{
+}
+
+SharedStatePublisher& SharedStatePublisher::Default()
+{
+    static SharedStatePublisher* instance = []()
+    {
+        auto publisher = new SharedStatePublisher();
+        /* So that no segment outlives the process, with states that no longer change */
+        std::atexit([]() { Default().Close(); });
+        return publisher;
+    }();
+    return *instance;
+}
+
+void SharedStatePublisher::Open(const std::string& name, std::size_t capacity)
+{
+    auto segment = std::make_shared<SharedStateSegment>(name, capacity);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (segment_)
+    {
+        segment_->Unlink();
+    }
+    segment_ = std::move(segment);
+    unpublished_ = 0;
+    generation_.fetch_add(1, std::memory_order_release);
+}
+
+void SharedStatePublisher::Close()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (segment_)
+    {
+        segment_->Unlink();
+        segment_.reset();
+        generation_.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void SharedStatePublisher::Publish(SharedStatePublisher::Slot& slot, const HistoryRecord& record)
+{
+    auto& shared = slot.segment_->SlotAt(slot.index_);
+    WriteSlot(shared, shared.light, record);
+}
+
+std::uint64_t SharedStatePublisher::Unpublished() const
+{
+    return unpublished_;
+}
+
+void SharedStatePublisher::Rebind(SharedStatePublisher::Slot& slot)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    slot.Release();
+    slot.generation_ = generation_.load(std::memory_order_relaxed);
+    if (!segment_)
+    {
+        return;
+    }
+    if (auto index = segment_->Acquire())
+    {
+        slot.segment_ = segment_;
+        slot.index_ = *index;
+    }
+    else
+    {
+        unpublished_++;
+    }
+}
+
+#ifndef _WIN32
+
+SharedStateReader::SharedStateReader(const std::string& name) :
+        mapping_(nullptr),
+        size_(0),
+        header_(nullptr),
+        slots_(nullptr)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+        ThrowSystemError("Cannot open the shared memory segment " + name);
+    }
+    struct stat status{};
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &status) == 0 && static_cast<std::size_t>(status.st_size) >= sizeof(SharedStateHeader))
+    {
+        size_ = static_cast<std::size_t>(status.st_size);
+        mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error(name + " is not a shared state segment");
+    }
+    mapping_ = mapping;
+    header_ = static_cast<const SharedStateHeader*>(mapping_);
+    slots_ = reinterpret_cast<const SharedStateSlot*>(header_ + 1);
+    if (std::memcmp(header_->magic, SharedStatePublisher::segment_magic, sizeof(header_->magic)) != 0 ||
+        header_->version != SharedStatePublisher::segment_version || header_->slot_size != sizeof(SharedStateSlot) ||
+        sizeof(SharedStateHeader) + header_->capacity * sizeof(SharedStateSlot) > size_)
+    {
+        munmap(const_cast<void*>(mapping_), size_);
+        throw std::runtime_error(name + " is not a shared state segment");
+    }
+}
+
+SharedStateReader::~SharedStateReader()
+{
+    munmap(const_cast<void*>(mapping_), size_);
+}
+
+#else
+
+SharedStateReader::SharedStateReader(const std::string& name) :
+        mapping_(nullptr),
+        size_(0),
+        header_(nullptr),
+        slots_(nullptr)
+{
+    throw std::system_error(std::make_error_code(std::errc::function_not_supported),
+                            "Cannot open the shared memory segment " + name);
+}
+
+SharedStateReader::~SharedStateReader() = default;
+
+#endif
+
+std::size_t SharedStateReader::Capacity() const
+{
+    return header_->capacity;
+}
+
+std::int32_t SharedStateReader::PublisherPid() const
+{
+    return header_->publisher_pid;
+}
+
+bool SharedStateReader::ReadSlot(std::size_t index, SharedStateSlot& slot) const
+{
+    const SharedStateSlot& shared = slots_[index];
+    for (int attempt = 0; attempt < max_read_attempts; ++attempt)
+    {
+        std::uint32_t before = VersionOf(shared).load(std::memory_order_acquire);
+        if (before % 2 == 0)
+        {
+            std::memcpy(&slot, &shared, sizeof(slot));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (VersionOf(shared).load(std::memory_order_relaxed) == before)
+            {
+                return slot.light != 0;
+            }
+        }
+        std::this_thread::yield();
+    }
+    return false;
+}
+
+std::vector<SharedStateSlot> SharedStateReader::Read() const
+{
+    std::vector<SharedStateSlot> slots;
+    SharedStateSlot slot;
+    for (std::size_t index = 0; index < Capacity(); ++index)
+    {
+        if (ReadSlot(index, slot))
+        {
+            slots.push_back(slot);
+        }
+    }
+    return slots;
+}
+
+const SharedStateSlot* SharedStateReader::Slots() const
+{
+    return slots_;
+}
@@ -0,0 +1,156 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_SHARED_STATE_H
+#define PYTHON_C_C_EXAMPLE_4_SHARED_STATE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "transition_history.h"
+
+/*
+ * The layout of a shared state segment: this header, followed by capacity slots.
+ * Both are in the byte order of the machine, and have no padding, so that other
+ * processes, e.g. in Python with mmap and numpy, can read them as they are.
+ */
+struct SharedStateHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t slot_size;
+    std::uint32_t capacity;
+    /* The process that publishes to the segment, so a reader can tell whether it is still there */
+    std::int32_t publisher_pid;
+};
+
+static_assert(sizeof(SharedStateHeader) == 24, "SharedStateHeader must not have padding");
+
+/* The state of one traffic light, as its last change left it */
+struct SharedStateSlot
+{
+    /*
+     * Odd while the slot is being written; a reader that sees the same even version
+     * before and after copying the slot has a consistent copy
+     */
+    std::uint32_t version;
+    /* Numbers the traffic lights of the process from 1, in the order in which they got a slot; 0 for a free slot */
+    std::uint32_t light;
+    HistoryRecord record;
+};
+
+static_assert(sizeof(SharedStateSlot) == 32, "SharedStateSlot must not have padding");
+
+class SharedStateSegment;
+
+/*
+ * Publishes the state of every traffic light of the process in a POSIX shared memory segment,
+ * so that monitors in other processes can map it read-only and poll it, without calls into
+ * this process. Every light has a slot, which it writes with a seqlock at every change:
+ * the writer never waits for readers, and a reader retries when it copies a slot while it changes.
+ * A light gets its slot at its first change after Open, so a light that is idle meanwhile
+ * does not show up; open the segment before creating the lights to see all of them.
+ * While no segment is open, publishing a change costs one atomic load.
+ */
+class SharedStatePublisher
+{
+public:
+    static constexpr char segment_magic[8] = {'T', 'L', 'S', 'T', 'A', 'T', 'E', '\0'};
+    static constexpr std::uint32_t segment_version = 1;
+
+    /* The slot of one traffic light, which only that light uses, from one thread at a time */
+    class Slot
+    {
+    public:
+        Slot();
+        ~Slot();
+        Slot(const Slot&) = delete;
+        Slot& operator=(const Slot&) = delete;
+
+    private:
+        friend class SharedStatePublisher;
+
+        void Release();
+
+        std::shared_ptr<SharedStateSegment> segment_;
+        std::uint32_t index_;
+        std::uint64_t generation_;
+    };
+
+    /* The publisher of the process, which is never destroyed, so lights can publish during exit */
+    static SharedStatePublisher& Default();
+
+    SharedStatePublisher(const SharedStatePublisher&) = delete;
+    SharedStatePublisher& operator=(const SharedStatePublisher&) = delete;
+
+    /*
+     * Create the segment called name, e.g. "/traffic", with room for capacity lights, replacing the
+     * segment that is open. Lights that find all slots taken are not published until the next Open,
+     * and are counted. A segment of that name that a stopped process left behind is replaced;
+     * throws std::system_error if the segment cannot be created, with EEXIST if a running
+     * process publishes to it.
+     */
+    void Open(const std::string& name, std::size_t capacity = 256);
+    /* Remove the segment; readers that mapped it keep what they see, which no longer changes */
+    void Close();
+
+    /* Make slot refer to the open segment, if any, and return whether there is one to publish to */
+    bool Attach(Slot& slot)
+    {
+        if (slot.generation_ != generation_.load(std::memory_order_acquire))
+        {
+            Rebind(slot);
+        }
+        return slot.segment_ != nullptr;
+    }
+
+    /* Write record to slot, which Attach found a segment for */
+    static void Publish(Slot& slot, const HistoryRecord& record);
+
+    /* The number of lights that found no free slot since Open */
+    std::uint64_t Unpublished() const;
+
+private:
+    SharedStatePublisher();
+
+    void Rebind(Slot& slot);
+
+    /* Increased by Open and Close, so every light takes a slot in the new segment, or gives up the old one */
+    std::atomic<std::uint64_t> generation_;
+    std::mutex mutex_;
+    std::shared_ptr<SharedStateSegment> segment_;
+    std::atomic<std::uint64_t> unpublished_;
+};
+
+/* Maps a segment created by a SharedStatePublisher, in this or another process, read-only */
+class SharedStateReader
+{
+public:
+    /* Throws std::system_error if there is no segment called name, and std::runtime_error for one in another format */
+    explicit SharedStateReader(const std::string& name);
+    ~SharedStateReader();
+    SharedStateReader(const SharedStateReader&) = delete;
+    SharedStateReader& operator=(const SharedStateReader&) = delete;
+
+    std::size_t Capacity() const;
+    std::int32_t PublisherPid() const;
+    /*
+     * Copy the slot at index consistently, and return whether a light uses it. Also returns false
+     * for a slot that stays in the middle of a change, because the publisher stopped while writing it.
+     */
+    bool ReadSlot(std::size_t index, SharedStateSlot& slot) const;
+    /* The slots that lights use, each copied consistently */
+    std::vector<SharedStateSlot> Read() const;
+    /* The slots in the mapping, which change while they are read */
+    const SharedStateSlot* Slots() const;
+
+private:
+    const void* mapping_;
+    std::size_t size_;
+    const SharedStateHeader* header_;
+    const SharedStateSlot* slots_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_SHARED_STATE_H
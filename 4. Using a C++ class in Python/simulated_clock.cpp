@@ -0,0 +1,79 @@
+#include <algorithm>
+
+#include "simulated_clock.h"
+
+SimulatedClock::SimulatedClock() :
+        mutex_(),
+        now_(Duration::zero()),
+        next_id_(1),
+        events_(),
+        pending_()
+{
+}
+
+Clock::Duration SimulatedClock::Now() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return now_;
+}
+
+Clock::TimerId SimulatedClock::Schedule(Clock::Duration delay, Clock::Task task)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    TimerId id = next_id_++;
+    events_.push_back({now_ + std::max(delay, Duration::zero()), id, std::move(task)});
+    std::push_heap(events_.begin(), events_.end(), &SimulatedClock::RunsAfter);
+    pending_.insert(id);
+    return id;
+}
+
+bool SimulatedClock::Cancel(Clock::TimerId id)
+{
+    /* The event stays in the heap, and is skipped when its time comes */
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_.erase(id) > 0;
+}
+
+bool SimulatedClock::IsSimulated() const
+{
+    return true;
+}
+
+std::size_t SimulatedClock::RunUntil(Clock::Duration time)
+{
+    std::size_t count = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!events_.empty() && events_.front().time <= time)
+    {
+        std::pop_heap(events_.begin(), events_.end(), &SimulatedClock::RunsAfter);
+        Event event = std::move(events_.back());
+        events_.pop_back();
+        if (pending_.erase(event.id) == 0)
+        {
+            continue;
+        }
+        now_ = event.time;
+        lock.unlock();
+        event.task();
+        count++;
+        lock.lock();
+    }
+    now_ = std::max(now_, time);
+    return count;
+}
+
+std::size_t SimulatedClock::RunFor(Clock::Duration duration)
+{
+    return RunUntil(Now() + duration);
+}
+
+std::size_t SimulatedClock::Pending() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_.size();
+}
+
+bool SimulatedClock::RunsAfter(const SimulatedClock::Event& a, const SimulatedClock::Event& b)
+{
+    return a.time != b.time ? a.time > b.time : a.id > b.id;
+}
@@ -0,0 +1,57 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_SIMULATED_CLOCK_H
+#define PYTHON_C_C_EXAMPLE_4_SIMULATED_CLOCK_H
+
+#include <cstddef>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include "clock.h"
+
+/*
+ * A clock for discrete-event simulation. Time stands still until RunUntil is called,
+ * which runs the scheduled tasks in order of their due time, jumping from one to the next,
+ * on the calling thread. Tasks that are due at the same time run in the order in which
+ * they were scheduled, so a simulation gives the same results every time it is run.
+ * Tasks can be scheduled from any thread, but only one thread may run the clock.
+ */
+class SimulatedClock : public Clock
+{
+public:
+    SimulatedClock();
+
+    Duration Now() const override;
+    TimerId Schedule(Duration delay, Task task) override;
+    bool Cancel(TimerId id) override;
+    bool IsSimulated() const override;
+
+    /*
+     * Run all tasks that are due up to and including time, including the ones they schedule,
+     * and then advance the clock to time. Returns the number of tasks that were run.
+     */
+    std::size_t RunUntil(Duration time);
+    std::size_t RunFor(Duration duration);
+
+    /* Number of tasks that are scheduled, but have not run yet */
+    std::size_t Pending() const;
+
+private:
+    struct Event
+    {
+        Duration time;
+        TimerId id;
+        Task task;
+    };
+
+    /* Orders the heap of events so that its front is the first event to run */
+    static bool RunsAfter(const Event& a, const Event& b);
+
+    mutable std::mutex mutex_;
+    Duration now_;
+    TimerId next_id_;
+    std::vector<Event> events_;
+    /* The ids of the events that have not run, and were not cancelled */
+    std::unordered_set<TimerId> pending_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_SIMULATED_CLOCK_H
@@ -0,0 +1,76 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_SPSC_RING_H
+#define PYTHON_C_C_EXAMPLE_4_SPSC_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+
+/*
+ * A bounded lock-free queue for one producer and one consumer.
+ * Each side owns one index, and only reads the other's, so neither ever waits
+ * or retries; a full queue makes TryPush fail instead of blocking.
+ */
+template<typename T>
+class SpscRing
+{
+public:
+    /* The capacity is rounded up to a power of two */
+    explicit SpscRing(std::size_t capacity) :
+            mask_(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1),
+            values_(std::make_unique<T[]>(mask_ + 1)),
+            head_(0),
+            tail_(0)
+    {
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    /* Only to be called by the producer. Returns false if the queue is full. */
+    bool TryPush(const T& value)
+    {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) > mask_)
+        {
+            return false;
+        }
+        values_[head & mask_] = value;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Only to be called by the consumer. Returns false if the queue is empty. */
+    bool TryPop(T& value)
+    {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        value = values_[tail & mask_];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Whether the consumer would find nothing to pop */
+    bool Empty() const
+    {
+        return tail_.load(std::memory_order_relaxed) == head_.load(std::memory_order_acquire);
+    }
+
+    std::size_t Capacity() const
+    {
+        return mask_ + 1;
+    }
+
+private:
+    const std::size_t mask_;
+    const std::unique_ptr<T[]> values_;
+    /* On separate cache lines, so the producer and the consumer do not slow each other down */
+    alignas(64) std::atomic<std::size_t> head_;
+    alignas(64) std::atomic<std::size_t> tail_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_SPSC_RING_H
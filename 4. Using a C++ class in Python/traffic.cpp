@@ -1,14 +1,273 @@
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
 #include "pybind11/pybind11.h"
+#include "pybind11/chrono.h"
 #include "pybind11/functional.h"
+#include "pybind11/numpy.h"
 #include "pybind11/stl.h"
 
+#include "binary_log.h"
+#include "clock.h"
 #include "light.h"
+#include "light_driver.h"
+#include "shared_state.h"
+#include "simulated_clock.h"
 #include "traffic_light.h"
+#include "traffic_light_grid.h"
+#include "transition_history.h"
 
 namespace py = pybind11;
 
 using namespace py::literals;
 
+/* Waiting for the transitions and deliveries of a traffic light may need the GIL on other threads */
+struct ReleaseGilDelete
+{
+    void operator()(TrafficLight* traffic_light) const
+    {
+        py::gil_scoped_release release;
+        delete traffic_light;
+    }
+};
+
+/* The steps of a transition program, as a list for Python */
+std::vector<TrafficLight::TransitionStep> ProgramSteps(const TrafficLight::TransitionProgram& program)
+{
+    return {program.begin(), program.end()};
+}
+
+/* A transition program with steps, which throws std::length_error, a ValueError in Python, if there are too many */
+TrafficLight::TransitionProgram StepsProgram(const std::vector<TrafficLight::TransitionStep>& steps)
+{
+    TrafficLight::TransitionProgram program;
+    for (const auto& step : steps)
+    {
+        program.Add(step);
+    }
+    return program;
+}
+
+/*
+ * Lets a Python subclass of TrafficLight override PrepareTransition. The traffic light keeps
+ * the programs, so the override is only called, with the GIL, the first time a transition
+ * between two states runs; the ones after it run in C++ alone, until the plans are invalidated.
+ */
+class PyTrafficLight : public TrafficLight
+{
+public:
+    using TrafficLight::TrafficLight;
+
+protected:
+    TransitionProgram PrepareTransition(State from_state, State target_state) override
+    {
+        py::gil_scoped_acquire gil;
+        const auto* self = static_cast<const TrafficLight*>(this);
+        if (!py::detail::get_object_handle(self, py::detail::get_type_info(typeid(TrafficLight))))
+        {
+            /* The first transition can start before the Python object is there: use the default, but do not keep it */
+            InvalidatePlans();
+            return TrafficLight::PrepareTransition(from_state, target_state);
+        }
+        py::function override = py::get_overload(self, "PrepareTransition");
+        if (override)
+        {
+            /* On the clock, nobody can catch the error: report it, and keep the default for this transition */
+            try
+            {
+                return StepsProgram(override(from_state, target_state).cast<std::vector<TransitionStep>>());
+            }
+            catch (py::error_already_set& e)
+            {
+                e.restore();
+                PyErr_WriteUnraisable(override.ptr());
+            }
+            catch (const std::exception& e)
+            {
+                PyErr_SetString(PyExc_ValueError, e.what());
+                PyErr_WriteUnraisable(override.ptr());
+            }
+        }
+        return TrafficLight::PrepareTransition(from_state, target_state);
+    }
+};
+
+/* A new traffic light, or the trampoline for a Python subclass; without a clock, it runs on the shared scheduler */
+template<typename Class>
+Class* NewTrafficLight(TrafficLight::State initial_state, Clock* clock, std::shared_ptr<LightDriver> driver)
+{
+    Clock& light_clock = clock ? *clock : Scheduler::Default();
+    if (driver)
+    {
+        return new Class(initial_state, light_clock, std::move(driver));
+    }
+    return new Class(initial_state, light_clock);
+}
+
+/*
+ * The thread that takes the GIL for the asyncio waits, so that the clock task that ends a wait never waits
+ * for it, which would hold up the traffic lights of a shared Scheduler worker. Never destroyed,
+ * because it may still have work when static objects are destroyed.
+ */
+Scheduler& FutureDispatcher()
+{
+    static auto dispatcher = new Scheduler(1);
+    return *dispatcher;
+}
+
+/* A Python object that can be released on any thread without waiting for the GIL, which the FutureDispatcher takes */
+std::shared_ptr<py::object> DispatchedObject(py::object object)
+{
+    return std::shared_ptr<py::object>(new py::object(std::move(object)), [](py::object* shared)
+    {
+        FutureDispatcher().Schedule(Clock::Duration::zero(), [shared]()
+        {
+            py::gil_scoped_acquire gil;
+            delete shared;
+        });
+    });
+}
+
+/*
+ * A future on the running asyncio loop, and a callback that ends it from any thread, without taking the GIL:
+ * with None if the light got where it was waited for, and with a RuntimeError if it was destroyed first
+ */
+std::pair<py::object, TrafficLight::WaitCallback> NewFuture()
+{
+    py::object loop = py::module::import("asyncio").attr("get_running_loop")();
+    py::object future = loop.attr("create_future")();
+    py::object complete = py::cpp_function([](const py::object& future, bool reached)
+    {
+        if (future.attr("done")().cast<bool>())
+        {
+            return;
+        }
+        if (reached)
+        {
+            future.attr("set_result")(py::none());
+        }
+        else
+        {
+            future.attr("set_exception")(py::reinterpret_borrow<py::object>(PyExc_RuntimeError)(
+                    "The traffic light was destroyed before it got there"));
+        }
+    });
+    TrafficLight::WaitCallback callback = [loop = DispatchedObject(loop), future = DispatchedObject(future),
+                                           complete = DispatchedObject(complete)](bool reached)
+    {
+        FutureDispatcher().Schedule(Clock::Duration::zero(), [loop, future, complete, reached]()
+        {
+            py::gil_scoped_acquire gil;
+            try
+            {
+                loop->attr("call_soon_threadsafe")(*complete, *future, reached);
+            }
+            catch (const py::error_already_set&)
+            {
+                /* The loop is closed, so nobody is waiting for the future anymore */
+            }
+        });
+    };
+    return {future, callback};
+}
+
+/* A read-only numpy array over memory of owner, which the array keeps alive */
+template<typename T>
+py::array ReadOnlyView(std::vector<py::ssize_t> shape, const T* data, const py::object& owner)
+{
+    py::array_t<T> view(shape, data, owner);
+    view.attr("setflags")("write"_a = false);
+    return view;
+}
+
+/* A numpy structured array with a copy of records */
+template<typename Record>
+py::array_t<Record> RecordArray(const std::vector<Record>& records)
+{
+    py::array_t<Record> array(static_cast<py::ssize_t>(records.size()));
+    std::copy(records.begin(), records.end(), array.mutable_data());
+    return array;
+}
+
+/* The count, total, maximum and percentiles of a histogram, as a dict with timedeltas */
+py::dict LatencySummary(const LatencyHistogram& histogram)
+{
+    auto snapshot = histogram.Read();
+    return py::dict("count"_a = snapshot.count, "sum"_a = snapshot.sum, "max"_a = snapshot.max,
+                    "p50"_a = snapshot.Percentile(0.5), "p90"_a = snapshot.Percentile(0.9),
+                    "p99"_a = snapshot.Percentile(0.99), "p999"_a = snapshot.Percentile(0.999));
+}
+
+/*
+ * The Python objects that the getters of a traffic light return, created once,
+ * so polling a traffic light only creates the snapshot tuple itself.
+ * They are never freed, because the interpreter may be gone by the time static objects are destroyed.
+ */
+struct TrafficLightObjects
+{
+    static constexpr std::size_t state_count = static_cast<std::size_t>(TrafficLight::State::Warning) + 1;
+    static constexpr std::size_t light_states = static_cast<std::size_t>(Light::State::Flashing) + 1;
+    static constexpr std::size_t pattern_count = []()
+    {
+        std::size_t count = 1;
+        for (std::size_t i = 0; i < TrafficLight::light_count; ++i)
+        {
+            count *= light_states;
+        }
+        return count;
+    }();
+
+    explicit TrafficLightObjects(const py::object& traffic_light_class)
+    {
+        for (std::size_t i = 0; i < states.size(); ++i)
+        {
+            states[i] = py::cast(static_cast<TrafficLight::State>(i));
+        }
+        std::array<py::object, light_states> light_objects;
+        for (std::size_t i = 0; i < light_states; ++i)
+        {
+            light_objects[i] = py::cast(static_cast<Light::State>(i));
+        }
+        for (std::size_t i = 0; i < patterns.size(); ++i)
+        {
+            py::tuple pattern(TrafficLight::light_count);
+            for (std::size_t light = 0, index = i; light < TrafficLight::light_count; ++light, index /= light_states)
+            {
+                pattern[TrafficLight::light_count - 1 - light] = light_objects[index % light_states];
+            }
+            patterns[i] = pattern;
+        }
+        names = py::tuple(TrafficLight::light_names.size());
+        for (std::size_t i = 0; i < TrafficLight::light_names.size(); ++i)
+        {
+            names[i] = py::reinterpret_steal<py::str>(PyUnicode_InternFromString(TrafficLight::light_names[i].c_str()));
+        }
+        snapshot_type = py::module::import("collections").attr("namedtuple")(
+                "Snapshot", py::make_tuple("state", "pattern", "sequence"));
+        snapshot_type.attr("__qualname__") = "TrafficLight.Snapshot";
+        snapshot_type.attr("__module__") = traffic_light_class.attr("__module__");
+    }
+
+    const py::object& Pattern(const TrafficLight::FixedLightPattern& pattern) const
+    {
+        std::size_t index = 0;
+        for (auto state : pattern)
+        {
+            index = index * light_states + static_cast<std::size_t>(state);
+        }
+        return patterns[index];
+    }
+
+    std::array<py::object, state_count> states;
+    std::array<py::object, pattern_count> patterns;
+    py::tuple names;
+    py::object snapshot_type;
+};
 
 PYBIND11_MODULE(traffic, m)
 {
@@ -25,7 +284,131 @@ PYBIND11_MODULE(traffic, m)
     Light.def(py::init<Light::State>(), "state"_a = Light::Off)
             .def_property("state", &Light::GetState, &Light::SetState, "The light state");
 
-    py::class_<TrafficLight> TrafficLight(m, "TrafficLight");
+    py::class_<Clock>(m, "Clock")
+            .def_property_readonly("now", &Clock::Now, "The time since the clock started");
+
+    py::class_<SimulatedClock, Clock>(m, "SimulatedClock")
+            .def(py::init<>())
+            .def("run_until", &SimulatedClock::RunUntil, "time"_a, py::call_guard<py::gil_scoped_release>(),
+                 "Run the tasks that are due up to time, and return how many ran")
+            .def("run_for", &SimulatedClock::RunFor, "duration"_a, py::call_guard<py::gil_scoped_release>(),
+                 "Run the tasks that are due within duration from now, and return how many ran")
+            .def_property_readonly("pending", &SimulatedClock::Pending, "The number of scheduled tasks");
+
+    /* Only the drivers of the library: a driver written in Python would need the GIL while the traffic light is locked */
+    py::class_<LightDriver, std::shared_ptr<LightDriver>>(m, "LightDriver");
+
+    py::class_<SimulatedLightDriver, LightDriver, std::shared_ptr<SimulatedLightDriver>>(m, "SimulatedLightDriver")
+            .def(py::init([](Clock* clock) { return new SimulatedLightDriver(clock ? *clock : Scheduler::Default()); }),
+                 "clock"_a = nullptr, py::keep_alive<1, 2>())
+            .def_property_readonly("commits", &SimulatedLightDriver::Commits, "The number of patterns committed")
+            .def_property_readonly("changed_lights", &SimulatedLightDriver::ChangedLights,
+                                   "The number of lights whose state differs from the commit before")
+            .def_property_readonly("last_pattern", &SimulatedLightDriver::LastPattern, "The pattern committed last")
+            .def_property_readonly("commit_times", &SimulatedLightDriver::CommitTimes,
+                                   "The time of every commit on the clock of the driver");
+
+    py::enum_<DeliveryPolicy>(m, "DeliveryPolicy")
+            .value("Drop", DeliveryPolicy::Drop)
+            .value("Coalesce", DeliveryPolicy::Coalesce)
+            .value("Keep", DeliveryPolicy::Keep);
+
+    py::class_<DeliveryMetrics>(m, "DeliveryMetrics")
+            .def_readonly("published", &DeliveryMetrics::published)
+            .def_readonly("delivered", &DeliveryMetrics::delivered)
+            .def_readonly("dropped", &DeliveryMetrics::dropped)
+            .def_readonly("coalesced", &DeliveryMetrics::coalesced)
+            .def_readonly("batches", &DeliveryMetrics::batches)
+            .def_readonly("errors", &DeliveryMetrics::errors)
+            .def_readonly("queue_depth", &DeliveryMetrics::queue_depth)
+            .def_readonly("max_queue_depth", &DeliveryMetrics::max_queue_depth)
+            .def_readonly("last_lag", &DeliveryMetrics::last_lag)
+            .def_readonly("max_lag", &DeliveryMetrics::max_lag)
+            .def_readonly("mean_lag", &DeliveryMetrics::mean_lag);
+
+    m.attr("latency_stats_enabled") = latency_stats_enabled;
+
+    m.def("open_log", [](const std::string& path) { BinaryLog::Default().Open(path); }, "path"_a,
+          "Trace the traffic lights to a binary log file, which the decode_log tool turns into text");
+    m.def("close_log",
+          []()
+          {
+              BinaryLog::Default().Close();
+              return BinaryLog::Default().Written();
+          },
+          py::call_guard<py::gil_scoped_release>(), "Close the log file, and return the number of records written");
+
+    PYBIND11_NUMPY_DTYPE(HistoryRecord, time_ns, clock_ms, sequence, state, pattern);
+    m.attr("history_dtype") = py::dtype::of<HistoryRecord>();
+
+    /*
+     * The buffer is the ring itself, so numpy.asarray(history) is a read-only view, in ring order,
+     * that changes as records are added
+     */
+    py::class_<TransitionHistory, std::shared_ptr<TransitionHistory>>(m, "TransitionHistory", py::buffer_protocol())
+            .def_buffer([](TransitionHistory& history)
+                        {
+                            /* Only the light writes the ring */
+                            return py::buffer_info(history.Records(),
+                                                   {static_cast<py::ssize_t>(history.Capacity())},
+                                                   {static_cast<py::ssize_t>(sizeof(HistoryRecord))},
+                                                   /* readonly */ true);
+                        })
+            .def("__len__", &TransitionHistory::Capacity)
+            .def_property_readonly("capacity", &TransitionHistory::Capacity)
+            .def_property_readonly("head", &TransitionHistory::Head,
+                                   "The number of records so far; the newest is at (head - 1) % capacity")
+            .def_property_readonly("lost", &TransitionHistory::Lost,
+                                   "The number of records that were overwritten before they could be spilled")
+            .def("read", [](const TransitionHistory& history) { return RecordArray(history.Read()); },
+                 "A consistent copy of the records, oldest first")
+            .def("spill_to", &TransitionHistory::SpillTo, "path"_a, "Append the records from now on to a file")
+            .def("flush", &TransitionHistory::Flush, py::call_guard<py::gil_scoped_release>(),
+                 "Write the records that have not been spilled yet, and flush the file");
+
+    m.def("read_history_file", [](const std::string& path) { return RecordArray(TransitionHistory::ReadFile(path)); },
+          "path"_a, "Read the records spilled to a file by a TransitionHistory");
+
+    PYBIND11_NUMPY_DTYPE(SharedStateSlot, version, light, record);
+    m.attr("shared_state_dtype") = py::dtype::of<SharedStateSlot>();
+
+    m.def("open_shared_state", [](const std::string& name, std::size_t capacity)
+          {
+              SharedStatePublisher::Default().Open(name, capacity);
+          },
+          "name"_a, "capacity"_a = 256,
+          "Publish the state of every traffic light, from its next change, in the shared memory segment name");
+    m.def("close_shared_state", []() { SharedStatePublisher::Default().Close(); },
+          "Stop publishing, and remove the shared memory segment");
+
+    /* For monitors in other processes, which can poll without calls into the process of the traffic lights */
+    py::class_<SharedStateReader>(m, "SharedStateReader")
+            .def(py::init<const std::string&>(), "name"_a)
+            .def_property_readonly("capacity", &SharedStateReader::Capacity)
+            .def_property_readonly("publisher_pid", &SharedStateReader::PublisherPid,
+                                   "The process that publishes to the segment")
+            .def("read",
+                 [](const SharedStateReader& reader)
+                 {
+                     std::vector<SharedStateSlot> slots;
+                     {
+                         py::gil_scoped_release release;
+                         slots = reader.Read();
+                     }
+                     return RecordArray(slots);
+                 },
+                 "A consistent copy of every slot that a traffic light uses")
+            .def_property_readonly("slots",
+                                   [](const py::object& self)
+                                   {
+                                       const auto& reader = self.cast<const SharedStateReader&>();
+                                       return ReadOnlyView({static_cast<py::ssize_t>(reader.Capacity())},
+                                                           reader.Slots(), self);
+                                   },
+                                   "A live view of all slots, without copying, in which a slot can be read "
+                                   "while it changes; compare its version before and after, or use read()");
+
+    py::class_<TrafficLight, PyTrafficLight, std::unique_ptr<TrafficLight, ReleaseGilDelete>> TrafficLight(m, "TrafficLight");
 
     py::enum_<TrafficLight::State>(TrafficLight, "State")
             .value("Off", TrafficLight::State::Off)
@@ -35,13 +418,251 @@ PYBIND11_MODULE(traffic, m)
             .value("Closing", TrafficLight::State::Closing)
             .value("Warning", TrafficLight::State::Warning);
 
-    TrafficLight.def(py::init<TrafficLight::State>(),
-                     "initial_state"_a = TrafficLight::State::Off)
-            .def("MoveTo", &TrafficLight::MoveTo, "target_state"_a)
-            .def_property_readonly("state", &TrafficLight::GetState, "The state of the traffic light")
-            .def_property_readonly("pattern", &TrafficLight::GetLightPattern, "The light pattern of the traffic light")
-            .def_property_readonly("names", &TrafficLight::GetLightNames, "The names of the lights")
+    py::enum_<TrafficLight::QueuePolicy>(TrafficLight, "QueuePolicy")
+            .value("Fifo", TrafficLight::QueuePolicy::Fifo)
+            .value("Coalesce", TrafficLight::QueuePolicy::Coalesce)
+            .value("LatestOnly", TrafficLight::QueuePolicy::LatestOnly);
+
+    py::enum_<TrafficLight::OverflowPolicy>(TrafficLight, "OverflowPolicy")
+            .value("Reject", TrafficLight::OverflowPolicy::Reject)
+            .value("Block", TrafficLight::OverflowPolicy::Block);
+
+    py::enum_<TrafficLight::Priority>(TrafficLight, "Priority")
+            .value("Normal", TrafficLight::Priority::Normal)
+            .value("Emergency", TrafficLight::Priority::Emergency);
+    TrafficLight.attr("max_override_delay") = TrafficLight::MaxOverrideDelay();
+
+    py::enum_<TrafficLight::EnqueueResult>(TrafficLight, "EnqueueResult")
+            .value("Queued", TrafficLight::EnqueueResult::Queued)
+            .value("Coalesced", TrafficLight::EnqueueResult::Coalesced)
+            .value("Replaced", TrafficLight::EnqueueResult::Replaced)
+            .value("Rejected", TrafficLight::EnqueueResult::Rejected)
+            .value("TimedOut", TrafficLight::EnqueueResult::TimedOut)
+            .value("Invalid", TrafficLight::EnqueueResult::Invalid);
+
+    /* A capacity of None is unbounded */
+    py::class_<TrafficLight::QueueConfig>(TrafficLight, "QueueConfig")
+            .def(py::init([](TrafficLight::QueuePolicy policy, std::optional<std::size_t> capacity,
+                             TrafficLight::OverflowPolicy overflow,
+                             std::optional<std::chrono::milliseconds> block_timeout)
+                          {
+                              return TrafficLight::QueueConfig{policy,
+                                                               capacity.value_or(TrafficLight::QueueConfig::unbounded),
+                                                               overflow, block_timeout};
+                          }),
+                 "policy"_a = TrafficLight::QueuePolicy::Fifo, "capacity"_a = py::none(),
+                 "overflow"_a = TrafficLight::OverflowPolicy::Reject, "block_timeout"_a = py::none())
+            .def_readwrite("policy", &TrafficLight::QueueConfig::policy)
+            .def_property("capacity",
+                          [](const TrafficLight::QueueConfig& config) -> std::optional<std::size_t>
+                          {
+                              if (config.capacity == TrafficLight::QueueConfig::unbounded)
+                              {
+                                  return std::nullopt;
+                              }
+                              return config.capacity;
+                          },
+                          [](TrafficLight::QueueConfig& config, std::optional<std::size_t> capacity)
+                          {
+                              config.capacity = capacity.value_or(TrafficLight::QueueConfig::unbounded);
+                          })
+            .def_readwrite("overflow", &TrafficLight::QueueConfig::overflow)
+            .def_readwrite("block_timeout", &TrafficLight::QueueConfig::block_timeout);
+
+    py::class_<TrafficLight::StateChange> StateChange(TrafficLight, "StateChange");
+    StateChange.def_readonly("state", &TrafficLight::StateChange::state)
+            .def_readonly("time", &TrafficLight::StateChange::time);
+
+    py::class_<TrafficLight::Subscription, std::shared_ptr<TrafficLight::Subscription>>(TrafficLight, "Subscription")
+            .def_property_readonly("policy", &TrafficLight::Subscription::Policy)
+            .def_property_readonly("metrics", &TrafficLight::Subscription::Metrics)
+            .def("flush", &TrafficLight::Subscription::Flush, py::call_guard<py::gil_scoped_release>(),
+                 "Wait until the changes that were published so far have been delivered");
+
+    auto objects = new TrafficLightObjects(TrafficLight);
+    TrafficLight.attr("Snapshot") = objects->snapshot_type;
+    StateChange.def_property_readonly("pattern",
+                                      [objects](const TrafficLight::StateChange& change)
+                                      {
+                                          return objects->Pattern(change.pattern);
+                                      });
+
+    py::class_<TrafficLight::TransitionStep>(TrafficLight, "TransitionStep")
+            .def(py::init([](::TrafficLight::State state, const ::TrafficLight::FixedLightPattern& pattern,
+                             Clock::Duration delay)
+                          {
+                              return ::TrafficLight::TransitionStep{state, pattern, delay};
+                          }),
+                 "state"_a, "pattern"_a, "delay"_a)
+            .def_readwrite("state", &TrafficLight::TransitionStep::state)
+            .def_property("pattern",
+                          [objects](const ::TrafficLight::TransitionStep& step) { return objects->Pattern(step.pattern); },
+                          [](::TrafficLight::TransitionStep& step, const ::TrafficLight::FixedLightPattern& pattern)
+                          {
+                              step.pattern = pattern;
+                          })
+            .def_readwrite("delay", &TrafficLight::TransitionStep::delay);
+
+    /*
+     * Without a driver, the light sets a Light per light. A subclass can override
+     * PrepareTransition(from_state, target_state) to return a list of TransitionStep;
+     * the default program of a transition is default_program(from_state, target_state).
+     */
+    TrafficLight.def(py::init(&NewTrafficLight<::TrafficLight>, &NewTrafficLight<PyTrafficLight>),
+                     "initial_state"_a = TrafficLight::State::Off, "clock"_a = nullptr, "driver"_a = nullptr,
+                     py::keep_alive<1, 3>())
+            .def_static("default_program",
+                        [](::TrafficLight::State from_state, ::TrafficLight::State target_state)
+                        {
+                            return ProgramSteps(::TrafficLight::DefaultProgram(from_state, target_state));
+                        },
+                        "from_state"_a, "target_state"_a,
+                        "The steps of the built-in transition, which are none if target_state cannot be moved to")
+            .def("invalidate_plans", &TrafficLight::InvalidatePlans,
+                 "Call PrepareTransition again for the transitions from now on, instead of reusing its programs")
+            .def("MoveTo", &TrafficLight::MoveTo, "target_state"_a, "priority"_a = TrafficLight::Priority::Normal,
+                 py::call_guard<py::gil_scoped_release>(),
+                 "Request a transition, and return what happened to the request")
+            .def_property("queue_config", &TrafficLight::GetQueueConfig, &TrafficLight::SetQueueConfig,
+                          "What MoveTo does with the requests that wait for the running transition")
+            .def_property_readonly("queue_length", &TrafficLight::QueueLength,
+                                   "The number of requests that wait for the running transition")
+            .def_property_readonly("state",
+                                   [objects](const ::TrafficLight& tl)
+                                   {
+                                       return objects->states[static_cast<std::size_t>(tl.GetState())];
+                                   },
+                                   "The state of the traffic light")
+            .def_property_readonly("pattern",
+                                   [objects](const ::TrafficLight& tl)
+                                   {
+                                       return objects->Pattern(tl.GetSnapshot().pattern);
+                                   },
+                                   "The light pattern of the traffic light, as a tuple")
+            .def_property_readonly("names",
+                                   [objects](const ::TrafficLight&) { return objects->names; },
+                                   "The names of the lights, as a tuple")
+            .def_property_readonly("snapshot",
+                                   [objects](const ::TrafficLight& tl)
+                                   {
+                                       auto snapshot = tl.GetSnapshot();
+                                       return objects->snapshot_type(objects->states[static_cast<std::size_t>(snapshot.state)],
+                                                                     objects->Pattern(snapshot.pattern),
+                                                                     snapshot.sequence);
+                                   },
+                                   "The state, light pattern and sequence number of the traffic light, read at once")
             .def("AddCallback", &TrafficLight::AddCallback, "Add a callback method")
+            /* The callback gets a list of StateChange objects, converted while it holds the GIL once */
+            .def("Subscribe", &TrafficLight::Subscribe, "callback"_a, "policy"_a = DeliveryPolicy::Drop,
+                 "capacity"_a = 64, "Add a callback method for batches of state changes")
+            .def("Unsubscribe", &TrafficLight::Unsubscribe, "subscription"_a,
+                 py::call_guard<py::gil_scoped_release>(), "Remove a callback method added with Subscribe")
             .def_property_readonly("in_transition", &TrafficLight::InTransition,
-                                   "Is the traffic light performing a transition");
+                                   "Is the traffic light performing a transition")
+            .def("EnableHistory", &TrafficLight::EnableHistory, "capacity"_a = 4096,
+                 "Record the changes of the traffic light in a new TransitionHistory")
+            .def_property_readonly("history", &TrafficLight::GetHistory,
+                                   "The TransitionHistory of the traffic light, or None")
+            .def("stats",
+                 [](const ::TrafficLight& tl) -> py::object
+                 {
+                     auto stats = tl.GetLatencyStats();
+                     if (!stats)
+                     {
+                         return py::none();
+                     }
+                     return py::dict("queue_wait"_a = LatencySummary(stats->queue_wait),
+                                     "step_jitter"_a = LatencySummary(stats->step_jitter),
+                                     "callback_duration"_a = LatencySummary(stats->callback_duration));
+                 },
+                 "The latency histograms, summarized, or None if the module is built without them")
+            .def("write_stats", &TrafficLight::WriteLatencyStats, "path"_a, "labels"_a = std::map<std::string, std::string>(),
+                 "Write the latency histograms to a file in the Prometheus text format")
+            .def("wait_idle", &TrafficLight::WaitIdle, "timeout"_a = py::none(),
+                 py::call_guard<py::gil_scoped_release>(),
+                 "Wait until no transition is running or requested, and return False if timeout passed first")
+            .def("wait_for_state", &TrafficLight::WaitForState, "state"_a, "timeout"_a = py::none(),
+                 py::call_guard<py::gil_scoped_release>(),
+                 "Wait until the traffic light is, or has been, in state, and return False if timeout passed first")
+            .def("wait_idle_async",
+                 [](::TrafficLight& tl)
+                 {
+                     auto [future, callback] = NewFuture();
+                     tl.NotifyWhenIdle(std::move(callback));
+                     return future;
+                 },
+                 "An asyncio future that is done when no transition is running or requested")
+            .def("wait_for_state_async",
+                 [](::TrafficLight& tl, ::TrafficLight::State state)
+                 {
+                     auto [future, callback] = NewFuture();
+                     tl.NotifyWhenInState(state, std::move(callback));
+                     return future;
+                 },
+                 "state"_a, "An asyncio future that is done when the traffic light is in state, "
+                 "or fails with RuntimeError if the traffic light is destroyed first");
+
+    /* The arrays are live views: they show the current states without copying, so they change while read */
+    py::class_<TrafficLightGrid>(m, "TrafficLightGrid")
+            .def(py::init([](std::size_t size, Clock* clock)
+                          {
+                              return new TrafficLightGrid(size, clock ? *clock : Scheduler::Default());
+                          }),
+                 "size"_a, "clock"_a = nullptr, py::keep_alive<1, 3>())
+            .def("__len__", &TrafficLightGrid::Size)
+            .def("MoveTo",
+                 [](TrafficLightGrid& grid,
+                    const py::array_t<std::size_t, py::array::c_style | py::array::forcecast>& indices,
+                    TrafficLight::State target_state)
+                 {
+                     if (indices.ndim() != 1)
+                     {
+                         throw py::value_error("indices must be one-dimensional");
+                     }
+                     std::span<const std::size_t> span(indices.data(), static_cast<std::size_t>(indices.size()));
+                     py::gil_scoped_release release;
+                     grid.MoveTo(span, target_state);
+                 },
+                 "indices"_a, "target_state"_a, "Move the traffic lights at indices to target_state")
+            .def("state",
+                 [objects](const TrafficLightGrid& grid, std::size_t index)
+                 {
+                     return objects->states[static_cast<std::size_t>(grid.GetState(index))];
+                 },
+                 "index"_a, "The state of one traffic light")
+            .def("pattern",
+                 [objects](const TrafficLightGrid& grid, std::size_t index)
+                 {
+                     return objects->Pattern(grid.GetLightPattern(index));
+                 },
+                 "index"_a, "The light pattern of one traffic light, as a tuple")
+            .def("count", &TrafficLightGrid::CountInState, "state"_a,
+                 "The number of traffic lights in state")
+            .def_property_readonly("in_transition", &TrafficLightGrid::InTransition,
+                                   "Is any traffic light performing a transition")
+            .def_property_readonly("states",
+                                   [](const py::object& self)
+                                   {
+                                       const auto& grid = self.cast<const TrafficLightGrid&>();
+                                       return ReadOnlyView({static_cast<py::ssize_t>(grid.Size())},
+                                                           reinterpret_cast<const std::uint8_t*>(grid.States()), self);
+                                   },
+                                   "The TrafficLight.State of every traffic light, as a uint8 array")
+            .def_property_readonly("patterns",
+                                   [](const py::object& self)
+                                   {
+                                       const auto& grid = self.cast<const TrafficLightGrid&>();
+                                       return ReadOnlyView({static_cast<py::ssize_t>(grid.Size()),
+                                                            static_cast<py::ssize_t>(TrafficLight::light_count)},
+                                                           reinterpret_cast<const std::uint8_t*>(grid.LightPatterns()), self);
+                                   },
+                                   "The Light.State of every light, as a uint8 array with a row per traffic light")
+            .def_property_readonly("deadlines",
+                                   [](const py::object& self)
+                                   {
+                                       const auto& grid = self.cast<const TrafficLightGrid&>();
+                                       return ReadOnlyView({static_cast<py::ssize_t>(grid.Size())}, grid.Deadlines(), self);
+                                   },
+                                   "When the current step of every traffic light ends, in milliseconds on the clock, "
+                                   "or the largest int64 for a traffic light that is not in transition");
 }
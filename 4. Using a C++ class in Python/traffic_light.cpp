@@ -1,196 +1,716 @@
 #include <algorithm>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <map>
 
 #include "traffic_light.h"
 
-TrafficLight::TrafficLight(State initial_state) :
-        current_state_(State::Off),
-        state_change_cb_list_(),
+TrafficLight::TrafficLight(State initial_state, Clock& clock) :
+        TrafficLight(initial_state, clock, Light::MakeLight)
+{
+}
+
+TrafficLight::TrafficLight(State initial_state, Clock& clock, const LightFactory& light_factory) :
+        TrafficLight(initial_state, clock, std::make_shared<PerLightDriver>(light_factory))
+{
+}
+
+TrafficLight::TrafficLight(State initial_state, Clock& clock, std::shared_ptr<LightDriver> driver) :
+        clock_(clock),
+        snapshot_(0),
+        driver_(std::move(driver)),
+        shared_slot_(),
+        subscriptions_(),
+        history_(),
         transition_sequence_(),
-        transition_thread_(std::thread(&TrafficLight::TransitionRunner, this)),
+        plans_mutex_(),
+        plans_(),
+        plans_generation_(0),
         lights_mutex_(),
         transition_buffer_(),
+        queue_config_(),
+        current_target_(initial_state),
         transition_mutex_(),
-        transition_cv(),
-        stop_signal_(),
-        stop_transition_thread_(stop_signal_.get_future()),
-        busy_(false)
+        queue_cv_(),
+        idle_cv_(),
+        state_visits_(),
+        state_callbacks_(),
+        idle_callbacks_(),
+        pending_step_(0),
+        step_preemptible_(false),
+        busy_(false),
+        preempt_(false),
+        stopping_(false),
+        step_due_(0),
+        stats_(latency_stats_enabled ? std::make_unique<LatencyStats>() : nullptr)
 {
-    for (auto& name : light_names)
+    if (!driver_)
     {
-        lights_.emplace_back(Light::MakeLight());
+        throw std::invalid_argument("A traffic light needs a light driver");
     }
     Init(initial_state);
 }
 
 TrafficLight::~TrafficLight()
 {
-    std::cout << "Destroying TrafficLight instance" << std::endl;
-    stop_signal_.set_value();
-    if (transition_thread_.joinable())
+    BinaryLog::Default().Write(LogEvent::LightDestroyed, this, 0);
+    /* The scheduled step refers to this instance: cancel it, or, if it is running, let it stop the transition */
+    std::unique_lock<std::mutex> lock(transition_mutex_);
+    stopping_ = true;
+    std::queue<QueuedMove>().swap(transition_buffer_);
+    queue_cv_.notify_all();
+    if (busy_ && clock_.Cancel(pending_step_))
+    {
+        auto callbacks = BecomeIdle();
+        lock.unlock();
+        for (auto& callback : callbacks)
+        {
+            callback(true);
+        }
+        lock.lock();
+    }
+    idle_cv_.wait(lock, [this]() { return !busy_; });
+    /* The states that were waited for are not reached anymore */
+    std::vector<std::pair<State, WaitCallback>> unreached;
+    unreached.swap(state_callbacks_);
+    lock.unlock();
+    for (auto& callback : unreached)
+    {
+        callback.second(false);
+    }
+
+    /* So do the deliveries to subscribers: the pending ones are dropped, and a running callback is waited for */
+    for (auto& subscription : CopySubscriptions())
     {
-        transition_thread_.join();
+        subscription->Close();
     }
 }
 
-TrafficLight::TrafficLight::State TrafficLight::GetState()
+namespace
+{
+constexpr std::uint64_t field_bits = 8;
+constexpr std::uint64_t field_mask = (std::uint64_t(1) << field_bits) - 1;
+constexpr std::uint64_t sequence_shift = 32;
+
+static_assert(field_bits * (1 + TrafficLight::light_count) <= sequence_shift,
+              "The state and the light pattern must fit below the sequence");
+
+using State = TrafficLight::State;
+using TransitionProgram = TrafficLight::TransitionProgram;
+using TransitionTable = std::array<std::array<TransitionProgram, TrafficLight::state_count>, TrafficLight::state_count>;
+
+constexpr std::size_t red = 0;
+constexpr std::size_t green = 2;
+
+/* The built-in program to reach target, which does not depend on the state the light comes from */
+constexpr TransitionProgram ProgramTo(State target)
 {
-    return current_state_;
+    using namespace std::chrono_literals;
+    constexpr auto Off = Light::State::Off;
+    constexpr auto On = Light::State::On;
+    constexpr auto Flashing = Light::State::Flashing;
+    switch (target)
+    {
+        case State::Open:
+            return TransitionProgram{{State::Open, {Off, Off, On}, 3000ms}};
+        case State::Closed:
+            return TransitionProgram{{State::Closing, {Off, On, Off}, 2000ms},
+                                     {State::Closed, {On, Off, Off}, 3000ms}};
+        case State::Warning:
+            return TransitionProgram{{State::Warning, {Off, Flashing, Off}, 3000ms}};
+        case State::Off:
+            return TransitionProgram{{State::Off, {Off, Off, Off}, 3000ms}};
+        default:
+            /* Unsupported target states */
+            return TransitionProgram{};
+    }
 }
 
-void TrafficLight::Init(TrafficLight::State initial_state)
+constexpr TransitionTable MakeTransitionTable()
 {
-    MoveTo(initial_state);
+    TransitionTable table{};
+    for (std::size_t from = 0; from < TrafficLight::state_count; ++from)
+    {
+        for (std::size_t target = 0; target < TrafficLight::state_count; ++target)
+        {
+            if (from != target)
+            {
+                table[from][target] = ProgramTo(static_cast<State>(target));
+            }
+        }
+    }
+    return table;
+}
+
+/* The programs, indexed by the state a transition starts from, and its target state */
+constexpr TransitionTable transition_table = MakeTransitionTable();
+
+constexpr bool IsTargetState(State state)
+{
+    return state == State::Off || state == State::Closed || state == State::Open || state == State::Warning;
 }
 
-void TrafficLight::TransitToState(TrafficLight::State target_state)
+/* Calls check(from, target, program) for every entry, and returns whether it held for all of them */
+template<typename Check>
+constexpr bool AllPrograms(Check check)
 {
-    if (current_state_ != target_state)
+    for (std::size_t from = 0; from < TrafficLight::state_count; ++from)
     {
-        State from_state = current_state_;
-        switch (target_state)
+        for (std::size_t target = 0; target < TrafficLight::state_count; ++target)
         {
-            case State::Open:
-                current_state_ = State::Opening;
-                break;
-            case State::Closed:
-                current_state_ = State::Closing;
-                break;
-            default:
-                break;
+            if (!check(static_cast<State>(from), static_cast<State>(target), transition_table[from][target]))
+            {
+                return false;
+            }
         }
-        PrepareTransition(from_state, target_state);
-        RunTransition();
     }
+    return true;
+}
+
+static_assert(AllPrograms([](State from, State target, const TransitionProgram& program)
+                          {
+                              return (from != target && IsTargetState(target)) != program.Empty();
+                          }),
+              "There must be a program for every move to another target state, and for nothing else");
+
+static_assert(AllPrograms([](State, State target, const TransitionProgram& program)
+                          {
+                              return program.Empty() || program[program.Size() - 1].state == target;
+                          }),
+              "Every program must end in its target state");
+
+static_assert(AllPrograms([](State, State target, const TransitionProgram& program)
+                          {
+                              for (const auto& step : program)
+                              {
+                                  if (step.state != target && step.state != State::Opening && step.state != State::Closing)
+                                  {
+                                      return false;
+                                  }
+                              }
+                              return true;
+                          }),
+              "Only the Opening and Closing states may come before the target state");
+
+static_assert(AllPrograms([](State, State, const TransitionProgram& program)
+                          {
+                              for (const auto& step : program)
+                              {
+                                  if (step.delay <= Clock::Duration::zero())
+                                  {
+                                      return false;
+                                  }
+                              }
+                              return true;
+                          }),
+              "Every step must last for some time");
+
+static_assert(AllPrograms([](State, State, const TransitionProgram& program)
+                          {
+                              for (const auto& step : program)
+                              {
+                                  if (step.pattern[red] != Light::State::Off && step.pattern[green] != Light::State::Off)
+                                  {
+                                      return false;
+                                  }
+                              }
+                              return true;
+                          }),
+              "No step may show red and green at the same time");
+
+/* The longest step that an Emergency request has to wait for, which is any step but the last of a program */
+constexpr Clock::Duration LongestProtectedStep()
+{
+    Clock::Duration longest = Clock::Duration::zero();
+    AllPrograms([&longest](State, State, const TransitionProgram& program)
+                {
+                    for (std::size_t i = 0; i + 1 < program.Size(); ++i)
+                    {
+                        longest = std::max(longest, program[i].delay);
+                    }
+                    return true;
+                });
+    return longest;
+}
+
+constexpr Clock::Duration max_override_delay = LongestProtectedStep();
+}
+
+TrafficLight::TrafficLight::State TrafficLight::GetState() const
+{
+    return static_cast<State>(snapshot_.load(std::memory_order_acquire) & field_mask);
+}
+
+TrafficLight::Snapshot TrafficLight::GetSnapshot() const
+{
+    return UnpackSnapshot(snapshot_.load(std::memory_order_acquire));
+}
+
+std::uint64_t TrafficLight::PackSnapshot(const TrafficLight::Snapshot& snapshot)
+{
+    std::uint64_t packed = static_cast<std::uint64_t>(snapshot.sequence) << sequence_shift;
+    packed |= static_cast<std::uint64_t>(snapshot.state);
+    for (std::size_t i = 0; i < light_count; ++i)
+    {
+        packed |= static_cast<std::uint64_t>(snapshot.pattern[i]) << (field_bits * (i + 1));
+    }
+    return packed;
+}
+
+TrafficLight::Snapshot TrafficLight::UnpackSnapshot(std::uint64_t packed)
+{
+    Snapshot snapshot{static_cast<State>(packed & field_mask), {},
+                      static_cast<std::uint32_t>(packed >> sequence_shift)};
+    for (std::size_t i = 0; i < light_count; ++i)
+    {
+        snapshot.pattern[i] = static_cast<Light::State>((packed >> (field_bits * (i + 1))) & field_mask);
+    }
+    return snapshot;
+}
+
+/* Returns the sequence number of the new snapshot */
+std::uint32_t TrafficLight::StoreSnapshot(TrafficLight::State state, const TrafficLight::FixedLightPattern& pattern)
+{
+    auto sequence = static_cast<std::uint32_t>((snapshot_.load(std::memory_order_relaxed) >> sequence_shift) + 1);
+    std::uint64_t packed = PackSnapshot({state, pattern, sequence});
+    snapshot_.store(packed, std::memory_order_release);
+    BinaryLog::Default().Write(LogEvent::StateChanged, this, packed);
+    auto& publisher = SharedStatePublisher::Default();
+    if (publisher.Attach(shared_slot_))
+    {
+        SharedStatePublisher::Publish(shared_slot_, MakeRecord(state, pattern, sequence));
+    }
+    return sequence;
+}
+
+HistoryRecord TrafficLight::MakeRecord(TrafficLight::State state, const TrafficLight::FixedLightPattern& pattern,
+                                       std::uint32_t sequence) const
+{
+    HistoryRecord record{std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::steady_clock::now().time_since_epoch()).count(),
+                         clock_.Now().count(), sequence, static_cast<std::uint8_t>(state), {}};
+    std::transform(pattern.begin(), pattern.end(), record.pattern,
+                   [](Light::State light) { return static_cast<std::uint8_t>(light); });
+    return record;
+}
+
+void TrafficLight::Init(TrafficLight::State initial_state)
+{
+    MoveTo(initial_state);
 }
 
-void TrafficLight::PrepareTransition(State from_state, State target_state)
+bool TrafficLight::TransitToState(TrafficLight::State target_state)
 {
-    transition_sequence_.clear();
+    Snapshot snapshot = GetSnapshot();
+    if (snapshot.state == target_state)
+    {
+        return false;
+    }
+    State from_state = snapshot.state;
+    std::optional<State> passing;
     switch (target_state)
     {
         case State::Open:
-            transition_sequence_.push_back(
-                    {State::Open, {Light::State::Off, Light::State::Off, Light::State::On}, 3000});
+            passing = State::Opening;
             break;
         case State::Closed:
-            transition_sequence_.push_back(
-                    {State::Closing, {Light::State::Off, Light::State::On, Light::State::Off}, 2000});
-            transition_sequence_.push_back(
-                    {State::Closed, {Light::State::On, Light::State::Off, Light::State::Off}, 3000});
-            break;
-        case State::Warning:
-            transition_sequence_.push_back(
-                    {State::Warning, {Light::State::Off, Light::State::Flashing, Light::State::Off}, 3000});
-            break;
-        case State::Off:
-            transition_sequence_.push_back(
-                    {State::Off, {Light::State::Off, Light::State::Off, Light::State::Off}, 3000});
+            passing = State::Closing;
             break;
         default:
             break;
     }
+    if (passing)
+    {
+        StoreSnapshot(*passing, snapshot.pattern);
+        std::vector<WaitCallback> reached;
+        {
+            std::lock_guard<std::mutex> lock(transition_mutex_);
+            ReachState(*passing, reached);
+        }
+        for (auto& callback : reached)
+        {
+            callback(true);
+        }
+    }
+    transition_sequence_ = PlanTransition(from_state, target_state);
+    BinaryLog::Default().Write(LogEvent::TransitionStarted, this,
+                               static_cast<std::uint64_t>(from_state) |
+                               static_cast<std::uint64_t>(target_state) << field_bits);
+    return true;
+}
+
+TrafficLight::TransitionProgram TrafficLight::PrepareTransition(State from_state, State target_state)
+{
+    return DefaultProgram(from_state, target_state);
+}
+
+TrafficLight::TransitionProgram TrafficLight::PlanTransition(State from_state, State target_state)
+{
+    std::uint64_t generation;
+    {
+        const std::lock_guard<std::mutex> lock(plans_mutex_);
+        const auto& plan = plans_[static_cast<std::size_t>(from_state)][static_cast<std::size_t>(target_state)];
+        if (plan)
+        {
+            return *plan;
+        }
+        generation = plans_generation_;
+    }
+    /* Without the lock, so that an override can take other locks, such as the GIL, while InvalidatePlans waits for them */
+    TransitionProgram program = PrepareTransition(from_state, target_state);
+    const std::lock_guard<std::mutex> lock(plans_mutex_);
+    /* A program prepared before the plans were invalidated is used once, but not kept */
+    if (generation == plans_generation_)
+    {
+        plans_[static_cast<std::size_t>(from_state)][static_cast<std::size_t>(target_state)] = program;
+    }
+    return program;
+}
+
+void TrafficLight::InvalidatePlans()
+{
+    const std::lock_guard<std::mutex> lock(plans_mutex_);
+    for (auto& plans : plans_)
+    {
+        plans.fill(std::nullopt);
+    }
+    plans_generation_++;
+}
+
+Clock::Duration TrafficLight::MaxOverrideDelay()
+{
+    return max_override_delay;
 }
 
-void TrafficLight::TransitionRunner()
+const TrafficLight::TransitionProgram& TrafficLight::DefaultProgram(State from_state, State target_state)
+{
+    return transition_table[static_cast<std::size_t>(from_state)][static_cast<std::size_t>(target_state)];
+}
+
+void TrafficLight::StartNextTransition()
 {
-    State next_state;
     while (true)
     {
-        using namespace std::chrono_literals;
+        QueuedMove next;
         {
             std::unique_lock<std::mutex> lock(transition_mutex_);
-            while (transition_buffer_.empty())
+            if (transition_buffer_.empty())
             {
-                busy_ = false;
-                transition_cv.wait_for(lock, 1ms);
-                if (transition_buffer_.empty() && stop_transition_thread_.wait_for(1ms) != std::future_status::timeout)
+                auto callbacks = BecomeIdle();
+                lock.unlock();
+                for (auto& callback : callbacks)
                 {
-                    // thread has been asked to stop
-                    return;
+                    callback(true);
                 }
+                return;
             }
-            busy_ = true;
-            next_state = transition_buffer_.front();
+            next = transition_buffer_.front();
             transition_buffer_.pop();
+            current_target_ = next.state;
+            preempt_ = false;
+            queue_cv_.notify_all();
+        }
+        if constexpr (latency_stats_enabled)
+        {
+            stats_->queue_wait.Record(StatsTime() - next.requested);
+        }
+        if (TransitToState(next.state))
+        {
+            RunTransitionStep(0);
+            return;
+        }
+    }
+}
+
+void TrafficLight::RunTransitionStep(std::size_t step)
+{
+    if constexpr (latency_stats_enabled)
+    {
+        /* Every step but the first is run by the timer of the step before it */
+        if (step > 0)
+        {
+            stats_->step_jitter.Record(StatsTime() - step_due_);
+        }
+    }
+    /* An Emergency request, or the destructor, ends the transition once a step is over */
+    if (step == transition_sequence_.Size() || (step > 0 && (preempt_ || stopping_)))
+    {
+        StartNextTransition();
+        return;
+    }
+    auto const& [state, pattern, delay] = transition_sequence_[step];
+    SetLightPattern(state, pattern);
+    std::vector<WaitCallback> reached;
+    {
+        std::lock_guard<std::mutex> lock(transition_mutex_);
+        if (stopping_)
+        {
+            reached = BecomeIdle();
+        }
+        else
+        {
+            /* Only the last step can be cut short; if an Emergency request came in meanwhile, that is right away */
+            step_preemptible_ = step + 1 == transition_sequence_.Size();
+            auto step_delay = step_preemptible_ && preempt_ ? Clock::Duration::zero() : delay;
+            if constexpr (latency_stats_enabled)
+            {
+                step_due_ = StatsTime() + step_delay;
+            }
+            pending_step_ = clock_.Schedule(step_delay, [this, step]() { RunTransitionStep(step + 1); });
         }
-        TransitToState(next_state);
+        ReachState(state, reached);
+    }
+    for (auto& callback : reached)
+    {
+        callback(true);
     }
 }
 
-void TrafficLight::RunTransition()
+void TrafficLight::SetLightPattern(TrafficLight::State state, const TrafficLight::FixedLightPattern& pattern)
 {
-    for (auto const&[state, pattern, delay_ms] : transition_sequence_)
+    const std::lock_guard<std::mutex> lock(lights_mutex_);
+    driver_->Commit(pattern);
+    std::uint32_t sequence = StoreSnapshot(state, pattern);
+    if (history_)
+    {
+        history_->Record(MakeRecord(state, pattern, sequence));
+    }
+    for (auto& subscription : subscriptions_)
     {
-        current_state_ = state;
-        SetLightPatternAndWait(pattern, delay_ms);
+        subscription->Publish({state, pattern, clock_.Now()});
     }
 }
 
-void TrafficLight::SetLightPatternAndWait(TrafficLight::LightPattern pattern, int delay_ms)
+const std::vector<std::string>& TrafficLight::GetLightNames() const
+{
+    return light_names;
+}
+
+TrafficLight::LightPattern TrafficLight::GetLightPattern() const
+{
+    auto pattern = GetSnapshot().pattern;
+    return LightPattern(pattern.begin(), pattern.end());
+}
+
+void TrafficLight::AddCallback(const TrafficLight::CallbackFunction& func)
 {
-    SetLightPattern(std::move(pattern));
-    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+    Subscribe([func](TrafficLight* traffic_light, const std::vector<StateChange>&) { func(traffic_light); },
+              DeliveryPolicy::Keep);
 }
 
-void TrafficLight::SetLightPattern(TrafficLight::LightPattern pattern)
+std::shared_ptr<TrafficLight::Subscription> TrafficLight::Subscribe(const TrafficLight::BatchCallback& func,
+                                                                    DeliveryPolicy policy, std::size_t capacity)
 {
+    auto subscription = std::make_shared<Subscription>(
+            [this, func](const std::vector<StateChange>& changes) { func(this, changes); },
+            policy, capacity, clock_.IsSimulated() ? clock_ : Dispatcher(),
+            stats_ ? &stats_->callback_duration : nullptr);
     const std::lock_guard<std::mutex> lock(lights_mutex_);
-    auto value_iterator = pattern.begin();
-    std::for_each(lights_.begin(), lights_.end(), [&](auto& light) { light->SetState(*value_iterator++); });
-    for (auto& func : state_change_cb_list_)
+    subscriptions_.push_back(subscription);
+    return subscription;
+}
+
+void TrafficLight::Unsubscribe(const std::shared_ptr<TrafficLight::Subscription>& subscription)
+{
     {
-        RunCallbackFunction(func);
+        const std::lock_guard<std::mutex> lock(lights_mutex_);
+        auto found = std::find(subscriptions_.begin(), subscriptions_.end(), subscription);
+        if (found == subscriptions_.end())
+        {
+            return;
+        }
+        subscriptions_.erase(found);
     }
+    subscription->Close();
 }
 
-std::vector<std::string> TrafficLight::GetLightNames()
+std::shared_ptr<TransitionHistory> TrafficLight::EnableHistory(std::size_t capacity)
 {
-    return light_names;
+    auto history = std::make_shared<TransitionHistory>(capacity, clock_.IsSimulated() ? clock_ : Dispatcher());
+    const std::lock_guard<std::mutex> lock(lights_mutex_);
+    history_ = history;
+    return history;
 }
 
-TrafficLight::LightPattern TrafficLight::GetLightPattern()
+std::shared_ptr<TransitionHistory> TrafficLight::GetHistory()
 {
-    TrafficLight::LightPattern result = TrafficLight::LightPattern();
-    std::transform(lights_.begin(), lights_.end(), std::back_inserter(result),
-            [](auto& light) -> Light::State { return light->GetState(); });
-    return result;
+    const std::lock_guard<std::mutex> lock(lights_mutex_);
+    return history_;
 }
 
-void TrafficLight::AddCallback(const TrafficLight::CallbackFunction& func)
+const TrafficLight::LatencyStats* TrafficLight::GetLatencyStats() const
+{
+    return stats_.get();
+}
+
+void TrafficLight::WriteLatencyStats(const std::string& path, const std::map<std::string, std::string>& labels) const
+{
+    if (!stats_)
+    {
+        throw std::runtime_error("trafficlib is built without latency stats");
+    }
+    std::string temporary_path = path + ".tmp";
+    {
+        std::ofstream file(temporary_path, std::ios::trunc);
+        WritePrometheusHistogram(file, "traffic_light_queue_wait_seconds",
+                                 "Time from a MoveTo request to the start of its transition",
+                                 labels, stats_->queue_wait.Read());
+        WritePrometheusHistogram(file, "traffic_light_step_jitter_seconds",
+                                 "How much later than its delay a transition step ended",
+                                 labels, stats_->step_jitter.Read());
+        WritePrometheusHistogram(file, "traffic_light_callback_duration_seconds",
+                                 "Duration of the calls of the state change callbacks",
+                                 labels, stats_->callback_duration.Read());
+        if (!file.flush())
+        {
+            throw std::runtime_error("Cannot write the latency stats to " + temporary_path);
+        }
+    }
+    std::filesystem::rename(temporary_path, path);
+}
+
+std::vector<std::shared_ptr<TrafficLight::Subscription>> TrafficLight::CopySubscriptions()
 {
-    state_change_cb_list_.push_back(func);
+    const std::lock_guard<std::mutex> lock(lights_mutex_);
+    return subscriptions_;
 }
 
-void TrafficLight::RunCallbackFunction(const TrafficLight::CallbackFunction& func)
+Scheduler& TrafficLight::Dispatcher()
 {
-    func(this);
+    static Scheduler dispatcher(1);
+    return dispatcher;
 }
 
-void TrafficLight::MoveTo(TrafficLight::State target_state)
+TrafficLight::EnqueueResult TrafficLight::MoveTo(TrafficLight::State target_state, TrafficLight::Priority priority)
 {
+    auto result = EnqueueResult::Invalid;
     switch (target_state)
     {
         case State::Off:
         case State::Closed:
         case State::Open:
         case State::Warning:
-            AddStateToTransitionBuffer(target_state);
+            result = AddStateToTransitionBuffer(target_state, priority);
             break;
         default:
             /* Unsupported target states */
             break;
     }
+    BinaryLog::Default().Write(LogEvent::MoveRequested, this,
+                               static_cast<std::uint64_t>(target_state) |
+                               static_cast<std::uint64_t>(priority) << field_bits |
+                               static_cast<std::uint64_t>(result) << (2 * field_bits));
+    return result;
 }
 
-const std::vector<std::string> TrafficLight::light_names{"red", "amber", "green"};
+void TrafficLight::SetQueueConfig(const TrafficLight::QueueConfig& config)
+{
+    std::lock_guard<std::mutex> lock(transition_mutex_);
+    queue_config_ = config;
+    /* The request that starts an idle light waits in the queue too, so there must be room for one */
+    queue_config_.capacity = std::max<std::size_t>(queue_config_.capacity, 1);
+    queue_cv_.notify_all();
+}
+
+TrafficLight::QueueConfig TrafficLight::GetQueueConfig()
+{
+    std::lock_guard<std::mutex> lock(transition_mutex_);
+    return queue_config_;
+}
 
-void TrafficLight::AddStateToTransitionBuffer(TrafficLight::State state)
+std::size_t TrafficLight::QueueLength()
 {
     std::lock_guard<std::mutex> lock(transition_mutex_);
-    transition_buffer_.push(state);
-    transition_cv.notify_all();
+    return transition_buffer_.size();
+}
+
+const std::vector<std::string> TrafficLight::light_names{"red", "amber", "green"};
+
+/* The state the light ends up in when the queued requests are done, with transition_mutex_ held */
+TrafficLight::State TrafficLight::LastTarget() const
+{
+    if (!transition_buffer_.empty())
+    {
+        return transition_buffer_.back().state;
+    }
+    return busy_ ? current_target_ : GetState();
+}
+
+TrafficLight::EnqueueResult TrafficLight::AddStateToTransitionBuffer(TrafficLight::State state,
+                                                                    TrafficLight::Priority priority)
+{
+    std::unique_lock<std::mutex> lock(transition_mutex_);
+    if (stopping_)
+    {
+        return EnqueueResult::Rejected;
+    }
+    auto result = EnqueueResult::Queued;
+    if (priority == Priority::Emergency)
+    {
+        if (!transition_buffer_.empty())
+        {
+            std::queue<QueuedMove>().swap(transition_buffer_);
+            queue_cv_.notify_all();
+            result = EnqueueResult::Replaced;
+        }
+        if (busy_)
+        {
+            if (current_target_ == state)
+            {
+                /* An Emergency request before this one may have been dropped above: the running transition is the one to finish */
+                preempt_ = false;
+                return EnqueueResult::Coalesced;
+            }
+            transition_buffer_.push({state, latency_stats_enabled ? StatsTime() : std::chrono::nanoseconds::zero()});
+            preempt_ = true;
+            if (step_preemptible_ && clock_.Cancel(pending_step_))
+            {
+                step_preemptible_ = false;
+                pending_step_ = clock_.Schedule(Clock::Duration::zero(), [this]() { StartNextTransition(); });
+            }
+            return result;
+        }
+    }
+    else if (queue_config_.policy == QueuePolicy::LatestOnly && !transition_buffer_.empty())
+    {
+        std::queue<QueuedMove>().swap(transition_buffer_);
+        result = EnqueueResult::Replaced;
+    }
+    if (queue_config_.policy != QueuePolicy::Fifo && LastTarget() == state)
+    {
+        return EnqueueResult::Coalesced;
+    }
+    if (transition_buffer_.size() >= queue_config_.capacity)
+    {
+        if (queue_config_.overflow == OverflowPolicy::Reject || clock_.IsSimulated() ||
+            event_channel_detail::delivering || Scheduler::OnWorkerThread())
+        {
+            return EnqueueResult::Rejected;
+        }
+        auto has_room = [this]() { return stopping_ || transition_buffer_.size() < queue_config_.capacity; };
+        if (!WaitUntil(queue_cv_, lock, queue_config_.block_timeout, has_room))
+        {
+            return EnqueueResult::TimedOut;
+        }
+        if (stopping_)
+        {
+            return EnqueueResult::Rejected;
+        }
+        /* The queue moved on while this waited */
+        if (queue_config_.policy == QueuePolicy::Coalesce && LastTarget() == state)
+        {
+            return EnqueueResult::Coalesced;
+        }
+    }
+    transition_buffer_.push({state, latency_stats_enabled ? StatsTime() : std::chrono::nanoseconds::zero()});
+    if (!busy_)
+    {
+        busy_ = true;
+        step_preemptible_ = false;
+        pending_step_ = clock_.Schedule(Clock::Duration::zero(), [this]() { StartNextTransition(); });
+    }
+    return result;
 }
 
 bool TrafficLight::InTransition()
@@ -198,24 +718,92 @@ bool TrafficLight::InTransition()
     return busy_;
 }
 
-std::ostream& operator<<(std::ostream& out, TrafficLight::State state)
+/* Count a visit to state, with transition_mutex_ held, wake its waiters, and add the callbacks that waited for it to reached */
+void TrafficLight::ReachState(TrafficLight::State state, std::vector<WaitCallback>& reached)
+{
+    state_visits_[static_cast<std::size_t>(state)]++;
+    auto waiting = std::stable_partition(state_callbacks_.begin(), state_callbacks_.end(),
+                                         [state](const auto& callback) { return callback.first != state; });
+    std::for_each(waiting, state_callbacks_.end(), [&reached](auto& callback) { reached.push_back(std::move(callback.second)); });
+    state_callbacks_.erase(waiting, state_callbacks_.end());
+    idle_cv_.notify_all();
+}
+
+/* Mark the light idle, with transition_mutex_ held, and return the callbacks that waited for it */
+std::vector<TrafficLight::WaitCallback> TrafficLight::BecomeIdle()
 {
-    static std::map<TrafficLight::State, std::string> stateStrings;
-    if (stateStrings.empty())
+    busy_ = false;
+    idle_cv_.notify_all();
+    std::vector<WaitCallback> callbacks;
+    callbacks.swap(idle_callbacks_);
+    return callbacks;
+}
+
+template<typename Predicate>
+bool TrafficLight::WaitUntil(std::condition_variable& cv, std::unique_lock<std::mutex>& lock,
+                             std::optional<std::chrono::milliseconds> timeout, Predicate predicate)
+{
+    if (!timeout)
+    {
+        cv.wait(lock, predicate);
+        return true;
+    }
+    return cv.wait_for(lock, *timeout, predicate);
+}
+
+/* The time for the latency stats, which is the time of the clock if it is simulated */
+std::chrono::nanoseconds TrafficLight::StatsTime() const
+{
+    if (clock_.IsSimulated())
+    {
+        return clock_.Now();
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch());
+}
+
+bool TrafficLight::WaitIdle(std::optional<std::chrono::milliseconds> timeout)
+{
+    std::unique_lock<std::mutex> lock(transition_mutex_);
+    return WaitUntil(idle_cv_, lock, timeout, [this]() { return !busy_; });
+}
+
+bool TrafficLight::WaitForState(TrafficLight::State state, std::optional<std::chrono::milliseconds> timeout)
+{
+    std::unique_lock<std::mutex> lock(transition_mutex_);
+    auto visits = state_visits_[static_cast<std::size_t>(state)];
+    return WaitUntil(idle_cv_, lock, timeout, [this, state, visits]()
     {
-        auto extractEnumSymbol = [](const std::string& s)
+        return GetState() == state || state_visits_[static_cast<std::size_t>(state)] != visits;
+    });
+}
+
+void TrafficLight::NotifyWhenIdle(WaitCallback callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(transition_mutex_);
+        if (busy_)
+        {
+            idle_callbacks_.push_back(std::move(callback));
+            return;
+        }
+    }
+    callback(true);
+}
+
+void TrafficLight::NotifyWhenInState(TrafficLight::State state, WaitCallback callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(transition_mutex_);
+        if (GetState() != state)
         {
-            std::size_t last_colon = s.rfind(':');
-            return (last_colon == std::string::npos) ? s : s.substr(last_colon + 1);
-        };
-#define ADD_ENUM_STRING(x) stateStrings[x] = extractEnumSymbol(std::string(#x))
-        ADD_ENUM_STRING(TrafficLight::State::Off);
-        ADD_ENUM_STRING(TrafficLight::State::Closed);
-        ADD_ENUM_STRING(TrafficLight::State::Closing);
-        ADD_ENUM_STRING(TrafficLight::State::Open);
-        ADD_ENUM_STRING(TrafficLight::State::Opening);
-        ADD_ENUM_STRING(TrafficLight::State::Warning);
-#undef ADD_ENUM_STRING
+            state_callbacks_.emplace_back(state, std::move(callback));
+            return;
+        }
     }
-    return out << stateStrings[state];
+    callback(true);
+}
+
+std::ostream& operator<<(std::ostream& out, TrafficLight::State state)
+{
+    return out << TrafficLight::StateName(state);
 }
@@ -1,69 +1,410 @@
 #ifndef PYTHON_C_C_EXAMPLE_4_TRAFFIC_LIGHT_H
 #define PYTHON_C_C_EXAMPLE_4_TRAFFIC_LIGHT_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <condition_variable>
 #include <functional>
-#include <future>
+#include <initializer_list>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
+#include <stdexcept>
 #include <string>
-#include <thread>
+#include <string_view>
 #include <vector>
 
+#include "binary_log.h"
+#include "event_channel.h"
+#include "latency_stats.h"
 #include "light.h"
+#include "light_driver.h"
+#include "scheduler.h"
+#include "shared_state.h"
+#include "transition_history.h"
 
 class TrafficLight
 {
 public:
     using LightPattern = std::vector<Light::State>;
     using CallbackFunction = std::function<void(TrafficLight*)>;
-    using LightFactory = std::function<std::shared_ptr<Light>()>;
+    /* Called with whether the light got where it was waited for, which is false if it was destroyed first */
+    using WaitCallback = std::function<void(bool reached)>;
+    using LightFactory = PerLightDriver::LightFactory;
     static const std::vector<std::string> light_names;
+    static constexpr std::size_t light_count = 3;
 
-    enum class State {Off, Closing, Closed, Opening, Open, Warning};
+    using FixedLightPattern = LightDriver::Pattern;
+    static_assert(light_count == LightDriver::light_count, "A driver shows all lights of a traffic light");
 
-    explicit TrafficLight(State initial_state = State::Off);
+    /* One byte each, so that arrays of states are compact, as in TrafficLightGrid */
+    enum class State : std::uint8_t {Off, Closing, Closed, Opening, Open, Warning};
+    static constexpr std::size_t state_count = static_cast<std::size_t>(State::Warning) + 1;
+    static constexpr std::array<std::string_view, state_count> state_names{
+            "Off", "Closing", "Closed", "Opening", "Open", "Warning"};
+
+    static constexpr std::string_view StateName(State state)
+    {
+        return state_names[static_cast<std::size_t>(state)];
+    }
+
+    /* What MoveTo does with requests while a transition is running */
+    enum class QueuePolicy : std::uint8_t
+    {
+        /* Every request, in order */
+        Fifo,
+        /* Like Fifo, but a request for the target that the request before it leads to is dropped */
+        Coalesce,
+        /* Only the latest request, which replaces the one that is waiting, if any */
+        LatestOnly
+    };
+
+    /* What MoveTo does when the queue is full */
+    enum class OverflowPolicy : std::uint8_t {Reject, Block};
+
+    struct QueueConfig
+    {
+        static constexpr std::size_t unbounded = SIZE_MAX;
+
+        QueuePolicy policy = QueuePolicy::Fifo;
+        /* The number of requests that can wait for the running transition */
+        std::size_t capacity = unbounded;
+        OverflowPolicy overflow = OverflowPolicy::Reject;
+        /* How long Block waits for room, which is forever without a timeout */
+        std::optional<std::chrono::milliseconds> block_timeout;
+    };
+
+    /*
+     * An Emergency request replaces everything that is queued, and preempts the running transition:
+     * the step that shows the state the transition ends in is cut short, while the steps before it,
+     * such as Closing, always last their full time, so no safety phase is ever skipped.
+     */
+    enum class Priority : std::uint8_t {Normal, Emergency};
+
+    /* What happened to a MoveTo request */
+    enum class EnqueueResult : std::uint8_t
+    {
+        /* Added to the queue */
+        Queued,
+        /* Dropped, because the light already goes to the target */
+        Coalesced,
+        /* Added to the queue, instead of the request that was waiting */
+        Replaced,
+        /* Dropped, because the queue is full */
+        Rejected,
+        /* Dropped, because the queue stayed full until the timeout */
+        TimedOut,
+        /* Dropped, because the target is not a state a light can be moved to */
+        Invalid
+    };
+
+    /* One step of a transition: the state and pattern to show, and for how long */
+    struct TransitionStep
+    {
+        State state;
+        FixedLightPattern pattern;
+        Clock::Duration delay;
+    };
+
+    /* The steps of a transition, stored in place, so that running a transition allocates nothing */
+    class TransitionProgram
+    {
+    public:
+        static constexpr std::size_t max_steps = 4;
+
+        constexpr TransitionProgram() = default;
+
+        constexpr TransitionProgram(std::initializer_list<TransitionStep> steps)
+        {
+            for (const auto& step : steps)
+            {
+                Add(step);
+            }
+        }
+
+        /* Throws std::length_error when the program is full, which in a constant expression fails to compile */
+        constexpr void Add(const TransitionStep& step)
+        {
+            if (size_ == max_steps)
+            {
+                throw std::length_error("A transition program has at most max_steps steps");
+            }
+            steps_[size_++] = step;
+        }
+
+        constexpr std::size_t Size() const
+        {
+            return size_;
+        }
+
+        constexpr bool Empty() const
+        {
+            return size_ == 0;
+        }
+
+        constexpr const TransitionStep& operator[](std::size_t i) const
+        {
+            return steps_[i];
+        }
+
+        constexpr const TransitionStep* begin() const
+        {
+            return steps_.data();
+        }
+
+        constexpr const TransitionStep* end() const
+        {
+            return steps_.data() + size_;
+        }
+
+    private:
+        std::array<TransitionStep, max_steps> steps_{};
+        std::size_t size_ = 0;
+    };
+
+    /* Everything that can be observed of a traffic light, at one moment */
+    struct Snapshot
+    {
+        State state;
+        FixedLightPattern pattern;
+        /* Increases with every change of the state or the pattern */
+        std::uint32_t sequence;
+    };
+
+    /* Published whenever the light pattern changes, with the time of the change on the clock */
+    struct StateChange
+    {
+        State state;
+        FixedLightPattern pattern;
+        Clock::Duration time;
+    };
+    using Subscription = EventChannel<StateChange>;
+    using BatchCallback = std::function<void(TrafficLight*, const std::vector<StateChange>&)>;
+
+    /*
+     * How the transitions and deliveries of a traffic light keep up. The queue wait and the step jitter
+     * are measured on the clock if it is simulated, and in real time otherwise.
+     */
+    struct LatencyStats
+    {
+        /* From MoveTo to the start of the transition it requested */
+        LatencyHistogram queue_wait;
+        /* How much later than its delay says a step ended */
+        LatencyHistogram step_jitter;
+        /* How long every call of a subscriber callback took */
+        LatencyHistogram callback_duration;
+    };
+
+    /*
+     * A traffic light has no thread of its own: every step of a transition is a task
+     * on its clock, which schedules the next step when its delay has passed.
+     * An idle traffic light uses no CPU time. By default, the clock is the shared
+     * real-time Scheduler; with a SimulatedClock, the transitions run in virtual time.
+     * The clock must outlive the traffic light.
+     * The destructor drops the requested transitions and the deliveries that are still pending;
+     * it only waits for a step or a callback that is running at that moment. Use WaitIdle first
+     * to see the transitions through.
+     *
+     * State changes are delivered to the subscribers asynchronously, so a slow subscriber
+     * does not hold up the transitions. In real time, one dispatcher thread shared by
+     * all traffic lights runs the callbacks; with a simulated clock, they are tasks on
+     * the clock, due at the time of the change.
+     */
+    explicit TrafficLight(State initial_state = State::Off, Clock& clock = Scheduler::Default());
+    /* The lights are made by light_factory, and set one by one, as by default */
+    TrafficLight(State initial_state, Clock& clock, const LightFactory& light_factory);
+    /* The patterns are shown by driver, with one commit per transition step */
+    TrafficLight(State initial_state, Clock& clock, std::shared_ptr<LightDriver> driver);
     virtual ~TrafficLight();
-    virtual State GetState();
-    virtual std::vector<std::string> GetLightNames();
-    virtual LightPattern GetLightPattern();
-    virtual void MoveTo(State target_state);
+    /* The getters do not lock or allocate, except GetLightPattern, which returns a new vector */
+    virtual State GetState() const;
+    virtual Snapshot GetSnapshot() const;
+    virtual const std::vector<std::string>& GetLightNames() const;
+    virtual LightPattern GetLightPattern() const;
+    /*
+     * Request a transition to target_state, which runs after the requests before it, as the queue config says.
+     * Blocking only happens in real time, and never in a callback: with a simulated clock,
+     * or on a Scheduler thread, such as the dispatcher or the one that runs a NotifyWhen* callback,
+     * a full queue rejects the request, because blocking there could keep the room from being made.
+     * Emergency requests ignore the queue config, and never block.
+     */
+    virtual EnqueueResult MoveTo(State target_state, Priority priority = Priority::Normal);
+    /* Applies to the requests from now on; those that are waiting stay, even if there are more than capacity */
+    virtual void SetQueueConfig(const QueueConfig& config);
+    virtual QueueConfig GetQueueConfig();
+    /* The number of requests that wait for the running transition */
+    virtual std::size_t QueueLength();
+    /*
+     * Call func after state changes, once for every batch of them that is delivered, so it can
+     * read the latest state from the traffic light; no change goes without a call after it.
+     * Use Subscribe to see every change on its own.
+     */
     virtual void AddCallback(const CallbackFunction& func);
+    /*
+     * Call func with batches of the state changes since the previous call.
+     * When func falls behind by capacity changes, policy decides what it misses.
+     */
+    virtual std::shared_ptr<Subscription> Subscribe(const BatchCallback& func,
+                                                    DeliveryPolicy policy = DeliveryPolicy::Drop,
+                                                    std::size_t capacity = 64);
+    /* Stop the deliveries to a subscription, waiting for a running callback to return */
+    virtual void Unsubscribe(const std::shared_ptr<Subscription>& subscription);
     virtual bool InTransition();
 
+    /*
+     * Record every change of the light pattern in a history of the last capacity changes,
+     * replacing the history that was recorded before, if any. The history outlives the light
+     * for as long as it is referenced.
+     */
+    virtual std::shared_ptr<TransitionHistory> EnableHistory(std::size_t capacity = 4096);
+    /* The history, or nullptr if it is not enabled */
+    virtual std::shared_ptr<TransitionHistory> GetHistory();
+
+    /* The latency stats, or nullptr if trafficlib is built without TRAFFIC_LATENCY_STATS */
+    virtual const LatencyStats* GetLatencyStats() const;
+    /*
+     * Write the latency stats in the Prometheus text format, with labels on every sample.
+     * The file at path is replaced at once, so a collector never reads half of it.
+     * Throws std::runtime_error if the file cannot be written, or there are no stats.
+     */
+    virtual void WriteLatencyStats(const std::string& path, const std::map<std::string, std::string>& labels = {}) const;
+
+    /*
+     * Block until the light is idle: no transition is running or requested.
+     * With a timeout, which is in real time even if the clock is simulated,
+     * returns false if the light was not idle in time.
+     */
+    virtual bool WaitIdle(std::optional<std::chrono::milliseconds> timeout = std::nullopt);
+    /*
+     * Block until the light is in state, or has been in it since the call. A state that is only
+     * passed through, such as Closing, is seen too, even if it is over before the caller wakes up.
+     */
+    virtual bool WaitForState(State state, std::optional<std::chrono::milliseconds> timeout = std::nullopt);
+    /*
+     * Call callback once, when the light is idle or in state, with true. If it already is, callback is called
+     * right away; otherwise it is called by the clock task that gets it there, so it must not block.
+     * The destructor calls the callbacks that still wait for a state with false.
+     */
+    virtual void NotifyWhenIdle(WaitCallback callback);
+    virtual void NotifyWhenInState(State state, WaitCallback callback);
+
+    /*
+     * With the built-in transition table, the longest time until an Emergency request shows the first step
+     * towards its target, apart from the time the clock takes to run a task that is due
+     */
+    static Clock::Duration MaxOverrideDelay();
+
+    /*
+     * A snapshot packed in one word: the state in the lowest byte, a byte per light above it,
+     * and the sequence in the upper half. This is how a light stores its snapshot, and how it is logged.
+     */
+    static std::uint64_t PackSnapshot(const Snapshot& snapshot);
+    static Snapshot UnpackSnapshot(std::uint64_t packed);
+
+    /* The entry of the built-in transition table, which is empty if target_state cannot be moved to */
+    static const TransitionProgram& DefaultProgram(State from_state, State target_state);
+
+    /*
+     * Forget the programs that PrepareTransition returned, so it is called again for the transitions
+     * from now on. A transition that is running keeps its program.
+     */
+    virtual void InvalidatePlans();
+
 protected:
-    virtual void PrepareTransition(State from_state, State target_state);
+    /*
+     * The steps that move the light from from_state to target_state, which are the entry
+     * of the built-in transition table unless this is overridden. It is called on the
+     * clock, when a transition between the two states starts for the first time since
+     * the light was made or InvalidatePlans was called; the program is kept for the next ones.
+     * An override must not block. Whether a target can be moved to at all is decided by
+     * the built-in table, so an override cannot add transitions; it can return an empty program,
+     * which ends the transition right away.
+     */
+    virtual TransitionProgram PrepareTransition(State from_state, State target_state);
 
 private:
-    using TransitionElement = std::tuple<State, LightPattern, int>;
-    using TransitionSequence = std::vector<TransitionElement>;
+    /* A MoveTo request, with the time it was made for the latency stats */
+    struct QueuedMove
+    {
+        State state;
+        std::chrono::nanoseconds requested;
+    };
 
     void Init(State initial_state);
-    void RunCallbackFunction(const CallbackFunction& func);
-    void RunTransition();
-    void SetLightPattern(LightPattern pattern);
-    void SetLightPatternAndWait(LightPattern pattern, int delay_ms);
-    void TransitToState(State target_state);
-    void AddStateToTransitionBuffer(State state);
-    void TransitionRunner();
-
-    State current_state_;
-    std::vector<std::unique_ptr<Light>> lights_;
-    std::vector<CallbackFunction> state_change_cb_list_;
-    TransitionSequence transition_sequence_;
-    std::thread transition_thread_;
+    void StartNextTransition();
+    void RunTransitionStep(std::size_t step);
+    void SetLightPattern(State state, const FixedLightPattern& pattern);
+    std::uint32_t StoreSnapshot(State state, const FixedLightPattern& pattern);
+    /* A record of a change to state and pattern, at the time of the call */
+    HistoryRecord MakeRecord(State state, const FixedLightPattern& pattern, std::uint32_t sequence) const;
+    bool TransitToState(State target_state);
+    /* The cached program from from_state to target_state, after calling PrepareTransition if there is none */
+    TransitionProgram PlanTransition(State from_state, State target_state);
+    EnqueueResult AddStateToTransitionBuffer(State state, Priority priority);
+    State LastTarget() const;
+    std::vector<std::shared_ptr<Subscription>> CopySubscriptions();
+    void ReachState(State state, std::vector<WaitCallback>& reached);
+    std::vector<WaitCallback> BecomeIdle();
+    template<typename Predicate>
+    bool WaitUntil(std::condition_variable& cv, std::unique_lock<std::mutex>& lock,
+                   std::optional<std::chrono::milliseconds> timeout, Predicate predicate);
+    std::chrono::nanoseconds StatsTime() const;
+
+    /* The clock that runs the deliveries to subscribers */
+    static Scheduler& Dispatcher();
+
+    Clock& clock_;
+    /*
+     * The snapshot, packed by PackSnapshot so it can be read without locking.
+     * Only the task that runs the current transition step writes it.
+     */
+    std::atomic<std::uint64_t> snapshot_;
+    const std::shared_ptr<LightDriver> driver_;
+    /* Where the snapshot is published to other processes, while SharedStatePublisher::Default is open */
+    SharedStatePublisher::Slot shared_slot_;
+    std::vector<std::shared_ptr<Subscription>> subscriptions_;
+    std::shared_ptr<TransitionHistory> history_;
+    TransitionProgram transition_sequence_;
+    /* The programs returned by PrepareTransition, by from and target state, and how often they were invalidated */
+    std::mutex plans_mutex_;
+    std::array<std::array<std::optional<TransitionProgram>, state_count>, state_count> plans_;
+    std::uint64_t plans_generation_;
     std::mutex lights_mutex_;
-    std::queue<State> transition_buffer_;
+    std::queue<QueuedMove> transition_buffer_;
+    QueueConfig queue_config_;
+    /* The target of the running transition */
+    State current_target_;
     std::mutex transition_mutex_;
-    std::condition_variable transition_cv;
-    std::promise<void> stop_signal_;
-    std::future<void> stop_transition_thread_;
-    bool busy_;
+    /* Signalled when a request leaves the queue, for MoveTo calls that block */
+    std::condition_variable queue_cv_;
+    /* Signalled when the light becomes idle, or a step shows a new state */
+    std::condition_variable idle_cv_;
+    /* How often each state was shown by a step, and the callbacks that wait for a state, or for idle */
+    std::array<std::uint64_t, state_count> state_visits_;
+    std::vector<std::pair<State, WaitCallback>> state_callbacks_;
+    std::vector<WaitCallback> idle_callbacks_;
+    Clock::TimerId pending_step_;
+    /* Whether the pending step may be cancelled by an Emergency request */
+    bool step_preemptible_;
+    std::atomic<bool> busy_;
+    /* Set by an Emergency request, to end the running transition after its current step */
+    std::atomic<bool> preempt_;
+    /* Set by the destructor, to stop scheduling steps */
+    std::atomic<bool> stopping_;
+    /* The time at which the pending step is due, for the step jitter */
+    std::chrono::nanoseconds step_due_;
+    const std::unique_ptr<LatencyStats> stats_;
 
 };
 
+static_assert(sizeof(HistoryRecord::pattern) == TrafficLight::light_count,
+              "A history record has the state of every light");
+
 std::ostream& operator<<(std::ostream& out, TrafficLight::State state);
 
 #endif //PYTHON_C_C_EXAMPLE_4_TRAFFIC_LIGHT_H
@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "traffic_light_grid.h"
+
+TrafficLightGrid::TrafficLightGrid(std::size_t size, Clock& clock) :
+        clock_(clock),
+        size_(size),
+        mutex_(),
+        states_(size, State::Off),
+        patterns_(size * TrafficLight::light_count, Light::State::Off),
+        deadlines_(size, no_deadline),
+        from_states_(size, State::Off),
+        targets_(size, State::Off),
+        steps_(size, 0),
+        queued_targets_(size, State::Off),
+        in_transition_(0),
+        timer_(0),
+        timer_generation_(0),
+        timer_deadline_(no_deadline),
+        timer_tasks_(0),
+        timers_cv_(),
+        stopping_(false)
+{
+}
+
+TrafficLightGrid::~TrafficLightGrid()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+    if (timer_deadline_ != no_deadline && clock_.Cancel(timer_))
+    {
+        timer_tasks_--;
+    }
+    timers_cv_.wait(lock, [this]() { return timer_tasks_ == 0; });
+}
+
+std::size_t TrafficLightGrid::Size() const
+{
+    return size_;
+}
+
+void TrafficLightGrid::MoveTo(std::span<const std::size_t> indices, TrafficLightGrid::State target_state)
+{
+    for (auto index : indices)
+    {
+        if (index >= size_)
+        {
+            throw std::out_of_range("Traffic light " + std::to_string(index) + " is not in the grid");
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::int64_t now = clock_.Now().count();
+    std::int64_t earliest = no_deadline;
+    for (auto index : indices)
+    {
+        if (deadlines_[index] != no_deadline)
+        {
+            queued_targets_[index] = target_state;
+        }
+        else if (StartTransition(index, target_state, now))
+        {
+            in_transition_++;
+            earliest = std::min(earliest, deadlines_[index]);
+        }
+    }
+    ScheduleTimer(earliest);
+}
+
+TrafficLightGrid::State TrafficLightGrid::GetState(std::size_t index) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return states_.at(index);
+}
+
+TrafficLight::FixedLightPattern TrafficLightGrid::GetLightPattern(std::size_t index) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (index >= size_)
+    {
+        throw std::out_of_range("Traffic light " + std::to_string(index) + " is not in the grid");
+    }
+    TrafficLight::FixedLightPattern pattern;
+    std::copy_n(patterns_.begin() + index * pattern.size(), pattern.size(), pattern.begin());
+    return pattern;
+}
+
+std::size_t TrafficLightGrid::CountInState(TrafficLightGrid::State state) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::count(states_.begin(), states_.end(), state);
+}
+
+bool TrafficLightGrid::InTransition() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_transition_ > 0;
+}
+
+const TrafficLightGrid::State* TrafficLightGrid::States() const
+{
+    return states_.data();
+}
+
+const Light::State* TrafficLightGrid::LightPatterns() const
+{
+    return patterns_.data();
+}
+
+const std::int64_t* TrafficLightGrid::Deadlines() const
+{
+    return deadlines_.data();
+}
+
+const TrafficLight::TransitionProgram& TrafficLightGrid::Program(std::size_t index) const
+{
+    return TrafficLight::DefaultProgram(from_states_[index], targets_[index]);
+}
+
+/* Returns false, leaving the light as it is, if there is no transition to target_state */
+bool TrafficLightGrid::StartTransition(std::size_t index, TrafficLightGrid::State target_state, std::int64_t start)
+{
+    if (TrafficLight::DefaultProgram(states_[index], target_state).Empty())
+    {
+        return false;
+    }
+    from_states_[index] = states_[index];
+    targets_[index] = target_state;
+    queued_targets_[index] = target_state;
+    steps_[index] = 0;
+    ApplyStep(index, start);
+    return true;
+}
+
+void TrafficLightGrid::ApplyStep(std::size_t index, std::int64_t start)
+{
+    const auto& step = Program(index)[steps_[index]];
+    states_[index] = step.state;
+    std::copy(step.pattern.begin(), step.pattern.end(), patterns_.begin() + index * step.pattern.size());
+    deadlines_[index] = start + step.delay.count();
+}
+
+/* Go on from a step whose deadline has passed, counting from that deadline rather than from now */
+void TrafficLightGrid::NextStep(std::size_t index)
+{
+    std::int64_t deadline = deadlines_[index];
+    steps_[index]++;
+    if (steps_[index] < Program(index).Size())
+    {
+        ApplyStep(index, deadline);
+    }
+    else if (!StartTransition(index, queued_targets_[index], deadline))
+    {
+        deadlines_[index] = no_deadline;
+        in_transition_--;
+    }
+}
+
+void TrafficLightGrid::Advance(std::uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    timer_tasks_--;
+    if (stopping_)
+    {
+        timers_cv_.notify_all();
+        return;
+    }
+    if (generation == timer_generation_)
+    {
+        timer_deadline_ = no_deadline;
+    }
+
+    std::int64_t now = clock_.Now().count();
+    std::int64_t earliest = no_deadline;
+    for (std::size_t index = 0; index < size_; ++index)
+    {
+        while (deadlines_[index] <= now)
+        {
+            NextStep(index);
+        }
+        earliest = std::min(earliest, deadlines_[index]);
+    }
+    ScheduleTimer(earliest);
+}
+
+/* Make sure the timer is due no later than deadline */
+void TrafficLightGrid::ScheduleTimer(std::int64_t deadline)
+{
+    if (stopping_ || deadline >= timer_deadline_)
+    {
+        return;
+    }
+    if (timer_deadline_ != no_deadline && clock_.Cancel(timer_))
+    {
+        timer_tasks_--;
+    }
+    std::uint64_t generation = ++timer_generation_;
+    timer_deadline_ = deadline;
+    timer_tasks_++;
+    auto delay = Clock::Duration(std::max<std::int64_t>(deadline - clock_.Now().count(), 0));
+    timer_ = clock_.Schedule(delay, [this, generation]() { Advance(generation); });
+}
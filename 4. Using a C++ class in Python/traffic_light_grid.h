@@ -0,0 +1,97 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_TRAFFIC_LIGHT_GRID_H
+#define PYTHON_C_C_EXAMPLE_4_TRAFFIC_LIGHT_GRID_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <vector>
+
+#include "clock.h"
+#include "light.h"
+#include "scheduler.h"
+#include "traffic_light.h"
+
+/*
+ * A fixed number of traffic lights, stored as struct of arrays rather than as one object per light,
+ * so that scanning or moving many lights at once goes through contiguous memory.
+ *
+ * The lights follow the built-in transition table of TrafficLight. A light that is in transition
+ * finishes it first; of the targets that are requested meanwhile, only the last one is kept.
+ * One timer on the clock serves the whole grid: it is due at the earliest deadline, and then
+ * advances every light whose deadline has passed.
+ *
+ * The getters lock the grid, but the arrays can also be read directly, e.g. as numpy views;
+ * the values then change while they are read, but every element is always a valid value.
+ * Unlike TrafficLight, a grid has no callbacks, and its destructor abandons the transitions
+ * that are in progress. The clock must outlive the grid.
+ */
+class TrafficLightGrid
+{
+public:
+    using State = TrafficLight::State;
+
+    /* The deadline of a light that is not in transition */
+    static constexpr std::int64_t no_deadline = INT64_MAX;
+
+    explicit TrafficLightGrid(std::size_t size, Clock& clock = Scheduler::Default());
+    ~TrafficLightGrid();
+    TrafficLightGrid(const TrafficLightGrid&) = delete;
+    TrafficLightGrid& operator=(const TrafficLightGrid&) = delete;
+
+    std::size_t Size() const;
+
+    /* Move the lights at indices to target. Throws std::out_of_range, before moving any, for a bad index. */
+    void MoveTo(std::span<const std::size_t> indices, State target_state);
+
+    State GetState(std::size_t index) const;
+    TrafficLight::FixedLightPattern GetLightPattern(std::size_t index) const;
+    std::size_t CountInState(State state) const;
+    bool InTransition() const;
+
+    /* One state per light */
+    const State* States() const;
+    /* light_count light states per light, one light after the other */
+    const Light::State* LightPatterns() const;
+    /* The time on the clock, in milliseconds, at which the current step of each light ends */
+    const std::int64_t* Deadlines() const;
+
+private:
+    const TrafficLight::TransitionProgram& Program(std::size_t index) const;
+    bool StartTransition(std::size_t index, State target_state, std::int64_t start);
+    void ApplyStep(std::size_t index, std::int64_t start);
+    void NextStep(std::size_t index);
+    void Advance(std::uint64_t generation);
+    void ScheduleTimer(std::int64_t deadline);
+
+    Clock& clock_;
+    const std::size_t size_;
+
+    /* The arrays, written under mutex_ */
+    mutable std::mutex mutex_;
+    std::vector<State> states_;
+    std::vector<Light::State> patterns_;
+    std::vector<std::int64_t> deadlines_;
+    /* The state each transition started from, its target, and its current step */
+    std::vector<State> from_states_;
+    std::vector<State> targets_;
+    std::vector<std::uint8_t> steps_;
+    /* The target requested during a transition, or the current target if there is none */
+    std::vector<State> queued_targets_;
+    std::size_t in_transition_;
+
+    /*
+     * The timer for the earliest deadline, with a generation that tells it apart from
+     * timers that were replaced, but could not be cancelled anymore.
+     * The destructor waits until none of the timer tasks that refer to the grid are left.
+     */
+    Clock::TimerId timer_;
+    std::uint64_t timer_generation_;
+    std::int64_t timer_deadline_;
+    std::size_t timer_tasks_;
+    std::condition_variable timers_cv_;
+    bool stopping_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_TRAFFIC_LIGHT_GRID_H
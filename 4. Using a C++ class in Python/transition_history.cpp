@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "transition_history.h"
+
+namespace
+{
+std::atomic_ref<std::uint32_t> SequenceOf(HistoryRecord& record)
+{
+    return std::atomic_ref<std::uint32_t>(record.sequence);
+}
+}
+
+TransitionHistory::TransitionHistory(std::size_t capacity, Clock& spill_clock) :
+        capacity_(std::max<std::size_t>(capacity, 2)),
+        spill_clock_(spill_clock),
+        records_(std::make_unique<HistoryRecord[]>(capacity_)),
+        head_(0),
+        spill_mutex_(),
+        file_(),
+        spilling_(false),
+        spilled_(0),
+        spill_scheduled_(false),
+        lost_(0)
+{
+}
+
+TransitionHistory::~TransitionHistory()
+{
+    Flush();
+}
+
+void TransitionHistory::Record(const HistoryRecord& record)
+{
+    std::uint64_t head = head_.load(std::memory_order_relaxed);
+    HistoryRecord& slot = records_[head % capacity_];
+    SequenceOf(slot).store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(&slot, &record, offsetof(HistoryRecord, sequence));
+    std::memcpy(&slot.state, &record.state, sizeof(HistoryRecord) - offsetof(HistoryRecord, state));
+    SequenceOf(slot).store(record.sequence, std::memory_order_release);
+    head_.store(head + 1, std::memory_order_release);
+
+    if (spilling_ && head + 1 - spilled_ >= capacity_ / 2 && !spill_scheduled_.exchange(true))
+    {
+        spill_clock_.Schedule(Clock::Duration::zero(), [self = shared_from_this()]() { self->Spill(); });
+    }
+}
+
+std::size_t TransitionHistory::Capacity() const
+{
+    return capacity_;
+}
+
+std::uint64_t TransitionHistory::Head() const
+{
+    return head_.load(std::memory_order_acquire);
+}
+
+const HistoryRecord* TransitionHistory::Records() const
+{
+    return records_.get();
+}
+
+/* Copy the record at index, and return whether it was still there, unchanged, all along */
+bool TransitionHistory::CopyRecord(std::uint64_t index, HistoryRecord& record) const
+{
+    HistoryRecord& slot = records_[index % capacity_];
+    std::uint32_t before = SequenceOf(slot).load(std::memory_order_acquire);
+    std::memcpy(&record, &slot, sizeof(HistoryRecord));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    std::uint32_t after = SequenceOf(slot).load(std::memory_order_relaxed);
+    return before != 0 && before == after && head_.load(std::memory_order_acquire) - index <= capacity_;
+}
+
+std::vector<HistoryRecord> TransitionHistory::Read() const
+{
+    std::uint64_t head = Head();
+    std::uint64_t first = head > capacity_ ? head - capacity_ : 0;
+    std::vector<HistoryRecord> records;
+    records.reserve(head - first);
+    HistoryRecord record;
+    for (std::uint64_t index = first; index < head; ++index)
+    {
+        if (CopyRecord(index, record))
+        {
+            records.push_back(record);
+        }
+    }
+    return records;
+}
+
+void TransitionHistory::SpillTo(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(spill_mutex_);
+    if (file_.is_open())
+    {
+        file_.close();
+    }
+    file_.open(path, std::ios::binary | std::ios::app);
+    if (!file_)
+    {
+        throw std::runtime_error("Cannot open " + path + " to spill the transition history");
+    }
+    if (file_.tellp() == 0)
+    {
+        HistoryFileHeader header{{}, file_version, sizeof(HistoryRecord)};
+        std::memcpy(header.magic, file_magic, sizeof(header.magic));
+        file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    spilled_ = Head();
+    spilling_ = true;
+}
+
+void TransitionHistory::Flush()
+{
+    Spill();
+    std::lock_guard<std::mutex> lock(spill_mutex_);
+    if (file_.is_open())
+    {
+        file_.flush();
+    }
+}
+
+std::uint64_t TransitionHistory::Lost() const
+{
+    return lost_;
+}
+
+void TransitionHistory::Spill()
+{
+    {
+        std::lock_guard<std::mutex> lock(spill_mutex_);
+        if (file_.is_open())
+        {
+            std::uint64_t head = Head();
+            std::uint64_t first = spilled_;
+            if (head - first > capacity_)
+            {
+                lost_ += head - capacity_ - first;
+                first = head - capacity_;
+            }
+            std::vector<HistoryRecord> records;
+            records.reserve(head - first);
+            HistoryRecord record;
+            for (std::uint64_t index = first; index < head; ++index)
+            {
+                if (CopyRecord(index, record))
+                {
+                    records.push_back(record);
+                }
+                else
+                {
+                    lost_++;
+                }
+            }
+            file_.write(reinterpret_cast<const char*>(records.data()),
+                        static_cast<std::streamsize>(records.size() * sizeof(HistoryRecord)));
+            spilled_ = head;
+        }
+    }
+    spill_scheduled_ = false;
+}
+
+std::vector<HistoryRecord> TransitionHistory::ReadFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    HistoryFileHeader header{};
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, file_magic, sizeof(header.magic)) != 0 ||
+        header.version != file_version || header.record_size != sizeof(HistoryRecord))
+    {
+        throw std::runtime_error(path + " is not a transition history file");
+    }
+    std::vector<HistoryRecord> records;
+    HistoryRecord record;
+    while (file.read(reinterpret_cast<char*>(&record), sizeof(record)))
+    {
+        records.push_back(record);
+    }
+    return records;
+}
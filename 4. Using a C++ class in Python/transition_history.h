@@ -0,0 +1,109 @@
+#ifndef PYTHON_C_C_EXAMPLE_4_TRANSITION_HISTORY_H
+#define PYTHON_C_C_EXAMPLE_4_TRANSITION_HISTORY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "clock.h"
+
+/*
+ * One change of the state and light pattern of a traffic light.
+ * The layout is fixed, without padding, so that the records can be viewed as a numpy
+ * structured array and written to disk as they are.
+ */
+struct HistoryRecord
+{
+    /* steady_clock time of the change */
+    std::int64_t time_ns;
+    /* Time of the change on the clock of the traffic light, which may be simulated */
+    std::int64_t clock_ms;
+    /* The sequence number of the snapshot of the traffic light, which is never 0 */
+    std::uint32_t sequence;
+    /* TrafficLight::State */
+    std::uint8_t state;
+    /* Light::State of red, amber and green */
+    std::uint8_t pattern[3];
+};
+
+static_assert(sizeof(HistoryRecord) == 24, "HistoryRecord must not have padding");
+
+/*
+ * The file format of a spilled history: this header, followed by the records.
+ * Both are in the byte order of the machine that wrote them.
+ */
+struct HistoryFileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t record_size;
+};
+
+/*
+ * The last changes of a traffic light, in a fixed-capacity ring buffer.
+ *
+ * Only one thread at a time records, which is the clock task that runs the transition,
+ * so recording needs no lock. Readers do not lock either: every slot works as a seqlock,
+ * whose sequence is 0 while the slot is written, so a copy that was overwritten while it
+ * was made is recognised and skipped.
+ *
+ * Optionally, the records are also appended to a file. Writing the file is a task on
+ * the spill clock, scheduled whenever half of the ring has not been written yet;
+ * if it falls behind by more than the capacity, the records it missed are counted as lost.
+ */
+class TransitionHistory : public std::enable_shared_from_this<TransitionHistory>
+{
+public:
+    static constexpr char file_magic[8] = {'T', 'L', 'H', 'I', 'S', 'T', '\0', '\0'};
+    static constexpr std::uint32_t file_version = 1;
+
+    TransitionHistory(std::size_t capacity, Clock& spill_clock);
+    /* Writes the records that have not been spilled yet */
+    ~TransitionHistory();
+    TransitionHistory(const TransitionHistory&) = delete;
+    TransitionHistory& operator=(const TransitionHistory&) = delete;
+
+    void Record(const HistoryRecord& record);
+
+    std::size_t Capacity() const;
+    /* The number of records written since the history was created; the newest is at (Head() - 1) % Capacity() */
+    std::uint64_t Head() const;
+    /* The ring buffer itself, in which records can change while they are read */
+    const HistoryRecord* Records() const;
+    /* A consistent copy of the records in the ring, oldest first */
+    std::vector<HistoryRecord> Read() const;
+
+    /* Append the records from now on to the file at path, which is created if needed. Throws std::runtime_error. */
+    void SpillTo(const std::string& path);
+    /* Write the records that have not been spilled yet, and flush the file */
+    void Flush();
+    /* The number of records that were overwritten before they could be spilled */
+    std::uint64_t Lost() const;
+
+    /* Read a file written by a spilling history. Throws std::runtime_error for a file in another format. */
+    static std::vector<HistoryRecord> ReadFile(const std::string& path);
+
+private:
+    bool CopyRecord(std::uint64_t index, HistoryRecord& record) const;
+    void Spill();
+
+    const std::size_t capacity_;
+    Clock& spill_clock_;
+    std::unique_ptr<HistoryRecord[]> records_;
+    std::atomic<std::uint64_t> head_;
+
+    /* The file, and the index of the first record that has not been written to it */
+    std::mutex spill_mutex_;
+    std::ofstream file_;
+    std::atomic<bool> spilling_;
+    std::atomic<std::uint64_t> spilled_;
+    std::atomic<bool> spill_scheduled_;
+    std::atomic<std::uint64_t> lost_;
+};
+
+#endif //PYTHON_C_C_EXAMPLE_4_TRANSITION_HISTORY_H
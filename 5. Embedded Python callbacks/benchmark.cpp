@@ -0,0 +1,92 @@
+/*
+ * Throughput of Python callbacks called from several C++ threads,
+ * with a CallbackHost that shares the GIL of the main interpreter,
+ * versus one with a subinterpreter (and, on Python 3.12+, a GIL) per worker.
+ */
+#include <Python.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "callback_host.h"
+#include "spamlib.h"
+
+namespace
+{
+const char* script = R"(
+def subtract(x, y):
+    return x - y
+
+
+def spin(x, y):
+    total = 0
+    for i in range(x):
+        total += i * y
+    return total % 1000003
+)";
+
+/* Calls operation(a, b) from the given number of threads for duration, and returns the calls per second */
+double calls_per_second(const std::function<int(int, int)>& operation, int a, int b, std::size_t threads,
+                        std::chrono::milliseconds duration)
+{
+    std::atomic<bool> stop(false);
+    std::atomic<long> calls(0);
+    std::vector<std::thread> callers;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < threads; ++i)
+    {
+        callers.emplace_back([&]()
+        {
+            long count = 0;
+            while (!stop)
+            {
+                do_operation(a, b, operation);
+                count++;
+            }
+            calls += count;
+        });
+    }
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (auto& caller : callers)
+    {
+        caller.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(calls) / elapsed.count();
+}
+}
+
+int main()
+{
+    /* Python is initialized here, so that all hosts below share one runtime */
+    Py_InitializeEx(0);
+    PyThreadState* main_state = PyEval_SaveThread();
+
+    std::size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    printf("%zu hardware threads, subinterpreters %s their own GIL\n", hardware_threads,
+           CallbackHost::SubinterpretersHaveOwnGil() ? "have" : "do not have");
+
+    for (auto mode : {CallbackHost::Mode::SharedGil, CallbackHost::Mode::Subinterpreters})
+    {
+        for (std::size_t threads : {1, 2, 4, 8})
+        {
+            CallbackHost host(threads, mode);
+            host.LoadScript("benchmark", script);
+            const char* mode_name = host.GetMode() == CallbackHost::Mode::Subinterpreters ? "subinterpreters" : "shared GIL";
+            double trivial = calls_per_second(host.Operation("benchmark", "subtract"), 3, 5, threads,
+                                              std::chrono::milliseconds(500));
+            double busy = calls_per_second(host.Operation("benchmark", "spin"), 1000, 3, threads,
+                                           std::chrono::milliseconds(500));
+            printf("%-16s threads=%-3zu subtract %12.0f calls/s    spin(1000) %10.0f calls/s\n",
+                   mode_name, threads, trivial, busy);
+        }
+    }
+
+    PyEval_RestoreThread(main_state);
+    Py_FinalizeEx();
+    return 0;
+}
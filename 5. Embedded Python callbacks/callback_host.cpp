@@ -0,0 +1,520 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <marshal.h>
+
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <sstream>
+
+#include "callback_host.h"
+
+#if PY_VERSION_HEX >= 0x030C0000
+#define CALLBACK_HOST_OWN_GIL
+#endif
+
+struct CallbackHost::Request
+{
+    std::size_t callback;
+    int a;
+    int b;
+    std::promise<int> result;
+};
+
+/*
+ * What one interpreter has loaded. It is only used by the workers of that
+ * interpreter, while they hold its GIL.
+ */
+struct CallbackHost::InterpreterCache
+{
+    /*
+     * Held while a script is executed, which can release the GIL, so that the other
+     * workers of the interpreter wait for the script instead of seeing half of it.
+     * It is only waited for with the GIL released.
+     */
+    std::mutex loading;
+    /* The globals of every script that has been executed completely in the interpreter */
+    std::map<std::string, PyObject*> namespaces;
+    /* The function of every callback, by index; nullptr if it was not looked up yet */
+    std::vector<PyObject*> functions;
+
+    void Clear()
+    {
+        for (PyObject* function : functions)
+        {
+            Py_XDECREF(function);
+        }
+        functions.clear();
+        for (auto& entry : namespaces)
+        {
+            Py_DECREF(entry.second);
+        }
+        namespaces.clear();
+    }
+};
+
+namespace
+{
+/* Describe and clear the current Python exception */
+std::string fetch_error()
+{
+    PyObject* type;
+    PyObject* value;
+    PyObject* traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    PyErr_NormalizeException(&type, &value, &traceback);
+    std::string message = "unknown Python error";
+    if (type != nullptr)
+    {
+        message = reinterpret_cast<PyTypeObject*>(type)->tp_name;
+        PyObject* text = value ? PyObject_Str(value) : nullptr;
+        const char* utf8 = text ? PyUnicode_AsUTF8(text) : nullptr;
+        if (utf8 != nullptr && *utf8 != '\0')
+        {
+            message += std::string(": ") + utf8;
+        }
+        Py_XDECREF(text);
+        PyErr_Clear();
+    }
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(traceback);
+    return message;
+}
+
+/* Number of requests that a worker runs per GIL acquisition, with a shared GIL; see WorkerLoop */
+constexpr std::size_t shared_gil_batch_size = 16;
+
+/*
+ * Whether the calling thread holds a GIL. PyGILState_Check cannot tell once there
+ * are subinterpreters, as it then always succeeds; from Python 3.12 on, the
+ * current thread state is per thread, and tells instead.
+ */
+bool holds_gil()
+{
+#if PY_VERSION_HEX >= 0x030D0000
+    return PyThreadState_GetUnchecked() != nullptr;
+#elif defined(CALLBACK_HOST_OWN_GIL)
+    return _PyThreadState_UncheckedGet() != nullptr;
+#else
+    return PyGILState_Check();
+#endif
+}
+
+/*
+ * Releases the GIL for the lifetime of the object, if the calling thread holds it.
+ * A caller that holds the GIL while it waits for the workers would keep them from running.
+ */
+class ReleaseGilIfHeld
+{
+public:
+    ReleaseGilIfHeld() : state_(holds_gil() ? PyEval_SaveThread() : nullptr) {}
+    ~ReleaseGilIfHeld()
+    {
+        if (state_ != nullptr)
+        {
+            PyEval_RestoreThread(state_);
+        }
+    }
+    ReleaseGilIfHeld(const ReleaseGilIfHeld&) = delete;
+    ReleaseGilIfHeld& operator=(const ReleaseGilIfHeld&) = delete;
+
+private:
+    PyThreadState* state_;
+};
+}
+
+CallbackHost::CallbackHost(std::size_t workers, CallbackHost::Mode mode) :
+        mode_(mode),
+        owns_python_(false),
+        main_thread_state_(nullptr),
+        scripts_mutex_(),
+        scripts_(),
+        callbacks_(),
+        queue_mutex_(),
+        queue_cv_(),
+        queue_(),
+        stop_(false),
+        caches_(),
+        workers_()
+{
+#ifndef CALLBACK_HOST_OWN_GIL
+    mode_ = Mode::SharedGil;
+#endif
+    workers = std::max<std::size_t>(workers, 1);
+    if (!Py_IsInitialized())
+    {
+        Py_InitializeEx(0);
+        owns_python_ = true;
+        /* The workers need the GIL of the main interpreter to start */
+        main_thread_state_ = PyEval_SaveThread();
+    }
+
+    std::size_t caches = mode_ == Mode::Subinterpreters ? workers : 1;
+    for (std::size_t i = 0; i < caches; ++i)
+    {
+        caches_.emplace_back(std::make_unique<InterpreterCache>());
+    }
+    std::vector<std::future<void>> started;
+    for (std::size_t i = 0; i < workers; ++i)
+    {
+        auto promise = std::make_shared<std::promise<void>>();
+        started.push_back(promise->get_future());
+        InterpreterCache* cache = caches_[mode_ == Mode::Subinterpreters ? i : 0].get();
+        workers_.emplace_back(&CallbackHost::WorkerLoop, this, cache, [promise](std::exception_ptr error)
+        {
+            if (error)
+            {
+                promise->set_exception(error);
+            }
+            else
+            {
+                promise->set_value();
+            }
+        });
+    }
+
+    std::exception_ptr error;
+    {
+        ReleaseGilIfHeld release;
+        for (auto& worker_started : started)
+        {
+            try
+            {
+                worker_started.get();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error)
+    {
+        Shutdown();
+        std::rethrow_exception(error);
+    }
+}
+
+CallbackHost::~CallbackHost()
+{
+    Shutdown();
+}
+
+void CallbackHost::Shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        if (stop_)
+        {
+            return;
+        }
+        stop_ = true;
+    }
+    queue_cv_.notify_all();
+    {
+        ReleaseGilIfHeld release;
+        for (auto& worker : workers_)
+        {
+            worker.join();
+        }
+    }
+
+    PyGILState_STATE gil = PyGILState_Ensure();
+    if (mode_ == Mode::SharedGil)
+    {
+        caches_[0]->Clear();
+    }
+    PyGILState_Release(gil);
+    if (owns_python_)
+    {
+        PyEval_RestoreThread(main_thread_state_);
+        Py_FinalizeEx();
+    }
+}
+
+void CallbackHost::LoadScript(const std::string& name, const std::string& source)
+{
+    PyGILState_STATE gil = PyGILState_Ensure();
+    std::string marshalled;
+    std::string error;
+    PyObject* code = Py_CompileString(source.c_str(), name.c_str(), Py_file_input);
+    PyObject* bytes = code ? PyMarshal_WriteObjectToString(code, Py_MARSHAL_VERSION) : nullptr;
+    if (bytes != nullptr)
+    {
+        marshalled.assign(PyBytes_AS_STRING(bytes), static_cast<std::size_t>(PyBytes_GET_SIZE(bytes)));
+    }
+    else
+    {
+        error = fetch_error();
+    }
+    Py_XDECREF(bytes);
+    Py_XDECREF(code);
+    PyGILState_Release(gil);
+    if (!error.empty())
+    {
+        throw PythonError(error);
+    }
+
+    std::lock_guard<std::mutex> lock(scripts_mutex_);
+    if (!scripts_.emplace(name, std::move(marshalled)).second)
+    {
+        throw std::invalid_argument("script '" + name + "' is already loaded");
+    }
+}
+
+void CallbackHost::LoadScriptFile(const std::string& name, const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("cannot open '" + path + "'");
+    }
+    std::ostringstream source;
+    source << file.rdbuf();
+    LoadScript(name, source.str());
+}
+
+std::function<int(int, int)> CallbackHost::Operation(const std::string& script, const std::string& function)
+{
+    std::size_t callback;
+    {
+        std::lock_guard<std::mutex> lock(scripts_mutex_);
+        if (scripts_.find(script) == scripts_.end())
+        {
+            throw std::invalid_argument("script '" + script + "' is not loaded");
+        }
+        auto existing = std::find_if(callbacks_.begin(), callbacks_.end(), [&](const Callback& entry)
+        {
+            return entry.script == script && entry.function == function;
+        });
+        callback = static_cast<std::size_t>(existing - callbacks_.begin());
+        if (existing == callbacks_.end())
+        {
+            callbacks_.push_back({script, function});
+        }
+    }
+    return [this, callback](int a, int b) { return Call(callback, a, b); };
+}
+
+CallbackHost::Mode CallbackHost::GetMode() const
+{
+    return mode_;
+}
+
+std::size_t CallbackHost::Size() const
+{
+    return workers_.size();
+}
+
+bool CallbackHost::SubinterpretersHaveOwnGil()
+{
+#ifdef CALLBACK_HOST_OWN_GIL
+    return true;
+#else
+    return false;
+#endif
+}
+
+int CallbackHost::Call(std::size_t callback, int a, int b)
+{
+    Request request{callback, a, b, {}};
+    std::future<int> result = request.result.get_future();
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        queue_.push_back(&request);
+    }
+    queue_cv_.notify_one();
+
+    {
+        ReleaseGilIfHeld release;
+        result.wait();
+    }
+    return result.get();
+}
+
+PyObject* CallbackHost::LookupCallback(CallbackHost::InterpreterCache& cache, std::size_t callback)
+{
+    if (callback < cache.functions.size() && cache.functions[callback] != nullptr)
+    {
+        return cache.functions[callback];
+    }
+
+    Callback target;
+    std::string marshalled;
+    {
+        std::lock_guard<std::mutex> lock(scripts_mutex_);
+        target = callbacks_[callback];
+        marshalled = scripts_.at(target.script);
+    }
+
+    std::unique_lock<std::mutex> loading(cache.loading, std::defer_lock);
+    Py_BEGIN_ALLOW_THREADS
+    loading.lock();
+    Py_END_ALLOW_THREADS
+    if (callback < cache.functions.size() && cache.functions[callback] != nullptr)
+    {
+        /* Another worker on this interpreter stored it while this one waited */
+        return cache.functions[callback];
+    }
+    auto loaded = cache.namespaces.find(target.script);
+    if (loaded == cache.namespaces.end())
+    {
+        /* Unmarshalling the cached code object is all that is left of loading the script */
+        PyObject* code = PyMarshal_ReadObjectFromString(marshalled.data(), static_cast<Py_ssize_t>(marshalled.size()));
+        PyObject* name = PyUnicode_FromString(target.script.c_str());
+        PyObject* globals = PyDict_New();
+        PyObject* result = nullptr;
+        if (code != nullptr && name != nullptr && globals != nullptr &&
+            PyDict_SetItemString(globals, "__name__", name) == 0 &&
+            PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins()) == 0)
+        {
+            result = PyEval_EvalCode(code, globals, globals);
+        }
+        Py_XDECREF(result);
+        Py_XDECREF(name);
+        Py_XDECREF(code);
+        if (result == nullptr)
+        {
+            /* Not cached, so the next call executes the script again */
+            std::string error = fetch_error();
+            Py_XDECREF(globals);
+            throw PythonError(error);
+        }
+        loaded = cache.namespaces.emplace(target.script, globals).first;
+    }
+    PyObject* globals = loaded->second;
+
+    /* Still under the loading lock, so only one worker stores the function and its reference */
+    PyObject* function = PyDict_GetItemString(globals, target.function.c_str());
+    if (function == nullptr || !PyCallable_Check(function))
+    {
+        throw PythonError("script '" + target.script + "' has no function '" + target.function + "'");
+    }
+    if (cache.functions.size() <= callback)
+    {
+        cache.functions.resize(callback + 1, nullptr);
+    }
+    Py_INCREF(function);
+    cache.functions[callback] = function;
+    return function;
+}
+
+void CallbackHost::RunRequest(CallbackHost::InterpreterCache& cache, CallbackHost::Request& request)
+{
+    try
+    {
+        PyObject* function = LookupCallback(cache, request.callback);
+        PyObject* args[2] = {PyLong_FromLong(request.a), PyLong_FromLong(request.b)};
+        PyObject* result = nullptr;
+        if (args[0] != nullptr && args[1] != nullptr)
+        {
+#if PY_VERSION_HEX >= 0x03090000
+            result = PyObject_Vectorcall(function, args, 2, nullptr);
+#else
+            result = PyObject_CallFunctionObjArgs(function, args[0], args[1], nullptr);
+#endif
+        }
+        Py_XDECREF(args[0]);
+        Py_XDECREF(args[1]);
+        if (result == nullptr)
+        {
+            throw PythonError(fetch_error());
+        }
+        long value = PyLong_AsLong(result);
+        Py_DECREF(result);
+        if (value == -1 && PyErr_Occurred())
+        {
+            throw PythonError(fetch_error());
+        }
+        if (value < INT_MIN || value > INT_MAX)
+        {
+            throw PythonError("callback result " + std::to_string(value) + " does not fit in an int");
+        }
+        request.result.set_value(static_cast<int>(value));
+    }
+    catch (...)
+    {
+        request.result.set_exception(std::current_exception());
+    }
+}
+
+void CallbackHost::WorkerLoop(CallbackHost::InterpreterCache* cache, std::function<void(std::exception_ptr)> started)
+{
+    PyThreadState* main_state = PyThreadState_New(PyInterpreterState_Main());
+    PyEval_RestoreThread(main_state);
+    PyThreadState* state = main_state;
+
+#ifdef CALLBACK_HOST_OWN_GIL
+    if (mode_ == Mode::Subinterpreters)
+    {
+        PyInterpreterConfig config = {
+                .use_main_obmalloc = 0,
+                .allow_fork = 0,
+                .allow_exec = 0,
+                .allow_threads = 1,
+                .allow_daemon_threads = 0,
+                .check_multi_interp_extensions = 1,
+                .gil = PyInterpreterConfig_OWN_GIL,
+        };
+        PyThreadState* interpreter_state = nullptr;
+        PyStatus status = Py_NewInterpreterFromConfig(&interpreter_state, &config);
+        if (PyStatus_Exception(status))
+        {
+            PyThreadState_Clear(main_state);
+            PyThreadState_DeleteCurrent();
+            started(std::make_exception_ptr(PythonError(
+                    std::string("cannot create a subinterpreter: ") + (status.err_msg ? status.err_msg : "unknown error"))));
+            return;
+        }
+        state = interpreter_state;
+    }
+#endif
+    PyEval_SaveThread();
+    started(nullptr);
+
+    /*
+     * With a shared GIL, a worker runs a batch of queued requests each time it
+     * takes the GIL. A subinterpreter does not compete for its GIL, so there a
+     * worker takes one request at a time, leaving the rest to the other workers.
+     */
+    std::size_t batch_size = mode_ == Mode::SharedGil ? shared_gil_batch_size : 1;
+    std::vector<Request*> batch;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            queue_cv_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+            if (queue_.empty())
+            {
+                break;
+            }
+            while (!queue_.empty() && batch.size() < batch_size)
+            {
+                batch.push_back(queue_.front());
+                queue_.pop_front();
+            }
+        }
+        PyEval_RestoreThread(state);
+        for (Request* request : batch)
+        {
+            RunRequest(*cache, *request);
+        }
+        PyEval_SaveThread();
+        batch.clear();
+    }
+
+    if (state != main_state)
+    {
+#ifdef CALLBACK_HOST_OWN_GIL
+        PyEval_RestoreThread(state);
+        cache->Clear();
+        Py_EndInterpreter(state);
+#endif
+    }
+    PyEval_RestoreThread(main_state);
+    PyThreadState_Clear(main_state);
+    PyThreadState_DeleteCurrent();
+}
@@ -0,0 +1,112 @@
+#ifndef PYTHON_C_CPP_CALLBACK_HOST_H
+#define PYTHON_C_CPP_CALLBACK_HOST_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* PyObject and PyThreadState, without including Python.h */
+struct _object;
+struct _ts;
+
+/* Thrown when compiling a script, or calling a Python callback, raises a Python exception */
+class PythonError : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/*
+ * Runs Python functions as callbacks for C++ code that embeds Python.
+ *
+ * A script is compiled once, when it is loaded, and its code object is cached
+ * in marshalled form. The callbacks run on a pool of worker threads:
+ * - Mode::Subinterpreters gives every worker its own subinterpreter, which on
+ *   Python 3.12 and later also has its own GIL, so callbacks from several C++
+ *   threads run in parallel. Each subinterpreter executes the cached code once,
+ *   and keeps the resulting functions.
+ * - Mode::SharedGil lets all workers use the main interpreter, so only one
+ *   callback runs at a time. This is also what Mode::Subinterpreters falls back
+ *   to on Python versions before 3.12.
+ *
+ * If Python is not initialized yet, the host initializes it, and finalizes it
+ * again when it is destroyed; only one such host can exist at a time.
+ */
+class CallbackHost
+{
+public:
+    enum class Mode
+    {
+        SharedGil,
+        Subinterpreters
+    };
+
+    explicit CallbackHost(std::size_t workers = std::thread::hardware_concurrency(),
+                          Mode mode = Mode::Subinterpreters);
+    ~CallbackHost();
+    CallbackHost(const CallbackHost&) = delete;
+    CallbackHost& operator=(const CallbackHost&) = delete;
+
+    /* Compile a script, which is then known by name. Throws PythonError for a syntax error. */
+    void LoadScript(const std::string& name, const std::string& source);
+    void LoadScriptFile(const std::string& name, const std::string& path);
+
+    /*
+     * An operation for do_operation that calls a function of a loaded script.
+     * Calling it blocks until a worker has run the function, and throws PythonError
+     * if the function raises an exception or does not return an int.
+     * The operation must not be used after the host is destroyed.
+     */
+    std::function<int(int, int)> Operation(const std::string& script, const std::string& function);
+
+    /* The mode that is actually used, which may differ from the requested one */
+    Mode GetMode() const;
+    std::size_t Size() const;
+
+    /* Whether subinterpreters have their own GIL, i.e. whether this is Python 3.12 or later */
+    static bool SubinterpretersHaveOwnGil();
+
+private:
+    struct Callback
+    {
+        std::string script;
+        std::string function;
+    };
+
+    struct Request;
+    struct InterpreterCache;
+
+    int Call(std::size_t callback, int a, int b);
+    void Shutdown();
+    void WorkerLoop(InterpreterCache* cache, std::function<void(std::exception_ptr)> started);
+    void RunRequest(InterpreterCache& cache, Request& request);
+    _object* LookupCallback(InterpreterCache& cache, std::size_t callback);
+
+    Mode mode_;
+    bool owns_python_;
+    _ts* main_thread_state_;
+
+    /* Marshalled code objects, and the callbacks, by index */
+    std::mutex scripts_mutex_;
+    std::map<std::string, std::string> scripts_;
+    std::vector<Callback> callbacks_;
+
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+    std::deque<Request*> queue_;
+    bool stop_;
+
+    std::vector<std::unique_ptr<InterpreterCache>> caches_;
+    std::vector<std::thread> workers_;
+};
+
+#endif //PYTHON_C_CPP_CALLBACK_HOST_H
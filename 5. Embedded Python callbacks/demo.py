@@ -0,0 +1,31 @@
+"""Callbacks for the main executable, which loads this script into a CallbackHost.
+
+The host runs the script in each of its interpreters with __name__ set to 'demo',
+so the code at the bottom only runs when the script is started directly.
+"""
+
+
+def subtract(x, y):
+    return x - y
+
+
+def collatz_steps(x, y):
+    """A callback that does some actual work: the number of Collatz steps from x to 1, plus y"""
+    steps = 0
+    while x > 1:
+        x = x // 2 if x % 2 == 0 else 3 * x + 1
+        steps += 1
+    return steps + y
+
+
+def divide(x, y):
+    return x // y
+
+
+if __name__ == '__main__':
+    x = 3
+    y = 5
+    print(f"x = {x}, y = {y}")
+    print(f"subtract({x}, {y}) gives {subtract(x, y)}")
+    total = sum(collatz_steps(i, 0) for i in range(1, 4001))
+    print(f"collatz_steps for 1..4000 sum to {total}")
@@ -0,0 +1,55 @@
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "callback_host.h"
+#include "spamlib.h"
+
+int main()
+{
+    CallbackHost host;
+    printf("Callback host with %zu workers, using %s\n", host.Size(),
+           host.GetMode() == CallbackHost::Mode::Subinterpreters ? "subinterpreters" : "a shared GIL");
+
+    /* The script is compiled here, once; the workers only execute the compiled code */
+    host.LoadScriptFile("demo", "demo.py");
+
+    int x = 3;
+    int y = 5;
+    printf("x = %d, y = %d\n", x, y);
+
+    int result = do_operation(x, y, host.Operation("demo", "subtract"));
+    printf("do_operation(%d, %d, demo.subtract) gives %d\n", x, y, result);
+
+    /* C++ threads can call Python callbacks at the same time */
+    auto collatz_steps = host.Operation("demo", "collatz_steps");
+    std::atomic<long> total(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            for (int i = t * 1000 + 1; i <= (t + 1) * 1000; ++i)
+            {
+                total += do_operation(i, 0, collatz_steps);
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    printf("do_operation(i, 0, demo.collatz_steps) from 4 threads, for 1..4000, sums to %ld\n", total.load());
+
+    try
+    {
+        do_operation(x, 0, host.Operation("demo", "divide"));
+    }
+    catch (const PythonError& e)
+    {
+        printf("do_operation(%d, 0, demo.divide) raises %s\n", x, e.what());
+    }
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+#include "spamlib.h"
+
+int add(int a, int b)
+{
+    return a + b;
+}
+
+void swap(int& a, int& b)
+{
+    int tmp = a;
+    a = b;
+    b = tmp;
+}
+
+int do_operation(int a, int b, const std::function<int(int, int)>& operator_func)
+{
+    return operator_func(a, b);
+}
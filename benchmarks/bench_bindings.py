@@ -0,0 +1,179 @@
+"""Measure the call overhead of the spam module for each way it is bound to Python.
+
+Every binding builds a module called 'spam', so each one is measured in its own
+subprocess, started in the build directory of that binding. Timing follows the
+approach of pyperf: the loop count is calibrated so that one sample takes at
+least --min-time seconds, a warmup sample is discarded, and the statistics of
+the remaining samples are reported. With more than one thread, all threads run
+the same statement at the same time, and ns/call is the wall-clock time divided
+by the total number of calls.
+
+Results, including the C++ baseline from bench_native, are written as JSON.
+"""
+import argparse
+import datetime
+import json
+import os
+import platform
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import timeit
+
+SETUP = """
+import spam
+
+
+def subtract(x, y):
+    return x - y
+"""
+
+SCALAR_BENCHMARKS = [
+    ("add", "spam.add(3, 5)"),
+    ("swap", "spam.swap(3, 5)"),
+    ("do_operation/python_callback", "spam.do_operation(3, 5, subtract)"),
+]
+
+# The ctypes binding has no registry of native operations,
+# but its do_operation accepts a ctypes pointer to the C function add
+NATIVE_CALLBACK = {
+    "ctypes": ("import ctypes\nnative = ctypes.cast(spam._spam.add, spam._operation_functype)",
+               "spam._spam.do_operation(3, 5, native)"),
+    "default": ("native = spam.ops.add", "spam.do_operation(3, 5, native)"),
+}
+
+ARRAY_SIZES = [1, 100, 10000]
+
+
+def benchmarks_for(binding):
+    import spam
+    result = [(name, SETUP, statement, 1) for name, statement in SCALAR_BENCHMARKS]
+    native_setup, native_statement = NATIVE_CALLBACK.get(binding, NATIVE_CALLBACK["default"])
+    result.append(("do_operation/native_callback", SETUP + native_setup, native_statement, 1))
+    if hasattr(spam, "add_arrays"):
+        for size in ARRAY_SIZES:
+            array_setup = SETUP + f"import array\nx = array.array('i', range({size}))\nout = array.array('i', x)"
+            result.append((f"add_arrays/{size}", array_setup, "spam.add_arrays(x, x, out)", size))
+    return result
+
+
+def calibrate(timer, min_time):
+    loops = 1
+    while True:
+        if timer.timeit(loops) >= min_time or loops >= 1 << 30:
+            return loops
+        loops *= 2
+
+
+def sample(setup, statement, loops, threads):
+    """Run the statement loops times in each thread, and return the wall-clock seconds"""
+    timers = [timeit.Timer(statement, setup) for _ in range(threads)]
+    barrier = threading.Barrier(threads + 1)
+    done = threading.Barrier(threads + 1)
+
+    def run(timer):
+        barrier.wait()
+        timer.timeit(loops)
+        done.wait()
+
+    workers = [threading.Thread(target=run, args=(timer,)) for timer in timers]
+    for worker in workers:
+        worker.start()
+    barrier.wait()
+    start = timeit.default_timer()
+    done.wait()
+    elapsed = timeit.default_timer() - start
+    for worker in workers:
+        worker.join()
+    return elapsed
+
+
+def run_worker(binding, args):
+    sys.path.insert(0, os.getcwd())
+    results = []
+    for name, setup, statement, elements in benchmarks_for(binding):
+        loops = calibrate(timeit.Timer(statement, setup), args.min_time)
+        for threads in args.threads:
+            sample(setup, statement, loops, threads)  # warmup
+            samples = [sample(setup, statement, loops, threads) / (loops * threads) * 1e9
+                       for _ in range(args.samples)]
+            results.append({
+                "binding": binding,
+                "name": name,
+                "threads": threads,
+                "elements_per_call": elements,
+                "loops": loops,
+                "ns_per_call": {
+                    "mean": statistics.mean(samples),
+                    "median": statistics.median(samples),
+                    "stdev": statistics.stdev(samples) if len(samples) > 1 else 0.0,
+                    "min": min(samples),
+                },
+                "samples": samples,
+            })
+    json.dump(results, sys.stdout)
+
+
+def run_binding(binding, directory, args):
+    command = [sys.executable, os.path.abspath(__file__), "--worker", binding,
+               "--samples", str(args.samples), "--min-time", str(args.min_time),
+               "--threads", *map(str, args.threads)]
+    completed = subprocess.run(command, cwd=directory, stdout=subprocess.PIPE, check=True)
+    return json.loads(completed.stdout)
+
+
+def run_native(executable):
+    with tempfile.TemporaryDirectory() as directory:
+        output = os.path.join(directory, "native.json")
+        subprocess.run([executable, output], check=True)
+        with open(output) as f:
+            return json.load(f)
+
+
+def print_summary(results):
+    for result in results:
+        print(f"{result['binding']:<10} {result['name']:<30} threads={result['threads']:<3}"
+              f"{result['ns_per_call']['median']:12.1f} ns/call")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--binding", action="append", default=[], metavar="NAME=BUILD_DIR",
+                        help="binding to measure, and the build directory containing its spam module")
+    parser.add_argument("--native", help="path of the bench_native executable")
+    parser.add_argument("--output", default="benchmark_results.json", help="JSON file for the results")
+    parser.add_argument("--samples", type=int, default=10)
+    parser.add_argument("--min-time", type=float, default=0.01, help="minimum duration of one sample in seconds")
+    parser.add_argument("--threads", type=int, nargs="+", default=[1, 2, 4])
+    parser.add_argument("--worker", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.worker:
+        run_worker(args.worker, args)
+        return
+
+    results = []
+    for binding in args.binding:
+        name, directory = binding.split("=", 1)
+        results.extend(run_binding(name, directory, args))
+    print_summary(results)
+
+    report = {
+        "metadata": {
+            "date": datetime.datetime.now(datetime.timezone.utc).isoformat(),
+            "python": sys.version,
+            "platform": platform.platform(),
+            "cpu_count": os.cpu_count(),
+        },
+        "benchmarks": results,
+        "native": run_native(args.native) if args.native else None,
+    }
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent=2)
+    print(f"Results written to {args.output}")
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,142 @@
+/*
+ * C++ baseline for the binding benchmarks: the spamlib calls made by the demo
+ * executables, timed without any Python in between.
+ * The output follows the JSON layout of Google Benchmark, so the same tooling
+ * can read both; Google Benchmark itself is not needed to build this.
+ */
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "spamlib.h"
+
+namespace
+{
+/* Prevents the compiler from optimizing away a computed value */
+template<typename T>
+void DoNotOptimize(T& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : "+m"(value) : : "memory");
+#else
+    volatile T sink = value;
+    (void) sink;
+#endif
+}
+
+struct Benchmark
+{
+    std::string name;
+    std::function<void(std::size_t iterations)> body;
+};
+
+struct Result
+{
+    std::string name;
+    std::size_t iterations;
+    double ns_per_iteration;
+};
+
+/* Doubles the iteration count until one run takes at least min_time, like Google Benchmark */
+Result Run(const Benchmark& benchmark, std::chrono::nanoseconds min_time = std::chrono::milliseconds(200))
+{
+    std::size_t iterations = 1;
+    while (true)
+    {
+        auto start = std::chrono::steady_clock::now();
+        benchmark.body(iterations);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed >= min_time || iterations >= (std::size_t(1) << 40))
+        {
+            auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+            return {benchmark.name, iterations, ns / static_cast<double>(iterations)};
+        }
+        iterations *= 2;
+    }
+}
+
+int subtract(int x, int y)
+{
+    return x - y;
+}
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> xs(10000, 3);
+    std::vector<int> ys(10000, 5);
+    std::vector<int> out(10000);
+
+    std::vector<Benchmark> benchmarks{
+            {"add", [](std::size_t n)
+            {
+                int x = 3;
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    int result = add(x, 5);
+                    DoNotOptimize(result);
+                }
+            }},
+            {"swap", [](std::size_t n)
+            {
+                int x = 3;
+                int y = 5;
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    swap(x, y);
+                    DoNotOptimize(x);
+                }
+            }},
+            {"do_operation/native_callback", [](std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    int result = do_operation(3, 5, subtract);
+                    DoNotOptimize(result);
+                }
+            }},
+            {"do_operation/registry", [](std::size_t n)
+            {
+                operation_func sub = find_operation("sub");
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    int result = do_operation(3, 5, sub);
+                    DoNotOptimize(result);
+                }
+            }},
+            {"add_arrays/10000", [&](std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    add_arrays(xs.data(), ys.data(), out.data(), xs.size());
+                    DoNotOptimize(out[0]);
+                }
+            }},
+    };
+
+    FILE* output = argc > 1 ? std::fopen(argv[1], "w") : stdout;
+    if (output == nullptr)
+    {
+        std::perror(argv[1]);
+        return 1;
+    }
+    std::fprintf(output, "{\n  \"context\": {\"library\": \"spamlib\", \"array_kernel\": \"%s\"},\n",
+                 array_kernel_name());
+    std::fprintf(output, "  \"benchmarks\": [\n");
+    for (std::size_t i = 0; i < benchmarks.size(); ++i)
+    {
+        Result result = Run(benchmarks[i]);
+        std::fprintf(output,
+                     "    {\"name\": \"%s\", \"iterations\": %zu, \"real_time\": %.3f, \"time_unit\": \"ns\"}%s\n",
+                     result.name.c_str(), result.iterations, result.ns_per_iteration,
+                     i + 1 < benchmarks.size() ? "," : "");
+    }
+    std::fprintf(output, "  ]\n}\n");
+    if (output != stdout)
+    {
+        std::fclose(output);
+    }
+    return 0;
+}